@@ -0,0 +1,154 @@
+#ifndef BODYPOSE_CPP_
+#define BODYPOSE_CPP_
+#include "Kinematics.cpp"
+#include <string.h>
+
+// Hip axis positions in the body frame (mm; x forwards, y left, z up, origin at the body centre)
+#define BODY_HIP_FRONT_X 60.0f
+#define BODY_HIP_FRONT_Y 40.0f
+#define BODY_HIP_MIDDLE_Y 50.0f
+#define BODY_HIP_BACK_X -60.0f
+#define BODY_HIP_BACK_Y 40.0f
+// Direction of each leg's x axis (hip angle 0), in degrees from straight out sideways, positive forwards
+#define BODY_MOUNT_FRONT_DEG 0.0f
+#define BODY_MOUNT_MIDDLE_DEG 0.0f
+#define BODY_MOUNT_BACK_DEG 0.0f
+
+#define BODY_LEG_NUM 6
+
+/**
+ * Maps foot positions between the world, the body and the legs' frames
+ * for a body pose. The body's pose in the world is one 4x4 rigid
+ * transform; the feet stay where they are in the world, so moving the
+ * body moves every foot the opposite way in its leg's frame.
+ *
+ * Legs are in Spider's LEG_ID order (RF RM RB LF LM LB). Each leg frame
+ * has x outwards and y forwards for either side, matching LegIK and the
+ * hip angle convention of the gaits (a positive hip angle swings forwards).
+ * The per-tick path works on fixed IK_BATCH-lane arrays and allocates
+ * nothing.
+ */
+class BodyKinematics
+{
+public:
+	typedef struct
+	{
+		float x, y, z;          // Translation of the body, mm
+		float roll, pitch, yaw; // Rotation about x, then y, then z, degrees
+	} Pose;
+
+	// Foot positions of every leg in the world frame, one lane per leg
+	typedef struct
+	{
+		float x[IK_BATCH];
+		float y[IK_BATCH];
+		float z[IK_BATCH];
+	} Feet;
+
+private:
+	// Hip position and the body-frame directions of the leg frame's x and y axes
+	float m_hipX[IK_BATCH], m_hipY[IK_BATCH];
+	float m_ux[IK_BATCH], m_uy[IK_BATCH];
+	float m_vx[IK_BATCH], m_vy[IK_BATCH];
+
+	void setMount(int leg, float hipX, float hipY, float mountDeg, bool left)
+	{
+		// Straight out is +y for left legs and -y for right legs; forwards is +x for both
+		float a = mountDeg / IK_RAD_TO_DEG;
+		float side = left ? 1.0f : -1.0f;
+		m_hipX[leg] = hipX;
+		m_hipY[leg] = side * hipY;
+		m_ux[leg] = sinf(a);
+		m_uy[leg] = side * cosf(a);
+		m_vx[leg] = cosf(a);
+		m_vy[leg] = -side * sinf(a);
+	}
+
+public:
+	BodyKinematics()
+	{
+		setMount(0, BODY_HIP_FRONT_X, BODY_HIP_FRONT_Y, BODY_MOUNT_FRONT_DEG, false);
+		setMount(1, 0, BODY_HIP_MIDDLE_Y, BODY_MOUNT_MIDDLE_DEG, false);
+		setMount(2, BODY_HIP_BACK_X, BODY_HIP_BACK_Y, BODY_MOUNT_BACK_DEG, false);
+		setMount(3, BODY_HIP_FRONT_X, BODY_HIP_FRONT_Y, BODY_MOUNT_FRONT_DEG, true);
+		setMount(4, 0, BODY_HIP_MIDDLE_Y, BODY_MOUNT_MIDDLE_DEG, true);
+		setMount(5, BODY_HIP_BACK_X, BODY_HIP_BACK_Y, BODY_MOUNT_BACK_DEG, true);
+		// The padding lanes repeat the first leg so they always solve
+		for (int i = BODY_LEG_NUM; i < IK_BATCH; i++) {
+			m_hipX[i] = m_hipX[0];
+			m_hipY[i] = m_hipY[0];
+			m_ux[i] = m_ux[0];
+			m_uy[i] = m_uy[0];
+			m_vx[i] = m_vx[0];
+			m_vy[i] = m_vy[0];
+		}
+	}
+
+	/**
+	 * Computes the body's 4x4 transform (body to world) for a pose.
+	 */
+	static void PoseToMatrix(const Pose &pose, float m[4][4])
+	{
+		float cr = cosf(pose.roll / IK_RAD_TO_DEG), sr = sinf(pose.roll / IK_RAD_TO_DEG);
+		float cp = cosf(pose.pitch / IK_RAD_TO_DEG), sp = sinf(pose.pitch / IK_RAD_TO_DEG);
+		float cy = cosf(pose.yaw / IK_RAD_TO_DEG), sy = sinf(pose.yaw / IK_RAD_TO_DEG);
+		// R = Rz(yaw) Ry(pitch) Rx(roll)
+		m[0][0] = cy * cp; m[0][1] = cy * sp * sr - sy * cr; m[0][2] = cy * sp * cr + sy * sr; m[0][3] = pose.x;
+		m[1][0] = sy * cp; m[1][1] = sy * sp * sr + cy * cr; m[1][2] = sy * sp * cr - cy * sr; m[1][3] = pose.y;
+		m[2][0] = -sp;     m[2][1] = cp * sr;                m[2][2] = cp * cr;                m[2][3] = pose.z;
+		m[3][0] = 0;       m[3][1] = 0;                      m[3][2] = 0;                      m[3][3] = 1;
+	}
+
+	/**
+	 * Interpolates between two poses, t from 0 to 1.
+	 */
+	static Pose Blend(const Pose &a, const Pose &b, float t)
+	{
+		Pose p;
+		p.x = a.x + (b.x - a.x) * t;
+		p.y = a.y + (b.y - a.y) * t;
+		p.z = a.z + (b.z - a.z) * t;
+		p.roll = a.roll + (b.roll - a.roll) * t;
+		p.pitch = a.pitch + (b.pitch - a.pitch) * t;
+		p.yaw = a.yaw + (b.yaw - a.yaw) * t;
+		return p;
+	}
+
+	/**
+	 * Computes where the feet are in the world with the body in the neutral
+	 * pose and every leg at the given joint angles (e.g. the standing stance).
+	 */
+	void LegsToFeet(const LegIK::Joints joints[BODY_LEG_NUM], Feet &feet)
+	{
+		for (int i = 0; i < IK_BATCH; i++) {
+			float x, y, z;
+			LegIK::Forward(joints[i < BODY_LEG_NUM ? i : 0], x, y, z);
+			feet.x[i] = m_hipX[i] + x * m_ux[i] + y * m_vx[i];
+			feet.y[i] = m_hipY[i] + x * m_uy[i] + y * m_vy[i];
+			feet.z[i] = z;
+		}
+	}
+
+	/**
+	 * Transforms world foot positions into the legs' frames for a body
+	 * transform m (body to world), ready for LegIK::SolveBatch. This is
+	 * the per-tick path: straight-line loops over the lanes.
+	 */
+	void FeetToLegs(const float m[4][4], const Feet &feet, LegIK::FootBatch &out)
+	{
+		for (int i = 0; i < IK_BATCH; i++) {
+			// Into the body frame: R^T (p - t)
+			float dx = feet.x[i] - m[0][3], dy = feet.y[i] - m[1][3], dz = feet.z[i] - m[2][3];
+			float bx = m[0][0] * dx + m[1][0] * dy + m[2][0] * dz;
+			float by = m[0][1] * dx + m[1][1] * dy + m[2][1] * dz;
+			float bz = m[0][2] * dx + m[1][2] * dy + m[2][2] * dz;
+			// Into the leg frame
+			float rx = bx - m_hipX[i], ry = by - m_hipY[i];
+			out.x[i] = rx * m_ux[i] + ry * m_uy[i];
+			out.y[i] = rx * m_vx[i] + ry * m_vy[i];
+			out.z[i] = bz;
+		}
+	}
+};
+
+#endif /* BODYPOSE_CPP_ */
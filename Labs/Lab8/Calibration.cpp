@@ -0,0 +1,204 @@
+#ifndef CALIBRATION_CPP_
+#define CALIBRATION_CPP_
+#include "ServoMotor.cpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+// Environment variable naming a calibration file loaded at start-up
+#define CALIBRATION_FILE_ENV "SPIDER_CAL"
+
+/*
+ * A calibration file has one line per servo that differs from nominal:
+ *
+ *   servo <motorId> [offset=<deg>] [gain=<g>] [min=<deg>] [max=<deg>]
+ *                   [curve=<in>:<out>,<in>:<out>,...]
+ *
+ * A commanded angle is clamped to [min, max], mapped through the
+ * piecewise-linear curve (if any; points sorted by <in>, constant beyond
+ * the ends), then scaled by gain and shifted by offset to give the angle
+ * actually sent, which is converted to a duty cycle as usual. Lines
+ * starting with # are comments.
+ */
+
+/**
+ * Holds the calibration of every servo and builds it into per-servo angle
+ * to duty cycle tables, so a calibrated move is still a single table read.
+ */
+class Calibration
+{
+public:
+	typedef struct
+	{
+		float offset;
+		float gain;
+		float min;
+		float max;
+		// Correction curve points (commanded angle, corrected angle), sorted by the first
+		std::vector<std::pair<float, float> > curve;
+	} Servo;
+
+private:
+	Servo m_servo[MOTOR_NUM];
+	// The tables of the servos, as last built by Apply()
+	AngleTable *m_tables;
+
+	static void setDefault(Servo &servo)
+	{
+		servo.offset = 0;
+		servo.gain = 1;
+		servo.min = DEGREE_MIN;
+		servo.max = DEGREE_MAX;
+		servo.curve.clear();
+	}
+
+	// Evaluates the piecewise-linear curve at angle
+	static float applyCurve(const Servo &servo, float angle)
+	{
+		const std::vector<std::pair<float, float> > &c = servo.curve;
+		if (c.empty())
+			return angle;
+		if (angle <= c.front().first)
+			return c.front().second;
+		for (size_t i = 1; i < c.size(); i++) {
+			if (angle <= c[i].first) {
+				float t = (angle - c[i - 1].first) / (c[i].first - c[i - 1].first);
+				return c[i - 1].second + t * (c[i].second - c[i - 1].second);
+			}
+		}
+		return c.back().second;
+	}
+
+	/**
+	 * Parses "servo ..." settings into servo.
+	 * @return false and prints a message if they are malformed
+	 */
+	static bool parseServo(std::stringstream &ss, Servo &servo, int line, const char *origin)
+	{
+		std::string tok;
+		while (ss >> tok) {
+			size_t eq = tok.find('=');
+			std::string key = tok.substr(0, eq);
+			std::string value = (eq == std::string::npos) ? "" : tok.substr(eq + 1);
+			char *end;
+			float v = strtof(value.c_str(), &end);
+			bool number = !value.empty() && *end == '\0';
+			if (key == "offset" && number) {
+				servo.offset = v;
+			} else if (key == "gain" && number) {
+				servo.gain = v;
+			} else if (key == "min" && number) {
+				servo.min = v;
+			} else if (key == "max" && number) {
+				servo.max = v;
+			} else if (key == "curve" && !value.empty()) {
+				std::stringstream points(value);
+				std::string point;
+				servo.curve.clear();
+				while (std::getline(points, point, ',')) {
+					float in, out;
+					if (sscanf(point.c_str(), "%f:%f", &in, &out) != 2) {
+						fprintf(stderr, "ERROR: %s:%d: bad curve point \"%s\"...\n", origin, line, point.c_str());
+						return false;
+					}
+					servo.curve.push_back(std::make_pair(in, out));
+				}
+				std::sort(servo.curve.begin(), servo.curve.end());
+			} else {
+				fprintf(stderr, "ERROR: %s:%d: bad setting \"%s\"...\n", origin, line, tok.c_str());
+				return false;
+			}
+		}
+		if (servo.min > servo.max) {
+			fprintf(stderr, "ERROR: %s:%d: min is above max...\n", origin, line);
+			return false;
+		}
+		return true;
+	}
+
+public:
+	Calibration()
+	{
+		for (int i = 0; i < MOTOR_NUM; i++)
+			setDefault(m_servo[i]);
+		m_tables = NULL;
+	}
+
+	~Calibration() { delete[] m_tables; }
+
+	const Servo &GetServo(int motorId) { return m_servo[motorId]; }
+
+	/**
+	 * Replaces the calibration with the one in a file. Servos the file does
+	 * not mention are nominal. Call Apply() afterwards.
+	 * @return false, keeping the current calibration, if the file cannot be read or is malformed
+	 */
+	bool Load(std::istream &in, const char *origin)
+	{
+		Servo servo[MOTOR_NUM];
+		std::string line, keyword;
+		for (int i = 0; i < MOTOR_NUM; i++)
+			setDefault(servo[i]);
+		for (int n = 1; std::getline(in, line); n++) {
+			size_t hash = line.find('#');
+			if (hash != std::string::npos)
+				line.erase(hash);
+			std::stringstream ss(line);
+			int id;
+			if (!(ss >> keyword))
+				continue;
+			if (keyword != "servo" || !(ss >> id) || id < 0 || id >= MOTOR_NUM) {
+				fprintf(stderr, "ERROR: %s:%d: expected \"servo <0-%d> ...\"...\n", origin, n, MOTOR_NUM - 1);
+				return false;
+			}
+			if (!parseServo(ss, servo[id], n, origin))
+				return false;
+		}
+		for (int i = 0; i < MOTOR_NUM; i++)
+			m_servo[i] = servo[i];
+		return true;
+	}
+
+	bool LoadFile(const char *path)
+	{
+		std::ifstream in(path);
+		if (!in) {
+			fprintf(stderr, "ERROR: could not open \"%s\"...\n", path);
+			return false;
+		}
+		return Load(in, path);
+	}
+
+	/**
+	 * Computes the duty cycle of a commanded angle for a servo; used to
+	 * build the tables, not on the move path.
+	 */
+	static uint32_t ComputeDC(const Servo &servo, float angle)
+	{
+		angle = (angle < servo.min) ? servo.min : (angle > servo.max) ? servo.max : angle;
+		angle = applyCurve(servo, angle) * servo.gain + servo.offset;
+		return ServoMotor::StepsToDC(ServoMotor::AngleToSteps(angle));
+	}
+
+	/**
+	 * Builds a table for every servo from the current calibration and gives
+	 * each motor its table. The previous tables are freed, so this must run
+	 * on the thread that moves the servos (for Spider, the control thread),
+	 * and any duty cycles computed from the old tables must be recomputed.
+	 * @param motors - the servos, indexed by motor ID
+	 */
+	void Apply(ServoMotor *const motors[MOTOR_NUM])
+	{
+		AngleTable *tables = new AngleTable[MOTOR_NUM];
+		for (int m = 0; m < MOTOR_NUM; m++)
+			for (int i = 0; i < ANGLE_TABLE_SIZE; i++)
+				tables[m].dc[i] = ComputeDC(m_servo[m], DEGREE_MIN + i / (float)ANGLE_STEPS_PER_DEGREE);
+		for (int m = 0; m < MOTOR_NUM; m++)
+			motors[m]->SetTable(&tables[m]);
+		delete[] m_tables;
+		m_tables = tables;
+	}
+};
+
+#endif /* CALIBRATION_CPP_ */
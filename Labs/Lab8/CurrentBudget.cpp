@@ -0,0 +1,242 @@
+#ifndef CURRENTBUDGET_CPP_
+#define CURRENTBUDGET_CPP_
+#include "ServoMotor.cpp"
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Environment variable setting the current budget of the servos, and optionally the model's currents:
+//   SPIDER_CURRENT=<budget mA>[:<moving mA>:<full speed mA>]
+#define CURRENT_BUDGET_ENV "SPIDER_CURRENT"
+// Drawn by a servo holding its position
+#define CURRENT_HOLD_MA 10
+// Drawn by a servo starting to move slowly (default)
+#define CURRENT_MOVE_MA 150
+// Drawn by a servo turning at full speed, close to its stall current (default)
+#define CURRENT_FULL_MA 700
+// The fastest a servo turns, in degrees per second
+#define SERVO_MAX_DPS 400
+// A servo's first pulse sends it from wherever it lies at full speed; this far, at worst
+#define CURRENT_JUMP_DEG 90
+
+/**
+ * Keeps the servos' combined current within a budget by staggering the
+ * starts of the moves of a frame. Commanding all 18 servos at once, as
+ * Init, Standup and Reset do, draws enough current on battery to brown
+ * the board out. Waiting for every servo in turn, as the BadInit sequence
+ * does, is safe but slow.
+ *
+ * Each move is modelled from its angle and PWM_DELAY. The ramp of a
+ * delay takes a predictable time (see PwmRampNs), and no servo turns
+ * faster than SERVO_MAX_DPS. A move draws between the moving and
+ * full-speed currents, in proportion to its speed. A servo's first pulse
+ * is a full-speed move of up to CURRENT_JUMP_DEG. Holding servos draw
+ * CURRENT_HOLD_MA each.
+ *
+ * Plan() places the longest moves first, each at the earliest time the
+ * load, counting the moves still running, leaves room for it. Moves that
+ * fit start together, and the rest follow as earlier ones finish. This
+ * keeps the whole frame's completion time short. A move that does not fit
+ * even alone starts once everything else has finished. The budget is off
+ * (0) unless it is set.
+ */
+class CurrentBudget
+{
+public:
+	typedef struct
+	{
+		uint64_t frames;    // Frames planned
+		uint64_t staggered; // Frames whose moves did not all start at once
+		uint32_t peakMa;    // Highest predicted draw of any plan
+		uint64_t addedNs;   // Completion time added by staggering, over all frames
+	} Stats;
+
+private:
+	typedef struct
+	{
+		uint64_t start; // Relative to the plan's start
+		uint64_t end;
+		uint32_t ma;
+	} Load;
+
+	uint32_t m_budgetMa;
+	uint32_t m_moveMa;
+	uint32_t m_fullMa;
+	// The move each servo was last sent on: when it ends and what it draws until then
+	uint64_t m_endNs[MOTOR_NUM];
+	uint32_t m_ma[MOTOR_NUM];
+	Stats m_stats;
+
+	// Predicted draw of all servos at time t
+	uint32_t loadAt(const std::vector<Load> &loads, uint64_t t)
+	{
+		uint32_t ma = MOTOR_NUM * CURRENT_HOLD_MA;
+		for (size_t i = 0; i < loads.size(); i++)
+			if (loads[i].start <= t && t < loads[i].end)
+				ma += loads[i].ma;
+		return ma;
+	}
+
+	// Whether a move drawing ma can run over [start, start + ns) within the budget
+	bool fits(const std::vector<Load> &loads, uint64_t start, uint64_t ns, uint32_t ma)
+	{
+		if (loadAt(loads, start) + ma > m_budgetMa)
+			return false;
+		for (size_t i = 0; i < loads.size(); i++)
+			if (loads[i].start > start && loads[i].start < start + ns && loadAt(loads, loads[i].start) + ma > m_budgetMa)
+				return false;
+		return true;
+	}
+
+public:
+	CurrentBudget()
+	{
+		m_budgetMa = 0;
+		m_moveMa = CURRENT_MOVE_MA;
+		m_fullMa = CURRENT_FULL_MA;
+		memset(m_endNs, 0, sizeof(m_endNs));
+		memset(m_ma, 0, sizeof(m_ma));
+		ResetStats();
+	}
+
+	/**
+	 * Configures the budget from $SPIDER_CURRENT, if it is set.
+	 * @return false if the variable cannot be parsed
+	 */
+	bool ConfigureFromEnv()
+	{
+		const char *value = getenv(CURRENT_BUDGET_ENV);
+		if (value == NULL || value[0] == '\0')
+			return true;
+		unsigned budget = 0, move = m_moveMa, full = m_fullMa;
+		int n = sscanf(value, "%u:%u:%u", &budget, &move, &full);
+		if (n != 1 && n != 3) {
+			fprintf(stderr, "ERROR: %s must be <budget mA>[:<moving mA>:<full speed mA>], not \"%s\"...\n",
+					CURRENT_BUDGET_ENV, value);
+			return false;
+		}
+		SetBudget(budget);
+		SetModel(move, full);
+		return true;
+	}
+
+	// Sets the budget, 0 for none; it includes what the holding servos draw
+	void SetBudget(uint32_t ma) { m_budgetMa = ma; }
+	uint32_t GetBudget() { return m_budgetMa; }
+	bool IsEnabled() { return m_budgetMa != 0; }
+
+	// Sets the currents of a servo starting to move slowly and of one turning at full speed
+	void SetModel(uint32_t moveMa, uint32_t fullMa)
+	{
+		m_moveMa = moveMa;
+		m_fullMa = (fullMa > moveMa) ? fullMa : moveMa;
+	}
+
+	const Stats &GetStats() { return m_stats; }
+	void ResetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+
+	/**
+	 * Predicts the current draw and duration of a servo moving between two
+	 * duty cycles with a given PWM_DELAY. A move to 0 turns the pulse off
+	 * and draws nothing.
+	 */
+	void Predict(uint32_t dcFrom, uint32_t dcTo, uint32_t delay, uint32_t &ma, uint64_t &ns)
+	{
+		if (dcTo == 0 || dcFrom == dcTo) {
+			ma = 0;
+			ns = 0;
+			return;
+		}
+		double deg = CURRENT_JUMP_DEG;
+		ns = 0;
+		if (dcFrom != 0) {
+			deg = (dcFrom > dcTo ? dcFrom - dcTo : dcTo - dcFrom) * (double)(DEGREE_MAX - DEGREE_MIN) / (PWM_MAX - PWM_MIN);
+			ns = PwmRampNs(dcFrom, dcTo, delay);
+		}
+		uint64_t fastest = (uint64_t)(deg * 1e9 / SERVO_MAX_DPS);
+		if (ns < fastest)
+			ns = fastest;
+		double dps = (ns != 0) ? deg * 1e9 / ns : 0;
+		ma = m_moveMa + (uint32_t)((m_fullMa - m_moveMa) * dps / SERVO_MAX_DPS);
+	}
+
+	/**
+	 * Plans the starts of a frame's moves to keep within the budget, and
+	 * records them as running from those times.
+	 * @param now - when the frame is committed
+	 * @param dc - the frame's duty cycles, per motor ID
+	 * @param motor - the servo of each move, or NULL for writes the budget
+	 * does not model (e.g. streamed setpoints), which start at once
+	 * @param mask - the motors in the frame
+	 * @param start - receives each move's start, in ns after now
+	 */
+	void Plan(uint64_t now, const uint32_t dc[MOTOR_NUM], ServoMotor *const motor[MOTOR_NUM], uint32_t mask,
+			  uint64_t start[MOTOR_NUM])
+	{
+		std::vector<Load> loads;
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			start[id] = 0;
+			// Moves still running, except those of servos this frame sends elsewhere
+			if (m_endNs[id] > now && !((mask & (1u << id)) && motor[id] != NULL)) {
+				Load l = { 0, m_endNs[id] - now, m_ma[id] };
+				loads.push_back(l);
+			}
+		}
+
+		uint32_t ids[MOTOR_NUM], ma[MOTOR_NUM], n = 0;
+		uint64_t ns[MOTOR_NUM], longest = 0;
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			if ((mask & (1u << id)) && motor[id] != NULL) {
+				Predict(motor[id]->GetDC(), dc[id], motor[id]->GetDelay(), ma[id], ns[id]);
+				ids[n++] = id;
+				longest = std::max(longest, ns[id]);
+			}
+		}
+		// Longest moves first, as they bound the completion time
+		std::sort(ids, ids + n, [&ns, &ma](uint32_t a, uint32_t b) {
+			return ns[a] != ns[b] ? ns[a] > ns[b] : ma[a] > ma[b];
+		});
+
+		uint64_t finish = 0;
+		for (uint32_t k = 0; k < n; k++) {
+			uint32_t id = ids[k];
+			if (ns[id] != 0) {
+				// Earliest of now and the ends of the moves placed so far
+				std::vector<uint64_t> candidates(1, 0);
+				uint64_t last = 0;
+				for (size_t i = 0; i < loads.size(); i++) {
+					candidates.push_back(loads[i].end);
+					last = std::max(last, loads[i].end);
+				}
+				std::sort(candidates.begin(), candidates.end());
+				start[id] = last;
+				for (size_t c = 0; c < candidates.size(); c++) {
+					if (fits(loads, candidates[c], ns[id], ma[id])) {
+						start[id] = candidates[c];
+						break;
+					}
+				}
+				Load l = { start[id], start[id] + ns[id], ma[id] };
+				loads.push_back(l);
+			}
+			m_endNs[id] = now + start[id] + ns[id];
+			m_ma[id] = ma[id];
+			finish = std::max(finish, start[id] + ns[id]);
+		}
+
+		uint32_t peak = loadAt(loads, 0);
+		bool staggered = false;
+		for (size_t i = 0; i < loads.size(); i++) {
+			peak = std::max(peak, loadAt(loads, loads[i].start));
+			staggered = staggered || loads[i].start != 0;
+		}
+		m_stats.frames++;
+		m_stats.staggered += staggered;
+		m_stats.peakMa = std::max(m_stats.peakMa, peak);
+		m_stats.addedNs += finish - longest;
+	}
+};
+
+#endif /* CURRENTBUDGET_CPP_ */
@@ -0,0 +1,487 @@
+#ifndef GAITENGINE_CPP_
+#define GAITENGINE_CPP_
+#include "SpiderLeg.cpp"
+#include "Trajectory.cpp"
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdlib.h>
+
+// Number of legs, and their names in the order of Spider's LEG_ID
+#define GAIT_LEG_NUM 6
+static const char *const gait_leg_names[GAIT_LEG_NUM] = { "RF", "RM", "RB", "LF", "LM", "LB" };
+static const char *const gait_joint_names[SpiderLeg::JOINT_NUM] = { "hip", "knee", "ankle" };
+
+// Environment variable naming a gait file loaded on top of the built-in gaits
+#define GAIT_FILE_ENV "SPIDER_GAITS"
+
+/*
+ * The built-in gaits. A gait file uses the same format and may add gaits,
+ * replace these, or change parameters:
+ *
+ *   param <name> <value>        set a parameter usable in angle expressions
+ *   gait <name>                 start a gait; it ends at "end"
+ *   phase <move> [; <move>...] [nowait] [hold=<ms>] [overlap=<percent>]
+ *         [profile=step|trapezoid|scurve] [time=<ms>]
+ *   end
+ *
+ * A move is "<legs> <joint> <angle>...". Legs are T1 (RF LM RB, angles given
+ * front, middle, back), T2 (LF RM LB), ALL (angles in RF RM RB LF LM LB order)
+ * or a comma separated list such as RF,LB. A single angle applies to every
+ * leg of the group. Angles are sums like "HipF+Swing" or "-20" of numbers
+ * and parameters. Each phase waits for the servos unless marked nowait, then
+ * holds for the given time. In pipelined mode (Spider::SetPipelined) a phase
+ * with an overlap only waits until its moves are predicted to have covered
+ * 100 - overlap percent of their travel, so the next phase starts while it
+ * is still moving; on the last phase this overlaps the next movement.
+ * A profile streams the phase's moves frame by frame along that velocity
+ * profile (see Trajectory), taking at least the given time; such phases run
+ * to the end of their trajectory and ignore overlap. Phases without a
+ * profile use Spider's default profile.
+ *
+ * The default parameter values are the *_Base macros in Spider.cpp.
+ */
+static const char *const gait_builtin =
+	"gait init\n"
+	"phase ALL hip 0 ; ALL knee 0 ; ALL ankle 0\n"
+	"end\n"
+	"gait standup\n"
+	"phase ALL hip HipF HipM HipB HipF HipM HipB\n"
+	"phase ALL knee 90 ; ALL ankle Ankle\n"
+	"phase ALL knee 85 ; ALL ankle Ankle\n"
+	"phase ALL knee 80 ; ALL ankle Ankle\n"
+	"phase ALL knee 75 ; ALL ankle Ankle\n"
+	"phase ALL knee 70 ; ALL ankle Ankle\n"
+	"phase ALL knee 65 ; ALL ankle Ankle\n"
+	"phase ALL knee 60 ; ALL ankle Ankle\n"
+	"phase ALL knee 55 ; ALL ankle Ankle\n"
+	"phase ALL knee 50 ; ALL ankle Ankle\n"
+	"phase ALL knee 45 ; ALL ankle Ankle\n"
+	"end\n"
+	"gait reset\n"
+	"phase RF,LB knee Knee_Up ; RF,LB hip HipF HipB ; RF,LB ankle Ankle\n"
+	"phase RF,LB knee Knee_Down\n"
+	"phase RM,LM knee Knee_Up ; RM,LM hip HipM HipM ; RM,LM ankle Ankle\n"
+	"phase RM,LM knee Knee_Down\n"
+	"phase RB,LF knee Knee_Up ; RB,LF hip HipB HipF ; RB,LF ankle Ankle\n"
+	"phase RB,LF knee Knee_Down\n"
+	"end\n"
+	// Tripod walking: lift one tripod, swing it while the other pushes, lower it.
+	// When pipelined, the swing starts before the knees are fully up and the
+	// next step's lift starts while this step's knees are still lowering.
+	"gait forward_t1\n"
+	"phase T1 knee Knee_Up overlap=KneeOverlap\n"
+	"phase T1 hip HipF+Swing HipM+Swing HipB+Swing ; T2 hip HipF-Swing HipM-Swing HipB-Swing overlap=HipOverlap\n"
+	"phase T1 knee Knee_Down overlap=KneeOverlap\n"
+	"end\n"
+	"gait forward_t2\n"
+	"phase T2 knee Knee_Up overlap=KneeOverlap\n"
+	"phase T1 hip HipF-Swing HipM-Swing HipB-Swing ; T2 hip HipF+Swing HipM+Swing HipB+Swing overlap=HipOverlap\n"
+	"phase T2 knee Knee_Down overlap=KneeOverlap\n"
+	"end\n"
+	"gait backward_t1\n"
+	"phase T1 knee Knee_Up overlap=KneeOverlap\n"
+	"phase T1 hip HipF-Swing HipM-Swing HipB-Swing ; T2 hip HipF+Swing HipM+Swing HipB+Swing overlap=HipOverlap\n"
+	"phase T1 knee Knee_Down overlap=KneeOverlap\n"
+	"end\n"
+	"gait backward_t2\n"
+	"phase T2 knee Knee_Up overlap=KneeOverlap\n"
+	"phase T1 hip HipF+Swing HipM+Swing HipB+Swing ; T2 hip HipF-Swing HipM-Swing HipB-Swing overlap=HipOverlap\n"
+	"phase T2 knee Knee_Down overlap=KneeOverlap\n"
+	"end\n"
+	// In-place turns: swing TRIPOD2's outer and middle hips in opposite directions
+	"gait turn_left\n"
+	"phase T2 knee Knee_Up\n"
+	"phase T2 hip HipF-Swing HipM+Swing HipB-Swing\n"
+	"phase T2 knee Knee_Down\n"
+	"phase T1 knee Knee_Up\n"
+	"phase T2 hip HipF+Swing HipM-Swing HipB+Swing\n"
+	"phase T1 knee Knee_Down nowait\n"
+	"end\n"
+	"gait turn_right\n"
+	"phase T2 knee Knee_Up\n"
+	"phase T2 hip HipF+Swing HipM-Swing HipB+Swing\n"
+	"phase T2 knee Knee_Down\n"
+	"phase T1 knee Knee_Up\n"
+	"phase T2 hip HipF-Swing HipM+Swing HipB-Swing\n"
+	"phase T1 knee Knee_Down nowait\n"
+	"end\n"
+	// Wave gait: one leg at a time, back to front on each side, then the body shifts
+	"gait wave\n"
+	"phase LB knee Knee_Up\n"
+	"phase LB hip HipB+Swing\n"
+	"phase LB knee Knee_Down\n"
+	"phase LM knee Knee_Up\n"
+	"phase LM hip HipM+Swing\n"
+	"phase LM knee Knee_Down\n"
+	"phase LF knee Knee_Up\n"
+	"phase LF hip HipF+Swing\n"
+	"phase LF knee Knee_Down\n"
+	"phase RB knee Knee_Up\n"
+	"phase RB hip HipB+Swing\n"
+	"phase RB knee Knee_Down\n"
+	"phase RM knee Knee_Up\n"
+	"phase RM hip HipM+Swing\n"
+	"phase RM knee Knee_Down\n"
+	"phase RF knee Knee_Up\n"
+	"phase RF hip HipF+Swing\n"
+	"phase RF knee Knee_Down\n"
+	"phase ALL hip HipF HipM HipB HipF HipM HipB\n"
+	"end\n"
+	// Ripple gait: two legs on opposite sides, out of phase, step together
+	"gait ripple\n"
+	"phase LB,RF knee Knee_Up\n"
+	"phase LB,RF hip HipB+Swing HipF+Swing\n"
+	"phase LB,RF knee Knee_Down\n"
+	"phase LM,RB knee Knee_Up\n"
+	"phase LM,RB hip HipM+Swing HipB+Swing\n"
+	"phase LM,RB knee Knee_Down\n"
+	"phase LF,RM knee Knee_Up\n"
+	"phase LF,RM hip HipF+Swing HipM+Swing\n"
+	"phase LF,RM knee Knee_Down\n"
+	"phase ALL hip HipF HipM HipB HipF HipM HipB\n"
+	"end\n";
+
+/**
+ * Loads gaits described as tables of phases and compiles them into flat
+ * arrays of PWM register writes, so running a gait needs no float math or
+ * per-leg branching: each phase is one register batch.
+ */
+class GaitEngine
+{
+public:
+	/**
+	 * One compiled phase: the register writes [begin, end) of its gait,
+	 * whether to wait for the servos afterwards, how long to hold and how
+	 * much of its travel the next phase may overlap when pipelined, and the
+	 * velocity profile and minimum length in frames of its trajectory.
+	 */
+	typedef struct
+	{
+		uint32_t begin;
+		uint32_t end;
+		bool waitReady;
+		uint32_t holdUs;
+		uint8_t overlapPct;
+		Trajectory::PROFILE profile;
+		uint32_t minFrames;
+	} Phase;
+
+	/**
+	 * A compiled gait. motors[i] and angles[i] are the servo and angle that
+	 * writes[i] sets, kept so the ServoMotor state can be updated without
+	 * recomputing them.
+	 */
+	typedef struct
+	{
+		std::vector<MMap::RegWrite> writes;
+		std::vector<ServoMotor *> motors;
+		std::vector<float> angles;
+		std::vector<Phase> phases;
+	} Gait;
+
+private:
+	// A move as written in the gait description, before parameters are applied
+	typedef struct
+	{
+		int leg;
+		int joint;
+		std::string angle;
+	} MoveSrc;
+
+	typedef struct
+	{
+		std::vector<MoveSrc> moves;
+		bool waitReady;
+		std::string hold;
+		std::string overlap;
+		Trajectory::PROFILE profile;
+		std::string time;
+		int line;
+	} PhaseSrc;
+
+	std::map<std::string, float> m_params;
+	std::map<std::string, std::vector<PhaseSrc> > m_source;
+	std::map<std::string, Gait> m_gaits;
+
+	static int findName(const std::string &name, const char *const *names, int count)
+	{
+		for (int i = 0; i < count; i++)
+			if (name == names[i])
+				return i;
+		return -1;
+	}
+
+	/**
+	 * Expands a leg group into leg indices.
+	 * @return false if the group is not recognised
+	 */
+	static bool parseLegs(const std::string &group, std::vector<int> &legs)
+	{
+		static const int tripod1[] = { 0, 4, 2 }; // RF LM RB
+		static const int tripod2[] = { 3, 1, 5 }; // LF RM LB
+		legs.clear();
+		if (group == "T1") {
+			legs.assign(tripod1, tripod1 + 3);
+		} else if (group == "T2") {
+			legs.assign(tripod2, tripod2 + 3);
+		} else if (group == "ALL") {
+			for (int i = 0; i < GAIT_LEG_NUM; i++)
+				legs.push_back(i);
+		} else {
+			std::stringstream ss(group);
+			std::string name;
+			while (std::getline(ss, name, ',')) {
+				int leg = findName(name, gait_leg_names, GAIT_LEG_NUM);
+				if (leg < 0)
+					return false;
+				legs.push_back(leg);
+			}
+		}
+		return !legs.empty();
+	}
+
+	/**
+	 * Evaluates a sum of numbers and parameters such as "HipF+Swing".
+	 * @return false if it names an unknown parameter
+	 */
+	bool eval(const std::string &expr, float &value)
+	{
+		value = 0;
+		size_t i = 0;
+		while (i < expr.size()) {
+			float sign = 1;
+			if (expr[i] == '+' || expr[i] == '-') {
+				sign = (expr[i] == '-') ? -1 : 1;
+				i++;
+			}
+			size_t j = expr.find_first_of("+-", i);
+			std::string term = expr.substr(i, j == std::string::npos ? std::string::npos : j - i);
+			char *end;
+			float v = strtof(term.c_str(), &end);
+			if (term.empty() || *end != '\0') {
+				std::map<std::string, float>::iterator it = m_params.find(term);
+				if (it == m_params.end())
+					return false;
+				v = it->second;
+			}
+			value += sign * v;
+			i = (j == std::string::npos) ? expr.size() : j;
+		}
+		return !expr.empty();
+	}
+
+	/**
+	 * Parses one "phase" line (without the keyword).
+	 * @return false and prints a message if it is malformed
+	 */
+	bool parsePhase(const std::string &text, int line, const char *origin, PhaseSrc &phase)
+	{
+		std::stringstream moves(text);
+		std::string move;
+		phase.waitReady = true;
+		phase.hold = "0";
+		phase.overlap = "0";
+		phase.profile = Trajectory::PROFILE_DEFAULT;
+		phase.time = "0";
+		phase.line = line;
+		while (std::getline(moves, move, ';')) {
+			std::stringstream tokens(move);
+			std::string group, joint, tok;
+			std::vector<std::string> angles;
+			tokens >> group >> joint;
+			while (tokens >> tok) {
+				if (tok == "nowait") {
+					phase.waitReady = false;
+				} else if (tok.compare(0, 5, "hold=") == 0) {
+					phase.hold = tok.substr(5);
+				} else if (tok.compare(0, 8, "overlap=") == 0) {
+					phase.overlap = tok.substr(8);
+				} else if (tok.compare(0, 5, "time=") == 0) {
+					phase.time = tok.substr(5);
+				} else if (tok.compare(0, 8, "profile=") == 0) {
+					if (!Trajectory::ParseProfile(tok.c_str() + 8, phase.profile)) {
+						fprintf(stderr, "ERROR: %s:%d: unknown profile \"%s\"...\n", origin, line, tok.c_str() + 8);
+						return false;
+					}
+				} else {
+					angles.push_back(tok);
+				}
+			}
+			std::vector<int> legs;
+			int j = findName(joint, gait_joint_names, SpiderLeg::JOINT_NUM);
+			if (!parseLegs(group, legs) || j < 0 || angles.empty()
+				|| (angles.size() != 1 && angles.size() != legs.size())) {
+				fprintf(stderr, "ERROR: %s:%d: bad move \"%s\"...\n", origin, line, move.c_str());
+				return false;
+			}
+			for (size_t i = 0; i < legs.size(); i++) {
+				MoveSrc m = { legs[i], j, angles[angles.size() == 1 ? 0 : i] };
+				phase.moves.push_back(m);
+			}
+		}
+		return true;
+	}
+
+public:
+	GaitEngine() {}
+
+	void SetParam(const std::string &name, float value) { m_params[name] = value; }
+
+	float GetParam(const std::string &name)
+	{
+		std::map<std::string, float>::iterator it = m_params.find(name);
+		return it == m_params.end() ? 0 : it->second;
+	}
+
+	const std::map<std::string, float> &GetParams() { return m_params; }
+
+	/**
+	 * Adds the gaits and parameters of a description to the engine.
+	 * Gaits replace earlier gaits of the same name. Call Compile() afterwards.
+	 * @param origin - the file name used in error messages
+	 * @return false if the description is malformed; gaits before the error are kept
+	 */
+	bool Load(std::istream &in, const char *origin)
+	{
+		std::string line, keyword, name;
+		std::vector<PhaseSrc> *gait = NULL;
+		for (int n = 1; std::getline(in, line); n++) {
+			size_t hash = line.find('#');
+			if (hash != std::string::npos)
+				line.erase(hash);
+			std::stringstream ss(line);
+			if (!(ss >> keyword))
+				continue;
+			if (keyword == "param") {
+				float value;
+				if (!(ss >> name >> value)) {
+					fprintf(stderr, "ERROR: %s:%d: expected \"param <name> <value>\"...\n", origin, n);
+					return false;
+				}
+				SetParam(name, value);
+			} else if (keyword == "gait" && gait == NULL && (ss >> name)) {
+				gait = &m_source[name];
+				gait->clear();
+			} else if (keyword == "phase" && gait != NULL) {
+				PhaseSrc phase;
+				std::string rest;
+				std::getline(ss, rest);
+				if (!parsePhase(rest, n, origin, phase))
+					return false;
+				gait->push_back(phase);
+			} else if (keyword == "end" && gait != NULL) {
+				gait = NULL;
+			} else {
+				fprintf(stderr, "ERROR: %s:%d: unexpected \"%s\"...\n", origin, n, keyword.c_str());
+				return false;
+			}
+		}
+		if (gait != NULL) {
+			fprintf(stderr, "ERROR: %s: missing \"end\"...\n", origin);
+			return false;
+		}
+		return true;
+	}
+
+	bool LoadText(const char *text, const char *origin)
+	{
+		std::istringstream in(text);
+		return Load(in, origin);
+	}
+
+	bool LoadFile(const char *path)
+	{
+		std::ifstream in(path);
+		if (!in) {
+			fprintf(stderr, "ERROR: could not open \"%s\"...\n", path);
+			return false;
+		}
+		return Load(in, path);
+	}
+
+	/**
+	 * Compiles every loaded gait into register writes for the given legs,
+	 * applying the current parameter values.
+	 * @param legs - the spider's legs in LEG_ID order
+	 * @return false if an angle uses an unknown parameter
+	 */
+	bool Compile(SpiderLeg *const legs[GAIT_LEG_NUM])
+	{
+		bool bSuccess = true;
+		m_gaits.clear();
+		for (std::map<std::string, std::vector<PhaseSrc> >::iterator g = m_source.begin(); g != m_source.end(); ++g) {
+			Gait &gait = m_gaits[g->first];
+			for (size_t p = 0; p < g->second.size(); p++) {
+				const PhaseSrc &src = g->second[p];
+				Phase phase;
+				float hold;
+				phase.begin = gait.writes.size();
+				for (size_t m = 0; m < src.moves.size(); m++) {
+					const MoveSrc &move = src.moves[m];
+					SpiderLeg *leg = legs[move.leg];
+					float angle;
+					if (!eval(move.angle, angle)) {
+						fprintf(stderr, "ERROR: gait %s line %d: unknown parameter in \"%s\"...\n",
+								g->first.c_str(), src.line, move.angle.c_str());
+						bSuccess = false;
+						continue;
+					}
+					if (leg->IsReversed())
+						angle = -angle;
+					angle = (angle > DEGREE_MAX) ? DEGREE_MAX : (angle < DEGREE_MIN) ? DEGREE_MIN : angle;
+					ServoMotor *motor = leg->GetMotor((SpiderLeg::JOINT_ID)move.joint);
+					gait.writes.push_back(MMap::BatchWrite<RegMap::PwmCore::Dc>(motor->GetMotorID(), motor->CalibratedDC(angle)));
+					gait.motors.push_back(motor);
+					gait.angles.push_back(angle);
+				}
+				phase.end = gait.writes.size();
+				phase.waitReady = src.waitReady;
+				if (!eval(src.hold, hold)) {
+					fprintf(stderr, "ERROR: gait %s line %d: unknown parameter in hold time...\n",
+							g->first.c_str(), src.line);
+					bSuccess = false;
+					hold = 0;
+				}
+				phase.holdUs = (hold > 0) ? (uint32_t)(hold * 1000) : 0;
+				float overlap;
+				if (!eval(src.overlap, overlap)) {
+					fprintf(stderr, "ERROR: gait %s line %d: unknown parameter in overlap...\n",
+							g->first.c_str(), src.line);
+					bSuccess = false;
+					overlap = 0;
+				}
+				phase.overlapPct = (overlap > 100) ? 100 : (overlap > 0) ? (uint8_t)overlap : 0;
+				float time;
+				if (!eval(src.time, time)) {
+					fprintf(stderr, "ERROR: gait %s line %d: unknown parameter in time...\n",
+							g->first.c_str(), src.line);
+					bSuccess = false;
+					time = 0;
+				}
+				phase.profile = src.profile;
+				phase.minFrames = (time > 0) ? (uint32_t)ceil(time * 1e6 / TRAJ_FRAME_NS) : 0;
+				gait.phases.push_back(phase);
+			}
+		}
+		return bSuccess;
+	}
+
+	// @return the compiled gait of the given name, or NULL
+	const Gait *Find(const std::string &name)
+	{
+		std::map<std::string, Gait>::iterator it = m_gaits.find(name);
+		return it == m_gaits.end() ? NULL : &it->second;
+	}
+
+	// Lists the names of the loaded gaits
+	std::vector<std::string> Names()
+	{
+		std::vector<std::string> names;
+		for (std::map<std::string, Gait>::iterator it = m_gaits.begin(); it != m_gaits.end(); ++it)
+			names.push_back(it->first);
+		return names;
+	}
+};
+
+#endif /* GAITENGINE_CPP_ */
@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include "RegRecorder.cpp"
+#include "ServoSim.cpp"
+#include "Spider.cpp"
+#include "WorkPool.cpp"
+
+using namespace std;
+
+// Gait cycles run before measuring, to leave the standing stance, and measured
+#define OPT_WARMUP_CYCLES 1
+#define OPT_DEFAULT_CYCLES 4
+#define OPT_DEFAULT_BUDGET 1000
+#define OPT_DEFAULT_GRID_STEPS 3
+// Evolution strategy: independent populations, each trading speed for travel with its own weight
+#define OPT_ES_ISLANDS 5
+#define OPT_ES_LAMBDA 12
+#define OPT_ES_MU (OPT_ES_LAMBDA / 2)
+// Learning rate of the step sizes, and their starting value and floor as a fraction of each range
+#define OPT_ES_CSIGMA 0.3
+#define OPT_ES_SIGMA0 0.3
+#define OPT_ES_SIGMA_MIN 0.01
+
+// The parameters searched: the stance and stride of the tripod gaits
+typedef struct
+{
+	const char *name;
+	float min;
+	float max;
+} ParamRange;
+
+static const ParamRange opt_params[] = {
+	{ "Knee_Up", 45, 90 },
+	{ "Knee_Down", 20, 70 },
+	{ "HipF", -40, 0 },
+	{ "HipM", -20, 20 },
+	{ "HipB", 0, 40 },
+	{ "Ankle", 20, 70 },
+	{ "Swing", 5, 35 },
+};
+#define OPT_PARAM_NUM (sizeof(opt_params) / sizeof(opt_params[0]))
+
+typedef struct
+{
+	float p[OPT_PARAM_NUM];
+	bool valid;        // false if it lifts no foot or does not move forwards
+	double speed;      // mm/s along the direction of travel
+	double travel;     // degrees turned by all servos per metre walked
+	double slip;       // mm slid by planted feet per metre walked
+} Candidate;
+
+// A simulated robot of one worker thread
+typedef struct
+{
+	ServoSim sim;
+	std::unique_ptr<Spider> spider;
+} Robot;
+
+static uint64_t RealNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool RunCycles(Spider &spider, const string &gait, uint32_t cycles)
+{
+	for (uint32_t c = 0; c < cycles; c++) {
+		MotionPlan plan;
+		if (gait == "forward" || gait == "backward") {
+			// A step of each tripod, each planned once the previous one has run
+			Spider::MOTION_ID motion = (gait == "forward") ? Spider::MOTION_FORWARD : Spider::MOTION_BACKWARD;
+			for (int i = 0; i < 2; i++) {
+				plan.clear();
+				spider.Plan(motion, plan);
+				if (!spider.RunPlan(plan))
+					return false;
+			}
+		} else if (!spider.PlanGait(gait, plan) || !spider.RunPlan(plan)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Runs a candidate's gait on a worker's robot, creating the robot on
+ * first use so its virtual clock belongs to the worker's thread.
+ */
+static void Evaluate(Robot &robot, const string &gait, uint32_t cycles, Candidate &c)
+{
+	if (!robot.spider) {
+		SetVirtualClock(&robot.sim);
+		robot.spider.reset(new Spider());
+		robot.sim.Attach(robot.spider->GetMMIO());
+		robot.spider->Init();
+		robot.spider->Standup();
+	}
+	Spider &spider = *robot.spider;
+	c.valid = false;
+	map<string, float> params;
+	for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+		params[opt_params[i].name] = c.p[i];
+	// Without a lift of a few degrees the feet drag instead of stepping
+	if (c.p[0] < c.p[1] + 5 || !spider.SetGaitParams(params))
+		return;
+	spider.Reset();
+	if (!RunCycles(spider, gait, OPT_WARMUP_CYCLES))
+		return;
+	robot.sim.ResetMotion();
+	uint64_t start = MonotonicNs();
+	if (!RunCycles(spider, gait, cycles))
+		return;
+	double seconds = (MonotonicNs() - start) / 1e9;
+	ServoSim::Motion m = robot.sim.GetMotion();
+	double dist = hypot(m.x, m.y);
+	if (dist < 1 || m.strides == 0)
+		return;
+	c.speed = dist / seconds;
+	c.travel = m.travelDeg / (dist / 1000);
+	c.slip = m.slipMm / (dist / 1000);
+	c.valid = true;
+}
+
+// Evaluates candidates [begin, end) on the pool
+static void EvaluateAll(WorkPool &pool, vector<Robot> &robots, const string &gait, uint32_t cycles,
+						vector<Candidate> &all, size_t begin)
+{
+	for (size_t i = begin; i < all.size(); i++) {
+		Candidate *c = &all[i];
+		Robot *r = &robots[0];
+		pool.Submit([r, c, &gait, cycles](unsigned worker) { Evaluate(r[worker], gait, cycles, *c); });
+	}
+	pool.Wait();
+}
+
+static float Clamp(float v, const ParamRange &r)
+{
+	return v < r.min ? r.min : v > r.max ? r.max : v;
+}
+
+// Every combination of steps values per parameter, evenly spaced over the ranges
+static void SearchGrid(vector<Candidate> &all, uint32_t steps)
+{
+	size_t total = 1;
+	for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+		total *= steps;
+	for (size_t n = 0; n < total; n++) {
+		Candidate c;
+		size_t k = n;
+		for (size_t i = 0; i < OPT_PARAM_NUM; i++, k /= steps) {
+			float t = (steps > 1) ? (float)(k % steps) / (steps - 1) : 0.5f;
+			c.p[i] = opt_params[i].min + t * (opt_params[i].max - opt_params[i].min);
+		}
+		all.push_back(c);
+	}
+}
+
+static void SearchRandom(vector<Candidate> &all, uint32_t count, mt19937 &rng)
+{
+	for (uint32_t n = 0; n < count; n++) {
+		Candidate c;
+		for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+			c.p[i] = uniform_real_distribution<float>(opt_params[i].min, opt_params[i].max)(rng);
+		all.push_back(c);
+	}
+}
+
+/**
+ * An evolution strategy in the style of CMA-ES with a diagonal covariance:
+ * each generation samples around a mean, moves the mean to the weighted
+ * best half and adapts each parameter's step size to their spread
+ * (rank-mu update). Speed and travel are two objectives, so several
+ * islands run side by side, each ranking by its own weighting of the two
+ * (normalised by the first generation), which spreads them along the front.
+ * Every generation of every island is evaluated as one parallel batch.
+ */
+static void SearchEs(WorkPool &pool, vector<Robot> &robots, const string &gait, uint32_t cycles,
+					 vector<Candidate> &all, uint32_t budget, const Candidate &start, mt19937 &rng)
+{
+	double mean[OPT_ES_ISLANDS][OPT_PARAM_NUM], sigma[OPT_ES_ISLANDS][OPT_PARAM_NUM];
+	double weights[OPT_ES_MU], wsum = 0;
+	for (int i = 0; i < OPT_ES_MU; i++)
+		wsum += weights[i] = log(OPT_ES_MU + 0.5) - log(i + 1.0);
+	for (int i = 0; i < OPT_ES_MU; i++)
+		weights[i] /= wsum;
+	for (int k = 0; k < OPT_ES_ISLANDS; k++) {
+		for (size_t i = 0; i < OPT_PARAM_NUM; i++) {
+			// Islands start around the hand-tuned parameters
+			mean[k][i] = (start.p[i] - opt_params[i].min) / (opt_params[i].max - opt_params[i].min);
+			sigma[k][i] = OPT_ES_SIGMA0;
+		}
+	}
+	double speedScale = 0, travelScale = 0;
+	normal_distribution<double> gauss(0, 1);
+	for (uint32_t used = 0; used + OPT_ES_ISLANDS * OPT_ES_LAMBDA <= budget; used += OPT_ES_ISLANDS * OPT_ES_LAMBDA) {
+		size_t begin = all.size();
+		vector<vector<double> > z(OPT_ES_ISLANDS * OPT_ES_LAMBDA, vector<double>(OPT_PARAM_NUM));
+		for (int n = 0; n < OPT_ES_ISLANDS * OPT_ES_LAMBDA; n++) {
+			Candidate c;
+			for (size_t i = 0; i < OPT_PARAM_NUM; i++) {
+				// Sampled in units of each range, clamped into it
+				double u = mean[n / OPT_ES_LAMBDA][i] + sigma[n / OPT_ES_LAMBDA][i] * gauss(rng);
+				z[n][i] = u < 0 ? 0 : u > 1 ? 1 : u;
+				c.p[i] = Clamp(opt_params[i].min + z[n][i] * (opt_params[i].max - opt_params[i].min), opt_params[i]);
+			}
+			all.push_back(c);
+		}
+		EvaluateAll(pool, robots, gait, cycles, all, begin);
+
+		if (speedScale == 0) {
+			for (size_t n = begin; n < all.size(); n++) {
+				if (all[n].valid) {
+					speedScale = max(speedScale, all[n].speed);
+					travelScale = max(travelScale, all[n].travel);
+				}
+			}
+			if (speedScale == 0)
+				continue;
+		}
+		for (int k = 0; k < OPT_ES_ISLANDS; k++) {
+			double w = (double)k / (OPT_ES_ISLANDS - 1);
+			vector<pair<double, int> > rank;
+			for (int j = 0; j < OPT_ES_LAMBDA; j++) {
+				const Candidate &c = all[begin + k * OPT_ES_LAMBDA + j];
+				// Higher is better; invalid candidates rank last
+				double score = c.valid ? w * c.speed / speedScale - (1 - w) * c.travel / travelScale : -1e9;
+				rank.push_back(make_pair(-score, k * OPT_ES_LAMBDA + j));
+			}
+			sort(rank.begin(), rank.end());
+			for (size_t i = 0; i < OPT_PARAM_NUM; i++) {
+				double m = 0, var = 0;
+				for (int r = 0; r < OPT_ES_MU; r++)
+					m += weights[r] * z[rank[r].second][i];
+				for (int r = 0; r < OPT_ES_MU; r++)
+					var += weights[r] * (z[rank[r].second][i] - mean[k][i]) * (z[rank[r].second][i] - mean[k][i]);
+				mean[k][i] = m;
+				double s2 = (1 - OPT_ES_CSIGMA) * sigma[k][i] * sigma[k][i] + OPT_ES_CSIGMA * var;
+				sigma[k][i] = max(sqrt(s2), (double)OPT_ES_SIGMA_MIN);
+			}
+		}
+	}
+}
+
+// The valid candidates no other one beats on both speed and travel, fastest first
+static vector<Candidate> ParetoFront(const vector<Candidate> &all)
+{
+	vector<Candidate> sorted;
+	for (size_t i = 0; i < all.size(); i++)
+		if (all[i].valid)
+			sorted.push_back(all[i]);
+	sort(sorted.begin(), sorted.end(), [](const Candidate &a, const Candidate &b) {
+		return a.speed != b.speed ? a.speed > b.speed : a.travel < b.travel;
+	});
+	// Going down in speed, a candidate is on the front if it needs less travel than every faster one
+	vector<Candidate> front;
+	for (size_t i = 0; i < sorted.size(); i++)
+		if (front.empty() || sorted[i].travel < front.back().travel)
+			front.push_back(sorted[i]);
+	return front;
+}
+
+static void PrintCandidate(FILE *out, const char *prefix, const Candidate &c)
+{
+	fprintf(out, "%s%7.2f mm/s %7.0f deg/m travel %6.0f mm/m slip:", prefix, c.speed, c.travel, c.slip);
+	for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+		fprintf(out, " %s=%.1f", opt_params[i].name, c.p[i]);
+	fprintf(out, "\n");
+}
+
+// Writes a gait file of param lines, for SPIDER_GAITS or spider -g
+static bool ExportParams(const char *path, const string &gait, const Candidate &c)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "ERROR: could not create \"%s\"...\n", path);
+		return false;
+	}
+	fprintf(f, "# Found by gaitopt for %s: %.2f mm/s, %.0f degrees of servo travel per metre\n",
+			gait.c_str(), c.speed, c.travel);
+	for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+		fprintf(f, "param %s %g\n", opt_params[i].name, c.p[i]);
+	fclose(f);
+	return true;
+}
+
+static void usage(const char *name)
+{
+	cerr << "Usage: " << name << " [-m grid|random|es] [-b <budget>] [-g <steps>] [-n <cycles>]" << endl
+		 << "       [-t <threads>] [-s <seed>] [-o <file> [-k <entry>]] [gait]" << endl
+		 << "  -m      search: a grid of -g steps per parameter, -b random candidates, or an" << endl
+		 << "          evolution strategy using -b evaluations (default es)" << endl
+		 << "  -n      gait cycles measured per candidate (default " << OPT_DEFAULT_CYCLES << ")" << endl
+		 << "  -t      worker threads (default: one per CPU)" << endl
+		 << "  -o, -k  write Pareto front entry k (default 1, the fastest) as a parameter file" << endl
+		 << "The gait defaults to forward." << endl;
+}
+
+/**
+ * Searches the gait parameters for the best trade-offs between walking
+ * speed and servo travel on the simulated robot (see ServoSim), and
+ * prints the Pareto front. Candidates run in parallel, one simulated
+ * robot per worker of a work-stealing pool.
+ */
+int main(int argc, char *argv[])
+{
+	string method = "es", gait = "forward";
+	uint32_t budget = OPT_DEFAULT_BUDGET, steps = OPT_DEFAULT_GRID_STEPS, cycles = OPT_DEFAULT_CYCLES;
+	unsigned threads = 0, seed = 1, entry = 1;
+	const char *out = NULL;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg += 2) {
+		string opt = argv[arg];
+		if (arg + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		const char *v = argv[arg + 1];
+		if (opt == "-m")
+			method = v;
+		else if (opt == "-b")
+			budget = atoi(v);
+		else if (opt == "-g")
+			steps = atoi(v);
+		else if (opt == "-n")
+			cycles = atoi(v);
+		else if (opt == "-t")
+			threads = atoi(v);
+		else if (opt == "-s")
+			seed = atoi(v);
+		else if (opt == "-o")
+			out = v;
+		else if (opt == "-k")
+			entry = atoi(v);
+		else
+			method = "";
+	}
+	if (arg < argc)
+		gait = argv[arg++];
+	if (arg != argc || (method != "grid" && method != "random" && method != "es") || steps == 0 || cycles == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Every robot is simulated, privately; nothing may be shared between the workers
+	setenv(MMAP_BACKEND_ENV, "anon", 1);
+	unsetenv(MMAP_SIM_READY_ENV);
+	unsetenv(RECORD_FILE_ENV);
+	unsetenv(WAIT_STRATEGY_ENV);
+	WorkPool pool(threads);
+	vector<Robot> robots(pool.Size());
+	mt19937 rng(seed);
+	uint64_t wallStart = RealNs();
+
+	// The hand-tuned parameters, as the reference
+	const float builtin[OPT_PARAM_NUM] = { Knee_Up_Base, Knee_Down_Base, HipF_Base, HipM_Base, HipB_Base, Ankle_Base, Swing_Base };
+	vector<Candidate> all(1);
+	for (size_t i = 0; i < OPT_PARAM_NUM; i++)
+		all[0].p[i] = builtin[i];
+	EvaluateAll(pool, robots, gait, cycles, all, 0);
+	if (!all[0].valid) {
+		fprintf(stderr, "ERROR: gait \"%s\" does not walk with the built-in parameters...\n", gait.c_str());
+		return 1;
+	}
+	Candidate baseline = all[0];
+
+	if (method == "grid") {
+		SearchGrid(all, steps);
+		EvaluateAll(pool, robots, gait, cycles, all, 1);
+	} else if (method == "random") {
+		SearchRandom(all, budget, rng);
+		EvaluateAll(pool, robots, gait, cycles, all, 1);
+	} else {
+		SearchEs(pool, robots, gait, cycles, all, budget, baseline, rng);
+	}
+	double wall = (RealNs() - wallStart) / 1e9;
+
+	size_t valid = 0;
+	for (size_t i = 0; i < all.size(); i++)
+		valid += all[i].valid;
+	printf("%zu candidates (%zu valid) of %s in %.2f s on %u threads: %.0f per second\n", all.size(), valid,
+		   gait.c_str(), wall, pool.Size(), all.size() / wall);
+	PrintCandidate(stdout, "Built-in: ", baseline);
+	vector<Candidate> front = ParetoFront(all);
+	printf("Pareto front, speed against servo travel:\n");
+	for (size_t i = 0; i < front.size(); i++) {
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "%3zu: ", i + 1);
+		PrintCandidate(stdout, prefix, front[i]);
+	}
+	if (out != NULL) {
+		if (entry < 1 || entry > front.size()) {
+			fprintf(stderr, "ERROR: the front has no entry %u...\n", entry);
+			return 1;
+		}
+		if (!ExportParams(out, gait, front[entry - 1]))
+			return 1;
+		printf("Wrote entry %u to %s\n", entry, out);
+	}
+	return 0;
+}
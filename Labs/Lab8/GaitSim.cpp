@@ -0,0 +1,150 @@
+#include <iostream>
+#include <stdlib.h>
+#include "ServoSim.cpp"
+#include "Spider.cpp"
+
+using namespace std;
+
+#define GAITSIM_DEFAULT_CYCLES 100
+
+// CLOCK_MONOTONIC, which MonotonicNs() no longer reads once the simulation's clock is installed
+static uint64_t RealNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Runs one cycle of a gait: a named gait once, or for "forward" and
+ * "backward" a step of each tripod, as Spider::MoveForward alternates them.
+ * Each tripod step is planned once the previous one has run, since the
+ * tripod stepped last only advances when a step runs.
+ * @return false if there is no such gait or a step failed
+ */
+static bool RunCycle(Spider &spider, const string &name)
+{
+	MotionPlan plan;
+	if (name == "forward" || name == "backward") {
+		Spider::MOTION_ID motion = (name == "forward") ? Spider::MOTION_FORWARD : Spider::MOTION_BACKWARD;
+		for (int i = 0; i < 2; i++) {
+			plan.clear();
+			spider.Plan(motion, plan);
+			if (!spider.RunPlan(plan))
+				return false;
+		}
+		return true;
+	}
+	if (spider.GetGaits()->Find(name) == NULL) {
+		fprintf(stderr, "ERROR: unknown gait \"%s\"...\n", name.c_str());
+		return false;
+	}
+	return spider.PlanGait(name, plan) && spider.RunPlan(plan);
+}
+
+// The gaits measured by default: those that go somewhere, not the set-up ones or single tripod steps
+static vector<string> DefaultGaits(Spider &spider)
+{
+	vector<string> names(1, "forward");
+	names.push_back("backward");
+	vector<string> all = spider.GetGaits()->Names();
+	for (size_t i = 0; i < all.size(); i++) {
+		const string &n = all[i];
+		bool step = n.size() > 3 && (n.compare(n.size() - 3, 3, "_t1") == 0 || n.compare(n.size() - 3, 3, "_t2") == 0);
+		if (!step && n != "init" && n != "standup" && n != "reset")
+			names.push_back(n);
+	}
+	return names;
+}
+
+static void usage(const char *name)
+{
+	cerr << "Usage: " << name << " [-n <cycles>] [-c] [gait...]" << endl
+		 << "  -n <cycles>  cycles of each gait (default " << GAITSIM_DEFAULT_CYCLES << ")" << endl
+		 << "  -c           print comma separated values" << endl
+		 << "Gaits are named as in the gait files, plus forward and backward (a step of" << endl
+		 << "each tripod); by default every gait that moves the body is run." << endl;
+}
+
+/**
+ * Runs gaits on the simulated robot (see ServoSim) in virtual time and
+ * prints, per gait, how far and how fast one cycle moves the body, how
+ * much the planted feet slip and how much MMIO it takes. The spider is
+ * configured from the environment as usual (SPIDER_GAITS, SPIDER_CAL,
+ * SPIDER_PIPELINE, SPIDER_PROFILE, ...), so gait changes can be compared.
+ */
+int main(int argc, char *argv[])
+{
+	uint32_t cycles = GAITSIM_DEFAULT_CYCLES;
+	bool csv = false;
+	int arg = 1;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		string opt = argv[arg];
+		if (opt == "-n" && arg + 1 < argc && atoi(argv[arg + 1]) > 0) {
+			cycles = atoi(argv[++arg]);
+		} else if (opt == "-c") {
+			csv = true;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Always simulated: the registers are private memory and the servos are modelled
+	setenv(MMAP_BACKEND_ENV, "anon", 1);
+	unsetenv(MMAP_SIM_READY_ENV);
+	ServoSim sim;
+	SetVirtualClock(&sim);
+	Spider spider;
+	MMap *mmio = spider.GetMMIO();
+	sim.Attach(mmio);
+	// An interrupt would have to come from the model; poll it instead
+	if (spider.GetWaiter()->GetStrategy() == ReadyWaiter::WAIT_IRQ)
+		spider.GetWaiter()->SetStrategy(ReadyWaiter::WAIT_BACKOFF);
+	uint64_t setup = MonotonicNs();
+	spider.Init();
+	spider.Standup();
+	if (!csv)
+		printf("Init and stand-up: %.2f s\n", (MonotonicNs() - setup) / 1e9);
+
+	vector<string> gaits;
+	for (; arg < argc; arg++)
+		gaits.push_back(argv[arg]);
+	if (gaits.empty())
+		gaits = DefaultGaits(spider);
+
+	if (csv)
+		printf("gait,cycles,mm_per_cycle,deg_per_cycle,cycles_per_s,slip_mm_per_cycle,stride_mm,writes_per_cycle,reads_per_cycle\n");
+	else
+		printf("%-12s %8s %10s %10s %9s %10s %9s %10s %10s\n", "gait", "cycles", "mm/cycle", "deg/cycle",
+			   "cycles/s", "slip mm", "stride mm", "writes", "reads");
+	uint64_t wallStart = RealNs();
+	double simSeconds = 0;
+	int status = 0;
+	for (size_t g = 0; g < gaits.size(); g++) {
+		// Every gait starts from the standing stance, at the origin
+		spider.Reset();
+		sim.ResetMotion();
+		mmio->ResetCounters();
+		uint64_t start = MonotonicNs();
+		bool ok = true;
+		for (uint32_t c = 0; c < cycles && ok; c++)
+			ok = RunCycle(spider, gaits[g]);
+		if (!ok) {
+			status = 1;
+			continue;
+		}
+		double seconds = (MonotonicNs() - start) / 1e9;
+		simSeconds += seconds;
+		const ServoSim::Motion &m = sim.GetMotion();
+		double stride = m.strides ? m.strideMm / m.strides : 0;
+		printf(csv ? "%s,%u,%.2f,%.2f,%.3f,%.2f,%.2f,%.1f,%.1f\n" : "%-12s %8u %10.2f %10.2f %9.3f %10.2f %9.2f %10.1f %10.1f\n",
+			   gaits[g].c_str(), cycles, hypot(m.x, m.y) / cycles, m.yaw / cycles, cycles / seconds,
+			   m.slipMm / cycles, stride, (double)mmio->GetWriteCount() / cycles,
+			   (double)mmio->GetReadCount() / cycles);
+	}
+	double wall = (RealNs() - wallStart) / 1e9;
+	if (!csv)
+		printf("Simulated %.1f s in %.2f s of real time\n", simSeconds, wall);
+	return status;
+}
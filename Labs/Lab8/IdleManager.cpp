@@ -0,0 +1,140 @@
+#ifndef IDLEMANAGER_CPP_
+#define IDLEMANAGER_CPP_
+#include "SpiderLeg.cpp"
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+// Environment variable enabling the idle power-down:
+//   SPIDER_IDLE=<timeout ms>[:hips|all]
+#define IDLE_ENV "SPIDER_IDLE"
+
+/**
+ * Releases the holding torque of idle servos. Without it all 18 servos
+ * hold torque, drawing current, for as long as the robot waits for a
+ * command. Once none of a leg's servos has been commanded for the
+ * timeout, its joints that bear no load are released through PWM_ABORT
+ * (see ServoFrame::Release). The next movement re-arms every released
+ * servo in one register batch before it issues anything; the servos take
+ * up their torque again at their next PWM period, together with the
+ * movement's first frame.
+ *
+ * Only the hips are released by default. They turn about a vertical axis,
+ * so the body's weight does not turn them, while knees and ankles carry
+ * it. Releasing all joints lets the body settle, so it is only for a
+ * robot on a stand.
+ */
+class IdleManager
+{
+public:
+	typedef struct
+	{
+		uint64_t wakes;     // Movements that found servos released
+		uint64_t lastArmNs; // Time taken to re-arm them, for the most recent one
+		uint64_t maxArmNs;  // Longest re-arm
+	} Stats;
+
+private:
+	uint64_t m_timeoutNs;
+	// Joints released when idle, bit per SpiderLeg::JOINT_ID
+	uint32_t m_joints;
+	Stats m_stats;
+	// Guards m_stats against GetStats() on another thread
+	std::mutex m_statsMutex;
+
+public:
+	IdleManager()
+	{
+		m_timeoutNs = 0;
+		m_joints = 1u << SpiderLeg::Hip;
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	/**
+	 * Configures the timeout and the joints released from $SPIDER_IDLE, if
+	 * it is set.
+	 * @return false if the variable cannot be parsed
+	 */
+	bool ConfigureFromEnv()
+	{
+		const char *value = getenv(IDLE_ENV);
+		if (value == NULL)
+			return true;
+		char *end;
+		unsigned long ms = strtoul(value, &end, 10);
+		if (end == value || (*end != '\0' && strcmp(end, ":hips") != 0 && strcmp(end, ":all") != 0)) {
+			fprintf(stderr, "ERROR: %s must be <timeout ms>[:hips|all], not \"%s\"...\n", IDLE_ENV, value);
+			return false;
+		}
+		SetTimeoutMs(ms);
+		m_joints = (strcmp(end, ":all") == 0) ? (1u << SpiderLeg::JOINT_NUM) - 1 : 1u << SpiderLeg::Hip;
+		return true;
+	}
+
+	// Sets how long a leg must be idle before its joints are released, 0 to never release them
+	void SetTimeoutMs(uint32_t ms) { m_timeoutNs = (uint64_t)ms * 1000000; }
+	uint32_t GetTimeoutMs() { return (uint32_t)(m_timeoutNs / 1000000); }
+	// Sets the joints released when idle, bit per SpiderLeg::JOINT_ID
+	void SetJoints(uint32_t joints) { m_joints = joints; }
+	bool IsEnabled() { return m_timeoutNs != 0; }
+
+	// May be called from any thread
+	Stats GetStats()
+	{
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		return m_stats;
+	}
+
+	/**
+	 * Releases the joints of the legs idle for the timeout. Call it between
+	 * movements, on the thread that drives the servos.
+	 * @return when the next leg becomes idle (MonotonicNs() time base), or
+	 * 0 if there is none left to release
+	 */
+	uint64_t Poll(ServoFrame &frame, MMap *mmio, SpiderLeg *const legs[], int legNum)
+	{
+		if (m_timeoutNs == 0)
+			return 0;
+		uint64_t now = MonotonicNs(), next = 0;
+		uint32_t release = 0;
+		for (int i = 0; i < legNum; i++) {
+			uint32_t joints = 0;
+			uint64_t last = 0;
+			for (int j = 0; j < SpiderLeg::JOINT_NUM; j++) {
+				uint32_t id = legs[i]->GetMotor((SpiderLeg::JOINT_ID)j)->GetMotorID();
+				if (m_joints & (1u << j))
+					joints |= 1u << id;
+				if (frame.GetLastWriteNs(id) > last)
+					last = frame.GetLastWriteNs(id);
+			}
+			joints &= frame.GetPulsed() & ~frame.GetReleased();
+			if (joints == 0)
+				continue;
+			if (now >= last + m_timeoutNs)
+				release |= joints;
+			else if (next == 0 || last + m_timeoutNs < next)
+				next = last + m_timeoutNs;
+		}
+		frame.Release(mmio, release);
+		return next;
+	}
+
+	/**
+	 * Re-arms every released servo. Call it before a movement issues
+	 * anything.
+	 */
+	void Wake(ServoFrame &frame, MMap *mmio)
+	{
+		if (frame.GetReleased() == 0)
+			return;
+		uint64_t start = MonotonicNs();
+		frame.Arm(mmio, frame.GetReleased());
+		std::lock_guard<std::mutex> lock(m_statsMutex);
+		m_stats.wakes++;
+		m_stats.lastArmNs = MonotonicNs() - start;
+		if (m_stats.lastArmNs > m_stats.maxArmNs)
+			m_stats.maxArmNs = m_stats.lastArmNs;
+	}
+};
+
+#endif /* IDLEMANAGER_CPP_ */
@@ -0,0 +1,164 @@
+#ifndef KINEMATICS_CPP_
+#define KINEMATICS_CPP_
+#include <math.h>
+#include <stdint.h>
+
+// Leg segment lengths in mm: hip axis to knee axis, knee to ankle, ankle to foot tip
+#define LEG_COXA_MM 28.0f
+#define LEG_FEMUR_MM 55.0f
+#define LEG_TIBIA_MM 80.0f
+
+// Number of legs solved by one batch, padded from 6 to a multiple of the SIMD width
+#define IK_BATCH 8
+
+#define IK_PI 3.14159265358979f
+#define IK_RAD_TO_DEG (180.0f / IK_PI)
+
+/**
+ * Analytic inverse kinematics of one hip/knee/ankle leg.
+ *
+ * Positions are in the leg's frame, in mm: the origin is on the hip axis,
+ * x points outwards along the leg at hip angle 0, y points forwards (the
+ * direction a positive hip angle swings the foot) and z points up.
+ * Angles follow the servo conventions used by the gaits, before the
+ * SpiderLeg reverse flag: hip 0 is along x; knee 0 is a horizontal femur,
+ * positive raising it; ankle 0 is a tibia perpendicular to the femur,
+ * positive folding it in, so knee 45 / ankle 45 is a vertical tibia.
+ */
+class LegIK
+{
+public:
+	typedef struct
+	{
+		float hip;
+		float knee;
+		float ankle;
+	} Joints;
+
+	/**
+	 * Foot positions of up to IK_BATCH legs as a structure of arrays, so
+	 * the batch solver's loops run over contiguous lanes.
+	 */
+	typedef struct
+	{
+		float x[IK_BATCH];
+		float y[IK_BATCH];
+		float z[IK_BATCH];
+	} FootBatch;
+
+	typedef struct
+	{
+		float hip[IK_BATCH];
+		float knee[IK_BATCH];
+		float ankle[IK_BATCH];
+		// Bit i is set if leg i's foot position is reachable
+		uint32_t reachable;
+	} JointBatch;
+
+	/**
+	 * Solves one leg.
+	 * @return false, leaving joints unchanged, if the position is out of reach
+	 */
+	static bool Solve(float x, float y, float z, Joints &joints)
+	{
+		float r = sqrtf(x * x + y * y) - LEG_COXA_MM;
+		float d2 = r * r + z * z;
+		float d = sqrtf(d2);
+		if (d > LEG_FEMUR_MM + LEG_TIBIA_MM || d < fabsf(LEG_FEMUR_MM - LEG_TIBIA_MM) || d == 0)
+			return false;
+		// Angle between the femur and the hip-to-foot line, knee above the line
+		float beta = acosf((LEG_FEMUR_MM * LEG_FEMUR_MM + d2 - LEG_TIBIA_MM * LEG_TIBIA_MM) / (2 * LEG_FEMUR_MM * d));
+		float femur = atan2f(z, r) + beta;
+		float tibia = atan2f(z - LEG_FEMUR_MM * sinf(femur), r - LEG_FEMUR_MM * cosf(femur));
+		joints.hip = atan2f(y, x) * IK_RAD_TO_DEG;
+		joints.knee = femur * IK_RAD_TO_DEG;
+		joints.ankle = (femur - tibia) * IK_RAD_TO_DEG - 90;
+		return true;
+	}
+
+	/**
+	 * Forward kinematics: where the foot is for the given joint angles.
+	 */
+	static void Forward(const Joints &joints, float &x, float &y, float &z)
+	{
+		float femur = joints.knee / IK_RAD_TO_DEG;
+		float tibia = (joints.knee - joints.ankle - 90) / IK_RAD_TO_DEG;
+		float hip = joints.hip / IK_RAD_TO_DEG;
+		float r = LEG_COXA_MM + LEG_FEMUR_MM * cosf(femur) + LEG_TIBIA_MM * cosf(tibia);
+		x = r * cosf(hip);
+		y = r * sinf(hip);
+		z = LEG_FEMUR_MM * sinf(femur) + LEG_TIBIA_MM * sinf(tibia);
+	}
+
+	/**
+	 * Solves count legs at once. The loops have no branches and use
+	 * polynomial approximations instead of libm calls (error below 0.01
+	 * degree, finer than the servos' 0.1 degree steps), so the compiler
+	 * can vectorise them. Out of reach legs get clamped angles and a clear
+	 * bit in out.reachable.
+	 */
+	static void SolveBatch(const FootBatch &in, JointBatch &out, int count = IK_BATCH)
+	{
+		const float L2 = LEG_FEMUR_MM, L3 = LEG_TIBIA_MM;
+		float reach[IK_BATCH], tibiaR[IK_BATCH], tibiaZ[IK_BATCH];
+		uint32_t reachable = 0;
+
+		for (int i = 0; i < IK_BATCH; i++) {
+			float x = in.x[i], y = in.y[i], z = in.z[i];
+			float r = sqrtf(x * x + y * y) - LEG_COXA_MM;
+			float d2 = r * r + z * z + 1e-6f;
+			float d = sqrtf(d2);
+			float c = (L2 * L2 + d2 - L3 * L3) / (2 * L2 * d);
+			c = fminf(fmaxf(c, -1.0f), 1.0f);
+			float beta = fastAtan2(sqrtf(1 - c * c), c);
+			float femur = fastAtan2(z, r) + beta;
+			out.hip[i] = fastAtan2(y, x) * IK_RAD_TO_DEG;
+			out.knee[i] = femur * IK_RAD_TO_DEG;
+			// The tibia runs from the end of the femur to the foot
+			tibiaR[i] = r - L2 * fastCos(femur);
+			tibiaZ[i] = z - L2 * fastCos(femur - IK_PI / 2);
+			reach[i] = d;
+		}
+		for (int i = 0; i < IK_BATCH; i++)
+			out.ankle[i] = out.knee[i] - fastAtan2(tibiaZ[i], tibiaR[i]) * IK_RAD_TO_DEG - 90;
+		for (int i = 0; i < count; i++)
+			if (reach[i] <= L2 + L3 && reach[i] >= fabsf(L2 - L3))
+				reachable |= 1u << i;
+		out.reachable = reachable;
+	}
+
+private:
+	// atan(t) for |t| <= 1, minimax polynomial
+	static float atanUnit(float t)
+	{
+		float t2 = t * t;
+		return t * (0.99997726f + t2 * (-0.33262347f + t2 * (0.19354346f + t2 * (-0.11643287f
+				+ t2 * (0.05265332f + t2 * -0.01172120f)))));
+	}
+
+	// Branch-free atan2, absolute error about 1e-5 rad
+	static float fastAtan2(float y, float x)
+	{
+		float ax = fabsf(x), ay = fabsf(y);
+		float mx = fmaxf(ax, ay), mn = fminf(ax, ay);
+		float a = atanUnit(mn / (mx + 1e-30f));
+		a = (ay > ax) ? IK_PI / 2 - a : a;
+		a = (x < 0) ? IK_PI - a : a;
+		return (y < 0) ? -a : a;
+	}
+
+	// cos(a) for |a| <= 2 pi, via range reduction to [-pi, pi] and a polynomial
+	static float fastCos(float a)
+	{
+		a = (a > IK_PI) ? a - 2 * IK_PI : a;
+		a = (a < -IK_PI) ? a + 2 * IK_PI : a;
+		// cos is even; fold [pi/2, pi] onto [0, pi/2] with a sign flip
+		float s = fabsf(a);
+		float sign = (s > IK_PI / 2) ? -1.0f : 1.0f;
+		s = (s > IK_PI / 2) ? IK_PI - s : s;
+		float s2 = s * s;
+		return sign * (1 + s2 * (-0.5f + s2 * (1 / 24.0f + s2 * (-1 / 720.0f + s2 * (1 / 40320.0f)))));
+	}
+};
+
+#endif /* KINEMATICS_CPP_ */
@@ -1,49 +1,162 @@
 #include "MMap.h"
+#include "RegRecorder.cpp"
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+
+// The recorder opened from $SPIDER_RECORD. Its ring takes a single producer,
+// so only one MMap at a time, the one holding s_envRecorderTaken, records into it
+static RegRecorder s_envRecorder;
+static std::atomic<bool> s_envRecorderTaken(false);
 
 #define H2F_LW_REGS_BASE ( 0xfc000000 )
 #define H2F_LW_REGS_SPAN ( 0x04000000 )
 #define PWM_PHYS_START   ( 0xff200000 )
 
-#define START_OFFSET (PWM_PHYS_START - H2F_LW_REGS_BASE)
-
 MMap::MMap() {
+	const char *name = getenv(MMAP_BACKEND_ENV);
+	m_backend = BACKEND_DEVMEM;
+	m_path = MMAP_DEFAULT_REG_FILE;
+	if (name != NULL && !ParseBackend(name, m_backend, m_path))
+		fprintf(stderr, "ERROR: unknown %s backend \"%s\", using /dev/mem...\n", MMAP_BACKEND_ENV, name);
+	init();
+	if (m_backend != BACKEND_DEVMEM && (name = getenv(MMAP_SIM_READY_ENV)) != NULL)
+		SetSimReadyDelay(strtoul(name, NULL, 0));
+	if ((name = getenv(RECORD_FILE_ENV)) != NULL) {
+		bool taken = false;
+		if (!s_envRecorderTaken.compare_exchange_strong(taken, true))
+			fprintf(stderr, "ERROR: %s is already recording another MMap, not recording this one...\n", RECORD_FILE_ENV);
+		else if (s_envRecorder.IsOpen() || s_envRecorder.Open(name))
+			m_recorder = &s_envRecorder;
+		else
+			s_envRecorderTaken = false;
+	}
+	mapDevices();
+}
+
+MMap::MMap(BACKEND backend, const char *path) {
+	m_backend = backend;
+	m_path = path;
+	init();
+	mapDevices();
+}
+
+/**
+ * Set-up shared by the constructors, once m_backend is known: clears the
+ * mapping state and counters.
+ */
+void MMap::init() {
 	m_fd = -1;
 	m_virtual_base = MAP_FAILED;
-	map(H2F_LW_REGS_BASE, H2F_LW_REGS_SPAN);
+	// A register file may be written by other processes (e.g. the simulator),
+	// which the shadow would not see
+	m_shadowEnabled = m_backend != BACKEND_FILE;
+	InvalidateShadow();
+	m_simReadyNs = 0;
+	m_model = NULL;
+	m_recorder = NULL;
+	m_lastFrameNs = 0;
+	ResetCounters();
+	m_batch.reserve(MOTOR_NUM * MOTOR_REG_NUM);
 }
 
 MMap::~MMap(){
 	unmap();
+	if (m_recorder == &s_envRecorder)
+		s_envRecorderTaken = false;
+}
+
+/**
+ * Parses a backend name as accepted in $SPIDER_MMIO.
+ * @param name - "devmem", "anon", "file" or "file:<path>"
+ * @param backend - receives the backend
+ * @param path - receives the register file path when one is given
+ * @return false if the name is not recognised, in which case nothing is changed
+ */
+bool MMap::ParseBackend(const char *name, BACKEND &backend, std::string &path) {
+	if (strcmp(name, "devmem") == 0) {
+		backend = BACKEND_DEVMEM;
+	} else if (strcmp(name, "anon") == 0) {
+		backend = BACKEND_ANON;
+	} else if (strcmp(name, "file") == 0) {
+		backend = BACKEND_FILE;
+	} else if (strncmp(name, "file:", 5) == 0 && name[5] != '\0') {
+		backend = BACKEND_FILE;
+		path = name + 5;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Maps the smallest page-aligned window of the lightweight bridge that
+ * covers every device in hps_0.h (a single page on the DE10), instead of
+ * the whole H2F_LW_REGS_SPAN, and records where PWM_PHYS_START falls in it.
+ * @return true if mapping created successfully, else false
+ */
+bool MMap::mapDevices() {
+	uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+	uint32_t base = (PWM_PHYS_START + RegMap::DEVICES_START) & ~(page - 1);
+	uint32_t end = (PWM_PHYS_START + RegMap::DEVICES_END + page - 1) & ~(page - 1);
+	m_start_offset = PWM_PHYS_START - base;
+	return map(base, end - base);
 }
 
 /**
  * An internal method that uses mmap to establish a device memory mapping.
  * If an error occurs is prints a message to stderr and returns false.
+ * For the simulated backends the same span is mapped from a register file
+ * or from anonymous memory, so register offsets are unchanged.
  * @param addr_base - The base physical address of the device to map
  * @param addr_span - The number of bytes to map, from addr_base
  * @return true if mapping created successfully, else false
  */
 bool MMap::map(uint32_t addr_base, uint32_t addr_span) {
-	
+
 	bool bSuccess = false;
-	int fd;
+	int fd = -1;
 	void *virtual_base;
-	m_addr_span = addr_span;
 
 	unmap();
+	InvalidateShadow();
+	m_addr_span = addr_span;
 
-	if ( ( fd = open( "/dev/mem", ( O_RDWR | O_SYNC ) ) ) == -1 ) {
-		fprintf(stderr, "ERROR: could not open \"/dev/mem\"...\n");
-	} else {
+	switch (m_backend) {
+	case BACKEND_DEVMEM:
+		if ( ( fd = open( "/dev/mem", ( O_RDWR | O_SYNC ) ) ) == -1 ) {
+			fprintf(stderr, "ERROR: could not open \"/dev/mem\"...\n");
+			return false;
+		}
 		virtual_base = mmap( NULL, addr_span, ( PROT_READ | PROT_WRITE ), MAP_SHARED, fd, addr_base );
-		if ( virtual_base == MAP_FAILED ) {
-			fprintf(stderr, "ERROR: mmap() failed...\n");
+		break;
+	case BACKEND_FILE:
+		if ( ( fd = open( m_path.c_str(), ( O_RDWR | O_CREAT ), 0666 ) ) == -1 ) {
+			fprintf(stderr, "ERROR: could not open \"%s\"...\n", m_path.c_str());
+			return false;
+		}
+		// Grow the register file to cover the window; existing contents are kept
+		// so several processes can share one simulated register file
+		if ( lseek( fd, 0, SEEK_END ) < (off_t)addr_span && ftruncate( fd, addr_span ) != 0 ) {
+			fprintf(stderr, "ERROR: could not size \"%s\"...\n", m_path.c_str());
 			close( fd );
-		} else {
-			bSuccess = true;
-			m_fd = fd;
-			m_virtual_base = virtual_base;
+			return false;
 		}
+		virtual_base = mmap( NULL, addr_span, ( PROT_READ | PROT_WRITE ), MAP_SHARED, fd, 0 );
+		break;
+	default:
+		virtual_base = mmap( NULL, addr_span, ( PROT_READ | PROT_WRITE ), MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		break;
+	}
+
+	if ( virtual_base == MAP_FAILED ) {
+		fprintf(stderr, "ERROR: mmap() failed...\n");
+		if ( fd != -1 )
+			close( fd );
+	} else {
+		bSuccess = true;
+		m_fd = fd;
+		m_virtual_base = virtual_base;
 	}
 	return bSuccess;
 }
@@ -58,8 +171,9 @@ void MMap::unmap() {
 	if (m_virtual_base != MAP_FAILED){
 		if( munmap( m_virtual_base, m_addr_span ) != 0 ) 
 			fprintf(stderr, "ERROR: munmap() failed...\n" );
-		m_virtual_base = MAP_FAILED;	
-		close( m_fd );
+		m_virtual_base = MAP_FAILED;
+		if ( m_fd != -1 )
+			close( m_fd );
 		m_fd = -1;
 	}	
 }
@@ -68,17 +182,17 @@ void MMap::unmap() {
  * @return true if the mapping has been established succesfully, else false
  */
 bool MMap::isMapped() {
-	return (m_virtual_base != MAP_FAILED) && (m_fd != -1);
+	return (m_virtual_base != MAP_FAILED) && (m_fd != -1 || m_backend == BACKEND_ANON);
 }
 
 /**
- * @return a virtual pointer to the first device register address,
- * which is (PWM_PHYS_START - H2F_LW_REGS_BASE) bytes above m_virtual_base,
- * and and then add 
+ * @return a virtual pointer to the first register of the given motor,
+ * which is m_start_offset bytes (the position of PWM_PHYS_START in the
+ * mapped window) plus the motor's device offset above m_virtual_base
  */
 uint32_t* MMap::getMotorStart(int motorId) {
 	char* tmp = (char*)m_virtual_base;
-	tmp = tmp + START_OFFSET + motor_offsets[motorId];
+	tmp = tmp + m_start_offset + RegMap::PWM_BASES[motorId];
 	return (uint32_t*)tmp;
 }
 
@@ -92,16 +206,24 @@ uint32_t* MMap::getMotorStart(int motorId) {
  * @param motorId - The motor Id
  * @param regOffset - Which 32-bit register in a motor's address range you want to write.
  * @param value - The 32-bit unsigned value to write to the register.
- * @return bool - true if the mapping currently exists and can be used, else false.
+ * @return bool - true if the mapping currently exists and can be used, else
+ * false; also false for a motor or register that does not exist.
  */
 bool MMap::Motor_Reg32_Write(uint32_t motorId, uint32_t regOffset, uint32_t value) {
-	if (m_virtual_base == MAP_FAILED)
+	if (m_virtual_base == MAP_FAILED || motorId >= MOTOR_NUM || regOffset >= MOTOR_REG_NUM)
 		return false;
+	if (!shadowUpdate(motorId, regOffset, value))
+		return true;
 	uint32_t* ptr = getMotorStart(motorId) + regOffset;
 	*ptr = value;
+	noteWrite(motorId, regOffset, value);
 	return true;
 }
 
+void MMap::recordWrite(uint32_t motorId, uint32_t regOffset, uint32_t value) {
+	m_recorder->Record(MonotonicNs(), RECORD_WRITE, motorId, regOffset, value);
+}
+
 /**
  * See MMap::Reg32_Write for documentation on how offset and index
  * should be interpreted. This performs a read operation of a register
@@ -109,11 +231,132 @@ bool MMap::Motor_Reg32_Write(uint32_t motorId, uint32_t regOffset, uint32_t valu
  * @param motorId - The motor Id
  * @param regOffset - Which 32-bit register in a motor's address range you want to read.
  * @return uint32_t - the value returned by the device register, zero extended as necessary to 32 bits.
- * returns 0 if the mapping does not exist.
+ * returns 0 if the mapping does not exist, or for a motor or register that does not exist.
  */
 uint32_t MMap::Motor_Reg32_Read(uint32_t motorId, uint32_t regOffset) {
-	if (m_virtual_base == MAP_FAILED)
+	if (m_virtual_base == MAP_FAILED || motorId >= MOTOR_NUM || regOffset >= MOTOR_REG_NUM)
 		return 0;
-	uint32_t* ptr = getMotorStart(motorId) + regOffset;
-	return *ptr;
+	m_nReads++;
+	uint32_t value;
+	if (m_simReadyNs != 0 && regOffset == PWM_READY)
+		value = MonotonicNs() >= m_simReadyAt[motorId];
+	else
+		value = *(getMotorStart(motorId) + regOffset);
+	if (m_model != NULL)
+		value = m_model->OnRead(motorId, regOffset, value);
+	if (m_recorder != NULL)
+		m_recorder->Record(MonotonicNs(), RECORD_READ, motorId, regOffset, value);
+	return value;
+}
+
+/**
+ * Makes a simulated backend emulate the PWM_READY bit: after a write to a
+ * motor's DC or DELAY register, reading its PWM_READY register returns 0
+ * until the given delay has passed and 1 afterwards. With a zero delay (the
+ * default) PWM_READY reads whatever is stored in the register file.
+ * Ignored for BACKEND_DEVMEM, where the hardware provides the ready bit.
+ * @param usec - the time a simulated motor stays busy after a move
+ */
+void MMap::SetSimReadyDelay(uint32_t usec) {
+	if (m_backend == BACKEND_DEVMEM)
+		return;
+	m_simReadyNs = (uint64_t)usec * 1000;
+	for (int i = 0; i < MOTOR_NUM; i++)
+		m_simReadyAt[i] = 0;
+}
+
+/**
+ * Writes several motor registers as one burst. The whole batch is validated
+ * before anything is written, the writes are issued in ascending register
+ * address order, and a single memory barrier follows the last one.
+ * Writes the shadow registers show to be redundant are skipped.
+ * @param writes - {motorId, regOffset, value} entries, in any order
+ * @param count - the number of entries
+ * @return bool - false (and nothing written) if the mapping does not exist
+ * or any entry names an invalid motor or register.
+ */
+bool MMap::Motor_Reg32_WriteBatch(const RegWrite *writes, size_t count) {
+	if (m_virtual_base == MAP_FAILED)
+		return false;
+	uint64_t start = MonotonicNs();
+	m_batch.clear();
+	for (size_t i = 0; i < count; i++) {
+		const RegWrite &w = writes[i];
+		if (w.motorId >= MOTOR_NUM || w.regOffset >= MOTOR_REG_NUM)
+			return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		const RegWrite &w = writes[i];
+		if (!shadowUpdate(w.motorId, w.regOffset, w.value))
+			continue;
+		simNoteWrite(w.motorId, w.regOffset, w.value);
+		uint32_t addr = RegMap::PWM_BASES[w.motorId] + w.regOffset * 4;
+		// Insertion sort; batches are short and usually close to sorted
+		size_t j = m_batch.size();
+		m_batch.push_back(std::make_pair(addr, w.value));
+		for (; j > 0 && m_batch[j - 1].first > addr; j--)
+			m_batch[j] = m_batch[j - 1];
+		m_batch[j] = std::make_pair(addr, w.value);
+	}
+	char *base = (char*)m_virtual_base + m_start_offset;
+	for (size_t i = 0; i < m_batch.size(); i++)
+		*(volatile uint32_t*)(base + m_batch[i].first) = m_batch[i].second;
+	__sync_synchronize();
+	if (m_recorder != NULL) {
+		// The batch was sorted by address; log each write with the motor and register it hit
+		for (size_t i = 0; i < m_batch.size(); i++)
+			for (uint32_t id = 0; id < MOTOR_NUM; id++)
+				if (m_batch[i].first - RegMap::PWM_BASES[id] < MOTOR_REG_NUM * 4)
+					m_recorder->Record(start, RECORD_WRITE, id, (m_batch[i].first - RegMap::PWM_BASES[id]) / 4, m_batch[i].second);
+	}
+	m_nWrites += m_batch.size();
+	m_nBatches++;
+	m_lastBatchNs = MonotonicNs() - start;
+	return true;
+}
+
+/**
+ * Writes the duty cycle register of every motor selected by motorMask as one
+ * burst, in ascending register address order, followed by a memory barrier.
+ * The registers to write are picked beforehand, so the burst itself is only
+ * the stores; its spread, from the first to the last, is kept for
+ * GetLastSpreadNs(). With a frame latch (see HasFrameLatch) the burst is
+ * written while the latch holds the PWM cores.
+ * @param dc - duty cycle per motor ID; entries not in the mask are ignored
+ * @param motorMask - bit i selects motor i (default: all motors)
+ * @return bool - true if the mapping currently exists and can be used, else false.
+ */
+bool MMap::Motor_DC_WriteFrame(const uint32_t dc[MOTOR_NUM], uint32_t motorMask) {
+	if (m_virtual_base == MAP_FAILED)
+		return false;
+	uint64_t start = MonotonicNs();
+	char *base = (char*)m_virtual_base + m_start_offset;
+	uint32_t ids[MOTOR_NUM], n = 0;
+	for (uint32_t i = 0; i < MOTOR_NUM; i++) {
+		uint32_t id = RegMap::PWM_ORDER[i];
+		if ((motorMask & (1u << id)) && shadowUpdate(id, PWM_DC, dc[id]))
+			ids[n++] = id;
+	}
+#ifdef PWM_LATCH_BASE
+	*(volatile uint32_t*)(base + PWM_LATCH_BASE) = 1;
+	__sync_synchronize();
+#endif
+	m_lastFrameNs = MonotonicNs();
+	for (uint32_t i = 0; i < n; i++) {
+		*(volatile uint32_t*)(base + RegMap::PWM_BASES[ids[i]] + PWM_DC * 4) = dc[ids[i]];
+		simNoteWrite(ids[i], PWM_DC, dc[ids[i]]);
+	}
+	__sync_synchronize();
+	m_lastSpreadNs = (n != 0) ? MonotonicNs() - m_lastFrameNs : 0;
+#ifdef PWM_LATCH_BASE
+	*(volatile uint32_t*)(base + PWM_LATCH_BASE) = 0;
+	__sync_synchronize();
+#endif
+	if (m_recorder != NULL)
+		for (uint32_t i = 0; i < n; i++)
+			m_recorder->Record(m_lastFrameNs, RECORD_WRITE, ids[i], PWM_DC, dc[ids[i]]);
+	m_nWrites += n;
+	m_nBatches++;
+	m_lastBatchNs = MonotonicNs() - start;
+	return true;
 }
@@ -3,21 +3,135 @@
 // This file contains the base offsets for each PWM_BASE circuit defined as macros
 // E.g., PWM0_BASE is defined as 0x110, PWM17_BASE is defined as 0x0
 #include "hps_0.h"
+// The same devices as types, generated from hps_0.h by gen_regmap.sh
+#include "RegMap.h"
 #include <sys/mman.h>
 #include <stdint.h>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <fcntl.h>
 #include <linux/input.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <type_traits>
 
+// Environment variable used by the default constructor to pick a backend:
+//   SPIDER_MMIO=devmem       - the real H2F bridge (default)
+//   SPIDER_MMIO=anon         - an anonymous in-process register array
+//   SPIDER_MMIO=file[:path]  - a shared register file (default path below)
+#define MMAP_BACKEND_ENV "SPIDER_MMIO"
+#define MMAP_DEFAULT_REG_FILE "/dev/shm/spider_regs"
+// With a simulated backend, SPIDER_SIM_READY_US=<usec> makes each motor
+// report not-ready for that long after a move (see SetSimReadyDelay)
+#define MMAP_SIM_READY_ENV "SPIDER_SIM_READY_US"
+
+class RegRecorder;
+
+// Number of PWM devices and of 32-bit registers in each device's block
+#define MOTOR_NUM 18
+#define MOTOR_REG_NUM (PWM0_SPAN / 4)
+static_assert(MOTOR_NUM == RegMap::PWM_NUM, "hps_0.h must have a PWM core per motor");
+
+// Use these definitions for _index_ arguments to the RegisterRead/RegisterWrite methods
+#define PWM_PERIOD 0
+#define PWM_DC 1
+#define PWM_DELAY 2
+#define PWM_READY 2
+#define PWM_ABORT 3
+
+/**
+ * A clock that replaces CLOCK_MONOTONIC, e.g. the virtual time of a
+ * simulation (see ServoSim). While one is installed with SetVirtualClock(),
+ * MonotonicNs() reads it and SleepUntilNs() advances it instead of
+ * sleeping, so a simulated run takes no longer than its computations.
+ * The clock is per thread, so simulations can run side by side on
+ * separate threads; each must keep to its own thread.
+ */
+class VirtualClock {
+public:
+	virtual ~VirtualClock() {}
+	virtual uint64_t NowNs() = 0;
+	virtual void SleepUntilNs(uint64_t t) = 0;
+};
+
+// The virtual clock installed on the calling thread, or NULL
+inline VirtualClock *&ActiveVirtualClock() {
+	static thread_local VirtualClock *s_clock = NULL;
+	return s_clock;
+}
+
+// Installs a virtual clock on the calling thread, or goes back to CLOCK_MONOTONIC with NULL
+inline void SetVirtualClock(VirtualClock *clock) { ActiveVirtualClock() = clock; }
+
+/**
+ * @return CLOCK_MONOTONIC in nanoseconds, or the virtual clock's time
+ */
+inline uint64_t MonotonicNs() {
+	if (ActiveVirtualClock() != NULL)
+		return ActiveVirtualClock()->NowNs();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Sleeps until the given MonotonicNs() time
+inline void SleepUntilNs(uint64_t t) {
+	if (ActiveVirtualClock() != NULL) {
+		ActiveVirtualClock()->SleepUntilNs(t);
+		return;
+	}
+	struct timespec ts;
+	ts.tv_sec = t / 1000000000ull;
+	ts.tv_nsec = t % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+inline void SleepNs(uint64_t ns) { SleepUntilNs(MonotonicNs() + ns); }
 
 /**
- * This object represents a memory mapped IO interface for a single device. 
+ * A model of the hardware behind a simulated backend (see ServoSim). It is
+ * told of every register write that reaches the bus and may override what
+ * a read returns, e.g. the PWM_READY bit.
+ */
+class RegModel {
+public:
+	virtual ~RegModel() {}
+	virtual void OnWrite(uint32_t motorId, uint32_t regOffset, uint32_t value) = 0;
+	// @return what the read returns, given the value held in the register memory
+	virtual uint32_t OnRead(uint32_t motorId, uint32_t regOffset, uint32_t value) = 0;
+};
+
+/**
+ * This object represents a memory mapped IO interface for a single device.
  * It manages the internal state of the memory mapping, and
  * exposes 32-bit register read and write methods to clients.
  */
 class MMap {
 
+public:
+	/**
+	 * The kinds of memory the register window can be mapped from.
+	 * All backends share the same layout, so register reads and writes
+	 * behave identically; only DEVMEM actually drives the servos.
+	 */
+	typedef enum {
+		BACKEND_DEVMEM, // The H2F lightweight bridge through /dev/mem
+		BACKEND_FILE,   // A file (e.g. on /dev/shm) shared with other processes
+		BACKEND_ANON    // An anonymous array private to this process
+	} BACKEND;
+
+	/**
+	 * One register write of a batch, see Motor_Reg32_WriteBatch.
+	 */
+	typedef struct {
+		uint32_t motorId;
+		uint32_t regOffset;
+		uint32_t value;
+	} RegWrite;
+
 private:
 	//Stores the file descriptor returned by mmap
 	int m_fd;
@@ -25,28 +139,70 @@ private:
 	void *m_virtual_base;
 	//Stores the size of the mapped memory region
 	uint32_t m_addr_span;
-
- // Use this array to translate MotorIDs to Byte Offsets into the MMIO region.
-	const uint32_t motor_offsets[18] = {
-		PWM0_BASE,
-		PWM1_BASE,
-		PWM2_BASE,
-		PWM3_BASE,
-		PWM4_BASE,
-		PWM5_BASE,
-		PWM6_BASE,
-		PWM7_BASE,
-		PWM8_BASE,
-		PWM9_BASE,
-		PWM10_BASE,
-		PWM11_BASE,
-		PWM12_BASE,
-		PWM13_BASE,
-		PWM14_BASE,
-		PWM15_BASE,
-		PWM16_BASE,
-		PWM17_BASE,
-	};
+	//Byte offset of PWM_PHYS_START from m_virtual_base
+	uint32_t m_start_offset;
+	//Which kind of memory backs the mapping
+	BACKEND m_backend;
+	//Path of the register file for BACKEND_FILE
+	std::string m_path;
+	//Number of register accesses since the last ResetCounters()
+	uint64_t m_nWrites;
+	uint64_t m_nReads;
+	uint64_t m_nBatches;
+	//Duration of the most recent batch or frame write, in nanoseconds
+	uint64_t m_lastBatchNs;
+	//When the most recent frame write started, and the time from its first register write to its last
+	uint64_t m_lastFrameNs;
+	uint64_t m_lastSpreadNs;
+	//Number of writes skipped because the shadow showed the register already held the value
+	uint64_t m_nElided;
+	//Last value written to each motor register, and which of them are known (bit per register)
+	uint32_t m_shadow[MOTOR_NUM][MOTOR_REG_NUM];
+	uint8_t m_shadowValid[MOTOR_NUM];
+	bool m_shadowEnabled;
+	//Simulated busy time after a move, and when each simulated motor becomes ready
+	uint64_t m_simReadyNs;
+	uint64_t m_simReadyAt[MOTOR_NUM];
+	//Simulated hardware, or NULL
+	RegModel *m_model;
+	//Starts the simulated busy time of a motor after a DC or DELAY write, and tells the model
+	void simNoteWrite(uint32_t motorId, uint32_t regOffset, uint32_t value) {
+		if (m_simReadyNs != 0 && (regOffset == PWM_DC || regOffset == PWM_DELAY))
+			m_simReadyAt[motorId] = MonotonicNs() + m_simReadyNs;
+		if (m_model != NULL)
+			m_model->OnWrite(motorId, regOffset, value);
+	}
+	//Scratch list of {byte offset, value} pairs used to order a batch
+	std::vector<std::pair<uint32_t, uint32_t> > m_batch;
+	//Receives every register access that reaches the bus, or NULL
+	RegRecorder *m_recorder;
+	//Logs a write that reached the bus to m_recorder
+	void recordWrite(uint32_t motorId, uint32_t regOffset, uint32_t value);
+	//Counts a write that reached the bus and tells the simulation and the recorder of it
+	void noteWrite(uint32_t motorId, uint32_t regOffset, uint32_t value) {
+		m_nWrites++;
+		simNoteWrite(motorId, regOffset, value);
+		if (m_recorder != NULL)
+			recordWrite(motorId, regOffset, value);
+	}
+	//shared constructor set-up
+	void init();
+	/**
+	 * Checks a write against the shadow registers and records the new value.
+	 * @return false if the register is known to already hold value
+	 */
+	bool shadowUpdate(uint32_t motorId, uint32_t regOffset, uint32_t value) {
+		uint8_t bit = 1u << regOffset;
+		if (m_shadowEnabled && (m_shadowValid[motorId] & bit) && m_shadow[motorId][regOffset] == value) {
+			m_nElided++;
+			return false;
+		}
+		m_shadow[motorId][regOffset] = value;
+		m_shadowValid[motorId] |= bit;
+		return true;
+	}
+	//maps the page-aligned window covering the devices in hps_0.h
+	bool mapDevices();
 	//creates the memory mapping
 	bool map(uint32_t addr_base, uint32_t addr_span);
 	//releases the memory mapping
@@ -55,16 +211,155 @@ private:
 	 * Computes the address of the beginning of the memory
 	 * region which corresponds to the given motor as a 32-bit integer pointer.
 	 * @param motorId - The motor id (between 0 and 17)
-	 * @return a pointer to the memory corresponding to the first register of the given motor 
+	 * @return a pointer to the memory corresponding to the first register of the given motor
 	 */
 	uint32_t* getMotorStart(int motorId);
 
 public:
+	//Uses the backend named by $SPIDER_MMIO, or /dev/mem if it is unset
 	MMap();
+	//Uses the given backend; path is only used by BACKEND_FILE
+	MMap(BACKEND backend, const char *path = MMAP_DEFAULT_REG_FILE);
 	virtual ~MMap();
 	bool isMapped();
+	BACKEND getBackend() { return m_backend; }
 	bool Motor_Reg32_Write(uint32_t motorId, uint32_t regOffset, uint32_t value);
 	uint32_t Motor_Reg32_Read(uint32_t motorId, uint32_t regOffset);
+	bool Motor_Reg32_WriteBatch(const RegWrite *writes, size_t count);
+
+	/**
+	 * Writes a register named by its RegMap type, e.g.
+	 * Write<RegMap::Pwm<3>::Dc>(dc). The register's address is a constant,
+	 * so the write is a single store after the shadow check, and a motor
+	 * that does not exist or a read-only register does not compile.
+	 * @return bool - true if the mapping currently exists and can be used, else false.
+	 */
+	template <typename R>
+	bool Write(uint32_t value) {
+		static_assert(R::WRITABLE, "register is read-only");
+		if (m_virtual_base == MAP_FAILED)
+			return false;
+		if (!shadowUpdate(R::Dev::ID, R::INDEX, value))
+			return true;
+		*(volatile uint32_t*)((char*)m_virtual_base + m_start_offset + R::OFFSET) = value;
+		noteWrite(R::Dev::ID, R::INDEX, value);
+		return true;
+	}
+
+	/**
+	 * Reads a register named by its RegMap type, e.g.
+	 * Read<RegMap::Pwm<3>::Ready>(). Reading a write-only register does
+	 * not compile.
+	 */
+	template <typename R>
+	uint32_t Read() {
+		static_assert(R::READABLE, "register is write-only");
+		return Motor_Reg32_Read(R::Dev::ID, R::INDEX);
+	}
+
+	/**
+	 * Writes a register of the PWM core of a motor known only at run time,
+	 * e.g. Write<RegMap::PwmCore::Dc>(id, dc). The register is checked when
+	 * compiling, as for Write<R>(value), and only the motor at run time.
+	 * @return bool - true if the mapping currently exists and can be used,
+	 * else false; also false for a motor that does not exist.
+	 */
+	template <typename R>
+	bool Write(uint32_t motorId, uint32_t value) {
+		static_assert(std::is_same<typename R::Dev, RegMap::PwmCore>::value, "not a RegMap::PwmCore register");
+		static_assert(R::WRITABLE, "register is read-only");
+		if (m_virtual_base == MAP_FAILED || motorId >= MOTOR_NUM)
+			return false;
+		if (!shadowUpdate(motorId, R::INDEX, value))
+			return true;
+		*(volatile uint32_t*)((char*)m_virtual_base + m_start_offset + RegMap::PWM_BASES[motorId] + R::OFFSET) = value;
+		noteWrite(motorId, R::INDEX, value);
+		return true;
+	}
+
+	// Reads a register of the PWM core of a motor known only at run time, e.g. Read<RegMap::PwmCore::Ready>(id)
+	template <typename R>
+	uint32_t Read(uint32_t motorId) {
+		static_assert(std::is_same<typename R::Dev, RegMap::PwmCore>::value, "not a RegMap::PwmCore register");
+		static_assert(R::READABLE, "register is write-only");
+		return Motor_Reg32_Read(motorId, R::INDEX);
+	}
+
+	// A batch entry writing a register of a motor's PWM core, e.g. BatchWrite<RegMap::PwmCore::Delay>(id, delay)
+	template <typename R>
+	static RegWrite BatchWrite(uint32_t motorId, uint32_t value) {
+		static_assert(std::is_same<typename R::Dev, RegMap::PwmCore>::value, "not a RegMap::PwmCore register");
+		static_assert(R::WRITABLE, "register is read-only");
+		RegWrite w = { motorId, R::INDEX, value };
+		return w;
+	}
+	bool Motor_Reg32_WriteBatch(const std::vector<RegWrite> &writes) {
+		return Motor_Reg32_WriteBatch(writes.empty() ? NULL : &writes[0], writes.size());
+	}
+	bool Motor_DC_WriteFrame(const uint32_t dc[MOTOR_NUM], uint32_t motorMask = (1u << MOTOR_NUM) - 1);
+
+	//Register access counters, used to measure MMIO traffic per operation
+	uint64_t GetWriteCount() { return m_nWrites; }
+	uint64_t GetReadCount() { return m_nReads; }
+	uint64_t GetBatchCount() { return m_nBatches; }
+	uint64_t GetLastBatchNs() { return m_lastBatchNs; }
+	uint64_t GetLastFrameNs() { return m_lastFrameNs; }
+	uint64_t GetLastSpreadNs() { return m_lastSpreadNs; }
+	uint64_t GetElidedCount() { return m_nElided; }
+	void ResetCounters() { m_nWrites = 0; m_nReads = 0; m_nBatches = 0; m_lastBatchNs = 0; m_lastSpreadNs = 0; m_nElided = 0; }
+
+	/**
+	 * The shadow registers remember the last value written to every PERIOD,
+	 * DC, DELAY and ABORT register so writes that would not change a register
+	 * are skipped. It is on for /dev/mem and the anonymous backend and off for
+	 * BACKEND_FILE, whose registers other processes may write. Disable it, or
+	 * invalidate it, if anything else may write the registers.
+	 */
+	void SetShadowEnabled(bool enabled) { m_shadowEnabled = enabled; InvalidateShadow(); }
+	bool IsShadowEnabled() { return m_shadowEnabled; }
+	void InvalidateShadow() { for (int i = 0; i < MOTOR_NUM; i++) m_shadowValid[i] = 0; }
+
+	/**
+	 * Whether the FPGA design has a frame latch: hps_0.h defines a PWM_LATCH
+	 * device whose register, while 1, makes the PWM cores keep generating
+	 * their current duty cycles and take the newly written ones together
+	 * once it returns to 0. Motor_DC_WriteFrame then writes under the latch.
+	 * The stock design has none.
+	 */
+	static bool HasFrameLatch() {
+#ifdef PWM_LATCH_BASE
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	//Emulates the PWM_READY bit on simulated backends
+	void SetSimReadyDelay(uint32_t usec);
+
+	/**
+	 * Puts a model of the hardware behind the registers, or removes it with
+	 * NULL. Only meaningful on the simulated backends.
+	 */
+	void SetModel(RegModel *model) { m_model = model; }
+
+	/**
+	 * Records every register access that reaches the bus (see RegRecorder),
+	 * or stops recording with NULL. The default constructor starts recording
+	 * into the file named by $SPIDER_RECORD, if it is set and no other MMap
+	 * is recording into it. A recorder takes one MMap, driven from one thread.
+	 */
+	void SetRecorder(RegRecorder *recorder) { m_recorder = recorder; }
+	RegRecorder *GetRecorder() { return m_recorder; }
+
+	/**
+	 * Parses a backend name as accepted in $SPIDER_MMIO.
+	 * @param name - "devmem", "anon", "file" or "file:<path>"
+	 * @param backend - receives the backend
+	 * @param path - receives the register file path for "file:<path>"
+	 * @return false if the name is not recognised
+	 */
+	static bool ParseBackend(const char *name, BACKEND &backend, std::string &path);
 };
 
 #endif /* MMAP_H_ */
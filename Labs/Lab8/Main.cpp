@@ -1,53 +1,260 @@
+#include <fstream>
 #include <iostream>
-#include "Spider.cpp"
+#include "MotionScheduler.cpp"
 
 using namespace std;
 
+// Prints how the current budget staggered the moves since the last call, if there is a budget
+static void PrintCurrent(Spider &spider)
+{
+	CurrentBudget *budget = spider.GetFrame()->GetBudget();
+	const CurrentBudget::Stats &stats = budget->GetStats();
+	if (budget->IsEnabled() && stats.frames > 0)
+		cout << "Current: " << stats.peakMa << " mA peak of " << budget->GetBudget() << " mA, "
+			 << stats.staggered << " of " << stats.frames << " frames staggered, "
+			 << stats.addedNs / 1000000 << " ms added" << endl;
+	budget->ResetStats();
+}
+
+// Prints how long the servos held torque and were released, since the start
+static void PrintPower(Spider &spider)
+{
+	ServoFrame::Power power = spider.GetFrame()->GetPower();
+	IdleManager::Stats idle = spider.GetIdle()->GetStats();
+	if (!spider.GetIdle()->IsEnabled())
+		return;
+	cout << "Power: " << power.heldNs / 1e9 << " servo-s held, " << power.releasedNs / 1e9 << " servo-s released, "
+		 << power.releases << " releases, " << idle.wakes << " wakes (" << idle.maxArmNs / 1000 << " us max to re-arm)" << endl;
+}
+
 int main(int argc, char *argv[])
 {
 	Spider Spider;
+	ifstream script;
+
+	// -g <file> loads extra gaits, e.g. to tune a gait without recompiling
+	// -c <file> loads a servo calibration
+	// -i <file> reads the commands from a file or named pipe instead of stdin
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (string(argv[i]) == "-g")
+			Spider.LoadGaits(argv[i + 1]);
+		else if (string(argv[i]) == "-c")
+			Spider.LoadCalibration(argv[i + 1]);
+		else if (string(argv[i]) == "-i")
+			script.open(argv[i + 1]);
+		else
+			cerr << "Usage: " << argv[0] << " [-g <gait file>] [-c <calibration file>] [-i <command file>]" << endl;
+	}
+	istream &in = script.is_open() ? script : cin;
 
 	cout << "Spider Init" << endl;
 	Spider.Init();
+	PrintCurrent(Spider);
 
 	cout << "Spider Standup" << endl;
 	Spider.Standup();
+	PrintCurrent(Spider);
+
+	// From here on the movements run on the scheduler's control thread,
+	// so new commands are accepted while the spider is still moving
+	MotionScheduler Scheduler(&Spider);
+	Spider.GetMMIO()->ResetCounters();
+	Spider.GetWaiter()->ResetStats();
+	Spider.GetFrame()->ResetStats();
+	Spider.ResetStepRate();
+
+	// Reports each finished movement with the MMIO traffic and waits it caused
+	MotionScheduler::Callback report = [&Spider](MotionScheduler::JobId id, bool completed)
+	{
+		if (!completed) {
+			cout << "Motion " << id << " cancelled" << endl;
+			return;
+		}
+		cout << "Motion " << id << " done" << endl;
+		cout << "MMIO: " << Spider.GetMMIO()->GetWriteCount() << " writes, "
+			 << Spider.GetMMIO()->GetElidedCount() << " elided, "
+			 << Spider.GetMMIO()->GetReadCount() << " reads" << endl;
+		if (Spider.GetWaiter()->GetStats().waits > 0)
+			cout << "Waits: " << Spider.GetWaiter()->GetStats().waits << ", "
+				 << Spider.GetWaiter()->GetStats().totalNs / 1000 << " us total, "
+				 << Spider.GetWaiter()->GetStats().maxNs / 1000 << " us max, "
+				 << Spider.GetWaiter()->GetStats().polls << " polls" << endl;
+		const ServoFrame::Stats &frames = Spider.GetFrame()->GetStats();
+		if (frames.commits > 0)
+			cout << "Frames: " << frames.commits << ", " << frames.delayed << " delayed, "
+				 << frames.straddled << " straddled, spread " << frames.totalSpreadNs / frames.commits
+				 << " ns mean, " << frames.maxSpreadNs << " ns max" << endl;
+		PrintCurrent(Spider);
+		PrintPower(Spider);
+		cout << "Steps: " << Spider.GetStepCount() << ", "
+			 << Spider.GetStepRate() << " steps/s" << endl;
+		Spider.GetMMIO()->ResetCounters();
+		Spider.GetWaiter()->ResetStats();
+		Spider.GetFrame()->ResetStats();
+	};
 
-	cout << "Waiting for Command..." << endl;
-	bool done = false;
-	while (!done)
+	// Prints how deep the motion queue got and how long movements waited to start
+	auto printQueue = [&Scheduler]()
 	{
-		char cmd_chr;
-		cout << "Enter Next Command: ";
-		cin >> cmd_chr;
+		cout << "Queue: " << Scheduler.Pending() << " pending, " << Scheduler.GetMaxDepth() << " max" << endl;
+		if (Scheduler.GetStartLatency()->GetCount() > 0)
+			Scheduler.GetStartLatency()->Print(stdout, "Command to motion start");
+		fflush(stdout);
+	};
 
-		switch (cmd_chr)
+	// The main thread parses the commands and is the only one submitting
+	// to the scheduler, so it can keep reading (and cancelling) while the
+	// control thread runs the queued movements
+	auto readCommands = [&]()
+	{
+		cout << "Waiting for Command..." << endl;
+		bool done = false;
+		while (!done)
 		{
-		case 'f':
-			cout << "CMD_FORDWARD" << endl;
-			Spider.MoveForward();
-			break;
-		case 'b':
-			cout << "CMD_BACKWARD" << endl;
-			Spider.MoveBackward();
-			break;
-		case 'l':
-			cout << "CMD_TURN_LEFT" << endl;
-			Spider.TurnLeft();
-			break;
-		case 'r':
-			cout << "CMD_TURN_RIGHT" << endl;
-			Spider.TurnRight();
-			break;
-		case 's':
-			cout << "CMD_STOP" << endl;
-			done = true;
-			break;
-		default:
-			cout << "IDLE or UNKNOWN COMMAND" << endl;
-			break;
+			char cmd_chr;
+			cout << "Enter Next Command: ";
+			// End of input stops like 's'
+			if (!(in >> cmd_chr))
+				cmd_chr = 's';
+
+			switch (cmd_chr)
+			{
+			case 'f':
+				cout << "CMD_FORDWARD" << endl;
+				Scheduler.Submit(Spider::MOTION_FORWARD, report);
+				break;
+			case 'b':
+				cout << "CMD_BACKWARD" << endl;
+				Scheduler.Submit(Spider::MOTION_BACKWARD, report);
+				break;
+			case 'l':
+				cout << "CMD_TURN_LEFT" << endl;
+				Scheduler.Submit(Spider::MOTION_TURN_LEFT, report);
+				break;
+			case 'r':
+				cout << "CMD_TURN_RIGHT" << endl;
+				Scheduler.Submit(Spider::MOTION_TURN_RIGHT, report);
+				break;
+			case 'g':
+			{
+				string name;
+				in >> name;
+				cout << "CMD_GAIT " << name << endl;
+				// Looked up on the control thread, which recompiles the gaits on 'k'
+				Scheduler.Submit([&Spider, name](MotionPlan &plan) {
+					if (Spider.GetGaits()->Find(name) != NULL) {
+						Spider.PlanGait(name, plan);
+						return;
+					}
+					vector<string> names = Spider.GetGaits()->Names();
+					cout << "Unknown gait, try one of:";
+					for (size_t i = 0; i < names.size(); i++)
+						cout << " " << names[i];
+					cout << endl;
+				}, report);
+				break;
+			}
+			case 'p':
+				// Takes effect from the next phase the control thread runs
+				Spider.SetPipelined(!Spider.IsPipelined());
+				cout << "CMD_PIPELINE " << (Spider.IsPipelined() ? "on" : "off") << endl;
+				break;
+			case 't':
+			{
+				string name;
+				Trajectory::PROFILE profile;
+				in >> name;
+				cout << "CMD_PROFILE " << name << endl;
+				if (Trajectory::ParseProfile(name.c_str(), profile))
+					Spider.SetProfile(profile);
+				else
+					cout << "Unknown profile, try one of: step trapezoid scurve" << endl;
+				break;
+			}
+			case 'o':
+			{
+				// Body pose: o <x> <y> <z> <roll> <pitch> <yaw> (mm, degrees), over half a second
+				BodyKinematics::Pose pose;
+				in >> pose.x >> pose.y >> pose.z >> pose.roll >> pose.pitch >> pose.yaw;
+				cout << "CMD_POSE" << endl;
+				Scheduler.Submit([&Spider, pose](MotionPlan &plan) { Spider.PlanPose(pose, 500, plan); }, report);
+				break;
+			}
+			case 'v':
+			{
+				// Walking velocity: v <vx> <vy> <yaw> (mm/s forwards, mm/s left, degrees/s anticlockwise); v 0 0 0 stops
+				float vx, vy, yaw;
+				in >> vx >> vy >> yaw;
+				cout << "CMD_VELOCITY" << endl;
+				// A running walk changes velocity mid-stride; otherwise queue one
+				if (Spider.SetVelocity(vx, vy, yaw)) {
+					Spider.ResetOdometry();
+					MotionScheduler::JobId id = Scheduler.Submit([&Spider](MotionPlan &plan) { Spider.PlanWalk(plan); },
+						[&Spider, report](MotionScheduler::JobId id, bool completed) {
+							float x, y, yaw;
+							if (!completed)
+								Spider.StopWalk();
+							Spider.GetOdometry(x, y, yaw);
+							cout << "Walked: " << x << " mm, " << y << " mm, " << yaw << " degrees" << endl;
+							report(id, completed);
+						});
+					// Not queued, so no walk will clear the flag SetVelocity set
+					if (id == 0) {
+						Spider.StopWalk();
+						cout << "Queue full, walk not started" << endl;
+					}
+				}
+				break;
+			}
+			case 'k':
+				// Reloaded on the control thread, between movements
+				cout << "CMD_RELOAD_CALIBRATION" << endl;
+				Scheduler.Submit([&Spider](MotionPlan &) {
+					cout << (Spider.ReloadCalibration() ? "Calibration reloaded" : "Calibration unchanged") << endl;
+				});
+				break;
+			case 'j':
+				// Timing of the streamed frames; fine to read while the control thread runs
+				cout << "CMD_JITTER" << endl;
+				Spider.GetLoopStats()->Print(stdout);
+				fflush(stdout);
+				break;
+			case 'c':
+				cout << "CMD_CANCEL" << endl;
+				Scheduler.CancelAll();
+				break;
+			case 'w':
+				cout << "CMD_WAIT" << endl;
+				Scheduler.WaitIdle();
+				break;
+			case 'q':
+				cout << "CMD_QUEUE" << endl;
+				printQueue();
+				break;
+			case 's':
+				cout << "CMD_STOP" << endl;
+				done = true;
+				break;
+			case 'x':
+				// Jumps the queue: stops the running movement and drops the queued ones, then exits
+				cout << "CMD_ABORT" << endl;
+				Scheduler.CancelAll();
+				done = true;
+				break;
+			default:
+				cout << "IDLE or UNKNOWN COMMAND" << endl;
+				break;
+			}
 		}
-	}
+	};
+	readCommands();
 
+	// Let the queued movements finish before exiting
+	Scheduler.WaitIdle();
+	printQueue();
+	PrintPower(Spider);
+	if (Spider.GetLoopStats()->wakeup.GetCount() > 0)
+		Spider.GetLoopStats()->Print(stdout);
 	return 0;
 }
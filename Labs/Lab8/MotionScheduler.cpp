@@ -0,0 +1,234 @@
+#ifndef MOTIONSCHEDULER_CPP_
+#define MOTIONSCHEDULER_CPP_
+#include "Spider.cpp"
+#include "SpscRing.cpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Most movements that can be queued, including the running one (a power of two)
+#define SCHED_QUEUE_SIZE 64
+
+/**
+ * Runs Spider movements on a dedicated control thread so the caller is
+ * not blocked for the length of a gait. Movements are queued with
+ * Submit() and run one after another as their plans of phase steps;
+ * Cancel() drops queued movements or stops the running one at the next
+ * phase boundary, wait, hold or streamed frame.
+ *
+ * The queue is a lock-free single-producer/single-consumer ring: one
+ * thread (e.g. the main thread reading commands) calls Submit(), Cancel() and CancelAll(),
+ * and the control thread consumes it. Cancelling jumps the queue: each
+ * slot has a cancel flag that the control thread checks before and while
+ * running the movement in it. Submitting never blocks; a full queue
+ * rejects the movement.
+ *
+ * While the scheduler is running, only the control thread may drive the
+ * Spider. Completion callbacks run on the control thread and may use it.
+ *
+ * The control thread enters the Spider's real-time mode, if enabled,
+ * before it runs anything.
+ */
+class MotionScheduler
+{
+public:
+	typedef uint64_t JobId;
+	// Called when a movement ends; completed is false if it was cancelled
+	typedef std::function<void(JobId id, bool completed)> Callback;
+	// Appends the steps of a movement; run on the control thread just before it starts
+	typedef std::function<void(MotionPlan &plan)> Planner;
+
+private:
+	typedef struct
+	{
+		JobId id;
+		Planner planner;
+		Callback callback;
+		// When the movement was submitted, to measure how long it waited to start
+		uint64_t submitNs;
+	} Job;
+
+	Spider *m_spider;
+	std::thread m_thread;
+	SpscRing<Job, SCHED_QUEUE_SIZE> m_queue;
+	// Cancel flag of the movement in each queue slot; reset by Submit()
+	std::atomic<bool> m_cancel[SCHED_QUEUE_SIZE];
+	// Id of the next movement submitted; Submit() numbers them in queue order
+	JobId m_nextId;
+	// Movements finished (run or dropped) so far; movement id is finished once this reaches it
+	std::atomic<JobId> m_finished;
+	std::atomic<bool> m_stop;
+	// Only for sleeping: the control thread waits for work, and waiters for movements to finish
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	// Queue depth seen by Submit() and the delay from submission to the start of a movement
+	std::atomic<uint32_t> m_maxDepth;
+	LatencyHistogram m_startLatency;
+
+	void run()
+	{
+		m_spider->EnterRealTime();
+		while (true)
+		{
+			Job *job = m_queue.Front();
+			if (job == NULL) {
+				// Between movements: let idle servos go, and wake up when the next leg becomes idle
+				uint64_t idleNs = m_spider->Idle();
+				std::unique_lock<std::mutex> lock(m_mutex);
+				auto ready = [this]() { return m_stop || m_queue.Size() != 0; };
+				if (idleNs == 0) {
+					m_wake.wait(lock, ready);
+				} else {
+					uint64_t now = MonotonicNs();
+					m_wake.wait_for(lock, std::chrono::nanoseconds(idleNs > now ? idleNs - now : 0), ready);
+				}
+				if (m_stop && m_queue.Size() == 0)
+					break;
+				continue;
+			}
+			// The job keeps its slot, and with it its cancel flag, until it has finished
+			std::atomic<bool> *cancel = &m_cancel[SpscRing<Job, SCHED_QUEUE_SIZE>::SlotOf((uint32_t)(job->id - 1))];
+			bool completed = false;
+			if (!cancel->load()) {
+				m_startLatency.Add(MonotonicNs() - job->submitNs);
+				MotionPlan plan;
+				job->planner(plan);
+				completed = m_spider->RunPlan(plan, cancel);
+			}
+			if (job->callback)
+				job->callback(job->id, completed);
+
+			// Release the job's captures before its slot is reused
+			job->planner = Planner();
+			job->callback = Callback();
+			m_queue.Pop();
+			m_finished.fetch_add(1);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done.notify_all();
+		}
+	}
+
+public:
+	MotionScheduler(Spider *spider)
+	{
+		m_spider = spider;
+		m_nextId = 1;
+		m_finished = 0;
+		m_stop = false;
+		m_maxDepth = 0;
+		for (int i = 0; i < SCHED_QUEUE_SIZE; i++)
+			m_cancel[i] = false;
+		m_thread = std::thread(&MotionScheduler::run, this);
+	}
+
+	/**
+	 * Finishes the queued movements, then stops the control thread.
+	 * Call CancelAll() first to stop sooner.
+	 */
+	~MotionScheduler()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		m_thread.join();
+	}
+
+	/**
+	 * Queues a movement.
+	 * @param planner - builds the movement's steps when it is about to run
+	 * @param callback - optional, called when it ends
+	 * @return the id of the movement, for Cancel() and Wait(), or 0 if the queue is full
+	 */
+	JobId Submit(Planner planner, Callback callback = Callback())
+	{
+		Job job;
+		job.id = m_nextId;
+		job.planner = planner;
+		job.callback = callback;
+		job.submitNs = MonotonicNs();
+		// The slot is free, so its flag can be reset before the job is published
+		m_cancel[SpscRing<Job, SCHED_QUEUE_SIZE>::SlotOf((uint32_t)(job.id - 1))] = false;
+		if (!m_queue.Push(job)) {
+			fprintf(stderr, "ERROR: motion queue full, command dropped...\n");
+			return 0;
+		}
+		m_nextId++;
+		uint32_t depth = m_queue.Size();
+		if (depth > m_maxDepth)
+			m_maxDepth = depth;
+		{
+			// Taken so the control thread cannot miss the wake-up between its check and its wait
+			std::lock_guard<std::mutex> lock(m_mutex);
+		}
+		m_wake.notify_all();
+		return job.id;
+	}
+
+	// Queues one of the Spider's built-in movements
+	JobId Submit(Spider::MOTION_ID motion, Callback callback = Callback())
+	{
+		Spider *spider = m_spider;
+		return Submit([spider, motion](MotionPlan &plan) { spider->Plan(motion, plan); }, callback);
+	}
+
+	// Queues one of the Spider's named gaits
+	JobId Submit(const std::string &gait, Callback callback = Callback())
+	{
+		Spider *spider = m_spider;
+		return Submit([spider, gait](MotionPlan &plan) { spider->PlanGait(gait, plan); }, callback);
+	}
+
+	/**
+	 * Cancels a movement: a queued one is skipped, the running one stops at
+	 * its next phase boundary. Its callback reports completed = false.
+	 * @return false if the movement has already finished
+	 */
+	bool Cancel(JobId id)
+	{
+		if (id == 0 || id >= m_nextId || id <= m_finished)
+			return false;
+		// Should the movement finish meanwhile, the flag is reset when its slot is reused
+		m_cancel[SpscRing<Job, SCHED_QUEUE_SIZE>::SlotOf((uint32_t)(id - 1))] = true;
+		return true;
+	}
+
+	// Cancels every queued movement and stops the running one
+	void CancelAll()
+	{
+		for (JobId id = m_finished + 1; id < m_nextId; id++)
+			Cancel(id);
+	}
+
+	// Blocks until the given movement has finished or been cancelled
+	void Wait(JobId id)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this, id]() { return m_finished >= id; });
+	}
+
+	// Blocks until every queued movement has finished
+	void WaitIdle()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this]() { return m_queue.Size() == 0; });
+	}
+
+	// Number of queued movements, including the running one
+	size_t Pending() { return m_queue.Size(); }
+	// Deepest the queue has been after a Submit()
+	uint32_t GetMaxDepth() { return m_maxDepth; }
+	// Delay from Submit() to the start of each movement that ran
+	LatencyHistogram *GetStartLatency() { return &m_startLatency; }
+
+	void ResetMetrics()
+	{
+		m_maxDepth = 0;
+		m_startLatency.Reset();
+	}
+};
+
+#endif /* MOTIONSCHEDULER_CPP_ */
@@ -0,0 +1,212 @@
+#ifndef READYWAITER_CPP_
+#define READYWAITER_CPP_
+#include "MMap.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Environment variable used to pick the wait strategy:
+//   SPIDER_WAIT=spin | backoff | predict | irq[:<device>]
+#define WAIT_STRATEGY_ENV "SPIDER_WAIT"
+#define WAIT_DEFAULT_UIO "/dev/uio0"
+
+// Backoff tuning: polls spent spinning, then yielding, then sleeping
+// with a doubling interval between WAIT_SLEEP_MIN_NS and WAIT_SLEEP_MAX_NS
+#define WAIT_SPIN_POLLS 64
+#define WAIT_YIELD_POLLS 64
+#define WAIT_SLEEP_MIN_NS 50000
+#define WAIT_SLEEP_MAX_NS 2000000
+// How far before the predicted completion time the predictive wait wakes up
+#define WAIT_PREDICT_MARGIN_NS 1000000
+
+/**
+ * Waits for the servos to report ready. Spider::WaitReady used to poll the
+ * ready registers in a tight loop; this provides strategies that give the
+ * CPU back while a movement is under way, and records how long each wait
+ * took and how many times the registers were polled.
+ */
+class ReadyWaiter
+{
+public:
+	typedef enum
+	{
+		WAIT_SPIN,    // Poll continuously (the original behaviour)
+		WAIT_BACKOFF, // Poll with an adaptive spin -> yield -> nanosleep backoff
+		WAIT_PREDICT, // Sleep until the predicted completion time, then back off
+		WAIT_IRQ      // Block on an interrupt fd (UIO or eventfd), then back off
+	} STRATEGY;
+
+	typedef struct
+	{
+		uint64_t waits;      // Number of completed waits
+		uint64_t polls;      // Polls over all waits
+		uint64_t lastPolls;  // Polls in the most recent wait
+		uint64_t totalNs;    // Time spent waiting over all waits
+		uint64_t lastNs;     // Time-to-ready of the most recent wait
+		uint64_t maxNs;      // Longest wait
+	} Stats;
+
+private:
+	STRATEGY m_strategy;
+	// Pollable interrupt source for WAIT_IRQ, or -1
+	int m_irqFd;
+	// Whether the fd is a UIO device, which must be re-armed by writing 1
+	bool m_irqRearm;
+	Stats m_stats;
+
+	/**
+	 * Blocks until the interrupt fd fires or the timeout passes.
+	 * @return false if the fd is unusable
+	 */
+	bool waitIrq(int timeoutMs)
+	{
+		uint32_t info = 1;
+		if (m_irqRearm && write(m_irqFd, &info, sizeof(info)) != sizeof(info))
+			return false;
+		struct pollfd pfd = { m_irqFd, POLLIN, 0 };
+		int n = poll(&pfd, 1, timeoutMs);
+		if (n < 0)
+			return errno == EINTR;
+		if (n > 0) {
+			uint64_t count;
+			// UIO reports a 32-bit interrupt count, eventfd a 64-bit counter
+			if (read(m_irqFd, &count, m_irqRearm ? sizeof(uint32_t) : sizeof(uint64_t)) < 0)
+				return false;
+		}
+		return true;
+	}
+
+public:
+	ReadyWaiter(STRATEGY strategy = WAIT_BACKOFF)
+	{
+		m_strategy = strategy;
+		m_irqFd = -1;
+		m_irqRearm = false;
+		ResetStats();
+	}
+
+	~ReadyWaiter()
+	{
+		if (m_irqFd != -1 && m_irqRearm)
+			close(m_irqFd);
+	}
+
+	/**
+	 * Configures the strategy from $SPIDER_WAIT, if it is set.
+	 * @return false if the variable names an unknown strategy
+	 */
+	bool ConfigureFromEnv()
+	{
+		const char *name = getenv(WAIT_STRATEGY_ENV);
+		if (name == NULL)
+			return true;
+		if (strcmp(name, "spin") == 0)
+			m_strategy = WAIT_SPIN;
+		else if (strcmp(name, "backoff") == 0)
+			m_strategy = WAIT_BACKOFF;
+		else if (strcmp(name, "predict") == 0)
+			m_strategy = WAIT_PREDICT;
+		else if (strcmp(name, "irq") == 0)
+			return OpenUio(WAIT_DEFAULT_UIO);
+		else if (strncmp(name, "irq:", 4) == 0)
+			return OpenUio(name + 4);
+		else {
+			fprintf(stderr, "ERROR: unknown %s strategy \"%s\"...\n", WAIT_STRATEGY_ENV, name);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Selects WAIT_IRQ using a UIO device for the PWM interrupt.
+	 * If the device cannot be opened, WAIT_BACKOFF is used instead.
+	 */
+	bool OpenUio(const char *path)
+	{
+		int fd = open(path, O_RDWR);
+		if (fd == -1) {
+			fprintf(stderr, "ERROR: could not open \"%s\", using backoff polling...\n", path);
+			m_strategy = WAIT_BACKOFF;
+			return false;
+		}
+		if (m_irqFd != -1 && m_irqRearm)
+			close(m_irqFd);
+		m_irqFd = fd;
+		m_irqRearm = true;
+		m_strategy = WAIT_IRQ;
+		return true;
+	}
+
+	/**
+	 * Selects WAIT_IRQ with a caller-owned fd that becomes readable when the
+	 * servos may have finished, e.g. an eventfd signalled by a simulator.
+	 */
+	void SetEventFd(int fd)
+	{
+		if (m_irqFd != -1 && m_irqRearm)
+			close(m_irqFd);
+		m_irqFd = fd;
+		m_irqRearm = false;
+		m_strategy = (fd == -1) ? WAIT_BACKOFF : WAIT_IRQ;
+	}
+
+	void SetStrategy(STRATEGY strategy) { m_strategy = strategy; }
+	STRATEGY GetStrategy() { return m_strategy; }
+	const Stats &GetStats() { return m_stats; }
+	void ResetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+
+	/**
+	 * Waits until isReady() returns true.
+	 * @param isReady - callable polling the ready registers
+	 * @param predictedReadyNs - when the movement is expected to finish
+	 * (MonotonicNs() time base), used by WAIT_PREDICT; 0 if unknown
+	 * @return true once ready
+	 */
+	template <class ReadyFn>
+	bool Wait(ReadyFn isReady, uint64_t predictedReadyNs = 0)
+	{
+		uint64_t start = MonotonicNs();
+		uint64_t polls = 1;
+		uint64_t sleepNsNext = WAIT_SLEEP_MIN_NS;
+		bool bReady = isReady();
+
+		if (!bReady && m_strategy == WAIT_PREDICT
+			&& predictedReadyNs > start + WAIT_PREDICT_MARGIN_NS) {
+			SleepUntilNs(predictedReadyNs - WAIT_PREDICT_MARGIN_NS);
+			bReady = isReady();
+			polls++;
+		}
+		while (!bReady) {
+			if (m_strategy == WAIT_SPIN) {
+				// busy poll
+			} else if (m_strategy == WAIT_IRQ && m_irqFd != -1) {
+				if (!waitIrq(WAIT_SLEEP_MAX_NS / 1000000))
+					m_strategy = WAIT_BACKOFF;
+			} else if (polls < WAIT_SPIN_POLLS) {
+				// spin: short moves finish before a yield would return
+			} else if (polls < WAIT_SPIN_POLLS + WAIT_YIELD_POLLS) {
+				sched_yield();
+			} else {
+				SleepNs(sleepNsNext);
+				if (sleepNsNext < WAIT_SLEEP_MAX_NS)
+					sleepNsNext *= 2;
+			}
+			bReady = isReady();
+			polls++;
+		}
+
+		uint64_t ns = MonotonicNs() - start;
+		m_stats.waits++;
+		m_stats.polls += polls;
+		m_stats.lastPolls = polls;
+		m_stats.totalNs += ns;
+		m_stats.lastNs = ns;
+		if (ns > m_stats.maxNs)
+			m_stats.maxNs = ns;
+		return bReady;
+	}
+};
+
+#endif /* READYWAITER_CPP_ */
@@ -0,0 +1,220 @@
+#ifndef REALTIME_CPP_
+#define REALTIME_CPP_
+#include <atomic>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Environment variable enabling real-time control: SPIDER_RT=1 or SPIDER_RT=<priority>[:<cpu>]
+#define RT_ENV "SPIDER_RT"
+#define RT_DEFAULT_PRIORITY 80
+// Stack touched when entering real-time mode, so the control loop never page-faults on it
+#define RT_STACK_PREFAULT (256 * 1024)
+
+// Histogram buckets: bucket 0 counts samples below 1 us, bucket b those in [2^(b-1), 2^b) us
+#define RT_HIST_BUCKETS 20
+
+/**
+ * A latency histogram with power-of-two microsecond buckets. One thread
+ * records samples and any thread may read them; the counters are relaxed
+ * atomics, so recording never blocks the control loop.
+ */
+class LatencyHistogram
+{
+	std::atomic<uint32_t> m_bucket[RT_HIST_BUCKETS];
+	std::atomic<uint32_t> m_count;
+	std::atomic<uint32_t> m_maxNs;
+
+public:
+	LatencyHistogram() { Reset(); }
+
+	void Reset()
+	{
+		for (int b = 0; b < RT_HIST_BUCKETS; b++)
+			m_bucket[b].store(0, std::memory_order_relaxed);
+		m_count.store(0, std::memory_order_relaxed);
+		m_maxNs.store(0, std::memory_order_relaxed);
+	}
+
+	void Add(uint64_t ns)
+	{
+		uint64_t us = ns / 1000;
+		int b = 0;
+		while (us != 0 && b < RT_HIST_BUCKETS - 1) {
+			us >>= 1;
+			b++;
+		}
+		m_bucket[b].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		uint32_t clamped = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+		if (clamped > m_maxNs.load(std::memory_order_relaxed))
+			m_maxNs.store(clamped, std::memory_order_relaxed);
+	}
+
+	uint32_t GetCount() { return m_count.load(std::memory_order_relaxed); }
+	uint32_t GetMaxNs() { return m_maxNs.load(std::memory_order_relaxed); }
+	uint32_t GetBucket(int b) { return m_bucket[b].load(std::memory_order_relaxed); }
+
+	// Upper bound of the bucket holding the given fraction of the samples, in us (0 if empty)
+	uint32_t PercentileUs(double fraction)
+	{
+		uint32_t count = GetCount(), seen = 0;
+		for (int b = 0; b < RT_HIST_BUCKETS; b++) {
+			seen += GetBucket(b);
+			if (count != 0 && seen >= fraction * count)
+				return 1u << b;
+		}
+		return 0;
+	}
+
+	void Print(FILE *out, const char *name)
+	{
+		fprintf(out, "%s: %u samples, p50 < %u us, p99 < %u us, max %u us\n", name, GetCount(),
+				PercentileUs(0.5), PercentileUs(0.99), GetMaxNs() / 1000);
+		for (int b = 0; b < RT_HIST_BUCKETS; b++)
+			if (GetBucket(b) != 0)
+				fprintf(out, "  [%6u, %6u) us: %u\n", b == 0 ? 0 : 1u << (b - 1), 1u << b, GetBucket(b));
+	}
+};
+
+/**
+ * Timing of a periodic control loop: how late each frame woke up after its
+ * deadline, how long its work took, and how often the work ran past the
+ * next frame's deadline.
+ */
+class LoopStats
+{
+public:
+	LatencyHistogram wakeup;
+	LatencyHistogram exec;
+
+private:
+	std::atomic<uint32_t> m_overruns;
+
+public:
+	LoopStats() { m_overruns = 0; }
+
+	void Record(uint64_t wakeLateNs, uint64_t execNs)
+	{
+		wakeup.Add(wakeLateNs);
+		exec.Add(execNs);
+	}
+
+	void Overrun() { m_overruns.fetch_add(1, std::memory_order_relaxed); }
+	uint32_t GetOverruns() { return m_overruns.load(std::memory_order_relaxed); }
+
+	void Reset()
+	{
+		wakeup.Reset();
+		exec.Reset();
+		m_overruns = 0;
+	}
+
+	void Print(FILE *out)
+	{
+		wakeup.Print(out, "Wake-up latency");
+		exec.Print(out, "Loop execution");
+		fprintf(out, "Overruns: %u\n", GetOverruns());
+	}
+};
+
+/**
+ * Opt-in real-time settings of the control thread: memory locked and
+ * pre-faulted, SCHED_FIFO at a priority, optionally pinned to a CPU.
+ */
+class RealTime
+{
+	bool m_enabled;
+	int m_priority;
+	// CPU to pin to, or -1
+	int m_cpu;
+
+	static void prefaultStack()
+	{
+		volatile unsigned char stack[RT_STACK_PREFAULT];
+		for (size_t i = 0; i < sizeof(stack); i += 4096)
+			stack[i] = 0;
+	}
+
+public:
+	RealTime()
+	{
+		m_enabled = false;
+		m_priority = RT_DEFAULT_PRIORITY;
+		m_cpu = -1;
+	}
+
+	/**
+	 * Configures real-time mode from $SPIDER_RT, if it is set: "1" for the
+	 * default priority, or "<priority>[:<cpu>]".
+	 * @return false if the variable is malformed
+	 */
+	bool ConfigureFromEnv()
+	{
+		const char *value = getenv(RT_ENV);
+		if (value == NULL || strcmp(value, "0") == 0)
+			return true;
+		int priority = RT_DEFAULT_PRIORITY, cpu = -1;
+		if (strcmp(value, "1") != 0 && sscanf(value, "%d:%d", &priority, &cpu) < 1) {
+			fprintf(stderr, "ERROR: bad %s \"%s\", expected <priority>[:<cpu>]...\n", RT_ENV, value);
+			return false;
+		}
+		Configure(priority, cpu);
+		return true;
+	}
+
+	void Configure(int priority, int cpu = -1)
+	{
+		m_enabled = true;
+		m_priority = priority;
+		m_cpu = cpu;
+	}
+
+	bool IsEnabled() { return m_enabled; }
+
+	/**
+	 * Makes the calling thread real-time, if enabled. Each setting that
+	 * fails (e.g. SCHED_FIFO without CAP_SYS_NICE on a desktop) is reported
+	 * and skipped, so the loop still runs, with ordinary scheduling.
+	 * @return false if any setting could not be applied
+	 */
+	bool Enter()
+	{
+		if (!m_enabled)
+			return true;
+		bool bSuccess = true;
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+			fprintf(stderr, "ERROR: mlockall failed (%s)...\n", strerror(errno));
+			bSuccess = false;
+		}
+		prefaultStack();
+
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = m_priority;
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0) {
+			fprintf(stderr, "ERROR: SCHED_FIFO priority %d failed (%s)...\n", m_priority, strerror(err));
+			bSuccess = false;
+		}
+
+		if (m_cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(m_cpu, &set);
+			err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			if (err != 0) {
+				fprintf(stderr, "ERROR: pinning to CPU %d failed (%s)...\n", m_cpu, strerror(err));
+				bSuccess = false;
+			}
+		}
+		return bSuccess;
+	}
+};
+
+#endif /* REALTIME_CPP_ */
@@ -0,0 +1,127 @@
+// Generated from hps_0.h by gen_regmap.sh; do not edit.
+#ifndef REGMAP_H_
+#define REGMAP_H_
+#include <stdint.h>
+
+/**
+ * The devices of the lightweight bridge as types, so a register whose
+ * device and index are known when compiling has a constant address (see
+ * MMap::Write and MMap::Read). Offsets are from PWM_PHYS_START.
+ */
+namespace RegMap
+{
+
+// How a register may be accessed, checked by MMap::Write and MMap::Read
+typedef enum { RW, RO, WO } ACCESS;
+
+template <uint32_t Base, uint32_t Span>
+struct Device
+{
+	static constexpr uint32_t BASE = Base;
+	static constexpr uint32_t SPAN = Span;
+};
+
+// The 32-bit register at Index of device D
+template <typename D, uint32_t Index, ACCESS Access = RW>
+struct Reg
+{
+	static_assert(Index < D::SPAN / 4, "register outside its device");
+	typedef D Dev;
+	static constexpr uint32_t INDEX = Index;
+	static constexpr uint32_t OFFSET = D::BASE + Index * 4;
+	static constexpr bool READABLE = Access != WO;
+	static constexpr bool WRITABLE = Access != RO;
+};
+
+// The registers of PWM core D; register 2 is PWM_DELAY when written and PWM_READY when read
+template <typename D>
+struct PwmRegs
+{
+	typedef Reg<D, 0> Period;
+	typedef Reg<D, 1> Dc;
+	typedef Reg<D, 2, WO> Delay;
+	typedef Reg<D, 2, RO> Ready;
+	typedef Reg<D, 3> Abort;
+};
+
+// The PWM core of servo Id
+template <uint32_t Base, uint32_t Span, uint32_t Id>
+struct PwmDevice : Device<Base, Span>, PwmRegs<PwmDevice<Base, Span, Id> >
+{
+	static constexpr uint32_t ID = Id;
+};
+
+constexpr uint32_t PWM_NUM = 18;
+constexpr uint32_t PWM_SPAN = 16;
+
+// The PWM core of a servo chosen at run time, e.g. PwmCore::Dc; offsets are within the core
+struct PwmCore : Device<0, PWM_SPAN>, PwmRegs<PwmCore>
+{
+};
+
+// PWM core by servo ID, e.g. Pwm<3>::Dc
+template <uint32_t Id>
+struct Pwm
+{
+	static_assert(Id < PWM_NUM, "no such PWM core in hps_0.h");
+};
+template <> struct Pwm<0> : PwmDevice<0x110, 16, 0> {};
+template <> struct Pwm<1> : PwmDevice<0x100, 16, 1> {};
+template <> struct Pwm<2> : PwmDevice<0xf0, 16, 2> {};
+template <> struct Pwm<3> : PwmDevice<0xe0, 16, 3> {};
+template <> struct Pwm<4> : PwmDevice<0xd0, 16, 4> {};
+template <> struct Pwm<5> : PwmDevice<0xc0, 16, 5> {};
+template <> struct Pwm<6> : PwmDevice<0xb0, 16, 6> {};
+template <> struct Pwm<7> : PwmDevice<0xa0, 16, 7> {};
+template <> struct Pwm<8> : PwmDevice<0x90, 16, 8> {};
+template <> struct Pwm<9> : PwmDevice<0x80, 16, 9> {};
+template <> struct Pwm<10> : PwmDevice<0x70, 16, 10> {};
+template <> struct Pwm<11> : PwmDevice<0x60, 16, 11> {};
+template <> struct Pwm<12> : PwmDevice<0x50, 16, 12> {};
+template <> struct Pwm<13> : PwmDevice<0x40, 16, 13> {};
+template <> struct Pwm<14> : PwmDevice<0x30, 16, 14> {};
+template <> struct Pwm<15> : PwmDevice<0x20, 16, 15> {};
+template <> struct Pwm<16> : PwmDevice<0x10, 16, 16> {};
+template <> struct Pwm<17> : PwmDevice<0x0, 16, 17> {};
+
+// Other devices
+typedef Device<0x120, 64> LED_PIO;
+typedef Device<0x130, 64> DIPSW_PIO;
+typedef Device<0x140, 64> BUTTON_PIO;
+typedef Device<0x150, 32> JTAG_UART;
+typedef Device<0x158, 8> SYSID_QSYS;
+
+// Device offsets of the PWM cores by servo ID, for IDs known only at run time
+constexpr uint32_t PWM_BASES[PWM_NUM] = {
+	0x110,
+	0x100,
+	0xf0,
+	0xe0,
+	0xd0,
+	0xc0,
+	0xb0,
+	0xa0,
+	0x90,
+	0x80,
+	0x70,
+	0x60,
+	0x50,
+	0x40,
+	0x30,
+	0x20,
+	0x10,
+	0x0,
+};
+
+// Servo IDs by ascending register address
+constexpr uint32_t PWM_ORDER[PWM_NUM] = {
+	17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+};
+
+// The extent of all devices: the lowest offset, and the end of the highest
+constexpr uint32_t DEVICES_START = 0x0;
+constexpr uint32_t DEVICES_END = 0x180;
+
+} // namespace RegMap
+
+#endif /* REGMAP_H_ */
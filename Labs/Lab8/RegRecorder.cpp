@@ -0,0 +1,174 @@
+#ifndef REGRECORDER_CPP_
+#define REGRECORDER_CPP_
+#include "MMap.h"
+#include "SpscRing.cpp"
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+// Environment variable naming a register log to record into: SPIDER_RECORD=<file>
+#define RECORD_FILE_ENV "SPIDER_RECORD"
+// Records buffered between the control thread and the writer thread (a power of two)
+#define RECORD_RING_SIZE 65536
+// How often the writer thread flushes the ring to the file
+#define RECORD_FLUSH_MS 50
+
+#define RECORD_MAGIC 0x4c525053 // "SPRL"
+#define RECORD_VERSION 1
+
+/*
+ * A register log is a RecordHeader followed by one RegRecord per register
+ * access that reached the bus, in the order they were issued. Writes the
+ * shadow registers elided are not recorded, since they never happened.
+ */
+
+typedef enum
+{
+	RECORD_WRITE,
+	RECORD_READ
+} RECORD_OP;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recordSize; // sizeof(RegRecord)
+	uint32_t dropped;    // records lost because the ring was full
+	uint64_t startNs;    // MonotonicNs() when recording started
+	uint64_t records;
+} RecordHeader;
+
+typedef struct
+{
+	uint64_t timeNs;  // since RecordHeader::startNs
+	uint32_t value;   // written, or read back
+	uint8_t motorId;
+	uint8_t regOffset;
+	uint8_t op;       // RECORD_OP
+	uint8_t reserved;
+} RegRecord;
+
+/**
+ * Records register accesses into a preallocated lock-free ring, which a
+ * writer thread flushes to a log file in the background. Recording is one
+ * ring push, with no system call or allocation, so it can stay enabled in
+ * the control loop; if the writer falls behind, records are dropped and
+ * counted rather than blocking the caller.
+ *
+ * Record() must only be called from one thread at a time (whichever one
+ * drives the MMap).
+ */
+class RegRecorder
+{
+	SpscRing<RegRecord, RECORD_RING_SIZE> m_ring;
+	FILE *m_file;
+	RecordHeader m_header;
+	std::atomic<uint32_t> m_dropped;
+	std::thread m_writer;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_stop;
+
+	// Writes out everything in the ring
+	void drain()
+	{
+		RegRecord buf[256];
+		size_t n = 0;
+		for (RegRecord *r = m_ring.Front(); r != NULL; r = m_ring.Front()) {
+			buf[n++] = *r;
+			m_ring.Pop();
+			if (n == sizeof(buf) / sizeof(buf[0])) {
+				fwrite(buf, sizeof(RegRecord), n, m_file);
+				n = 0;
+			}
+		}
+		fwrite(buf, sizeof(RegRecord), n, m_file);
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stop) {
+			m_wake.wait_for(lock, std::chrono::milliseconds(RECORD_FLUSH_MS));
+			lock.unlock();
+			drain();
+			lock.lock();
+		}
+	}
+
+public:
+	RegRecorder()
+	{
+		m_file = NULL;
+		m_dropped = 0;
+		m_stop = false;
+		memset(&m_header, 0, sizeof(m_header));
+	}
+
+	~RegRecorder() { Close(); }
+
+	/**
+	 * Starts recording into a new log file.
+	 * @return false if the file could not be created
+	 */
+	bool Open(const char *path)
+	{
+		Close();
+		m_file = fopen(path, "wb");
+		if (m_file == NULL) {
+			fprintf(stderr, "ERROR: could not create \"%s\"...\n", path);
+			return false;
+		}
+		memset(&m_header, 0, sizeof(m_header));
+		m_header.magic = RECORD_MAGIC;
+		m_header.version = RECORD_VERSION;
+		m_header.recordSize = sizeof(RegRecord);
+		m_header.startNs = MonotonicNs();
+		fwrite(&m_header, sizeof(m_header), 1, m_file);
+		m_dropped = 0;
+		m_stop = false;
+		m_writer = std::thread(&RegRecorder::run, this);
+		return true;
+	}
+
+	bool IsOpen() { return m_file != NULL; }
+
+	/**
+	 * Flushes the remaining records, completes the header and closes the
+	 * log. Call it once the register accesses have stopped.
+	 */
+	void Close()
+	{
+		if (m_file == NULL)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		m_writer.join();
+		drain();
+		m_header.dropped = m_dropped;
+		m_header.records = (ftell(m_file) - sizeof(m_header)) / sizeof(RegRecord);
+		fseek(m_file, 0, SEEK_SET);
+		fwrite(&m_header, sizeof(m_header), 1, m_file);
+		fclose(m_file);
+		m_file = NULL;
+		if (m_header.dropped != 0)
+			fprintf(stderr, "ERROR: register log dropped %u records...\n", m_header.dropped);
+	}
+
+	// Records one register access at time nowNs (MonotonicNs())
+	void Record(uint64_t nowNs, RECORD_OP op, uint32_t motorId, uint32_t regOffset, uint32_t value)
+	{
+		RegRecord r = { nowNs - m_header.startNs, value, (uint8_t)motorId, (uint8_t)regOffset, (uint8_t)op, 0 };
+		if (!m_ring.Push(r))
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	uint32_t GetDropped() { return m_dropped; }
+};
+
+#endif /* REGRECORDER_CPP_ */
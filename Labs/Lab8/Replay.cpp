@@ -0,0 +1,107 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <vector>
+#include "RegRecorder.cpp"
+#include "RealTime.cpp"
+
+using namespace std;
+
+// Reads a whole register log; false, with a message, if it is not one
+static bool LoadLog(const char *path, RecordHeader &header, vector<RegRecord> &records)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "ERROR: could not open \"%s\"...\n", path);
+		return false;
+	}
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == RECORD_MAGIC
+		&& header.version == RECORD_VERSION && header.recordSize == sizeof(RegRecord);
+	if (ok) {
+		records.resize(header.records);
+		ok = fread(records.data(), sizeof(RegRecord), records.size(), file) == records.size();
+	}
+	fclose(file);
+	if (!ok)
+		fprintf(stderr, "ERROR: \"%s\" is not a complete register log...\n", path);
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	cerr << "Usage: " << name << " [-x <speed> | -m] <register log>" << endl
+		 << "  -x <speed>   replay <speed> times faster than recorded (default 1)" << endl
+		 << "  -m           replay as fast as possible" << endl
+		 << "Drives the backend chosen by $" << MMAP_BACKEND_ENV << "; $" << RT_ENV << " enables real-time mode." << endl;
+}
+
+/**
+ * Replays a register log recorded with $SPIDER_RECORD: issues every write
+ * and read again, in order, at the recorded times scaled by the speed, and
+ * reports how late the accesses were and which reads returned a different
+ * value than when recorded.
+ */
+int main(int argc, char *argv[])
+{
+	double speed = 1;
+	int arg = 1;
+	for (; arg < argc - 1; arg++) {
+		string opt = argv[arg];
+		if (opt == "-m")
+			speed = 0;
+		else if (opt == "-x" && arg + 2 < argc && atof(argv[arg + 1]) > 0)
+			speed = atof(argv[++arg]);
+		else
+			break;
+	}
+	if (arg != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	RecordHeader header;
+	vector<RegRecord> records;
+	if (!LoadLog(argv[arg], header, records))
+		return 1;
+	if (header.dropped != 0)
+		fprintf(stderr, "ERROR: the log is missing %u records dropped while recording...\n", header.dropped);
+
+	MMap mmap;
+	if (!mmap.isMapped())
+		return 1;
+	// Every recorded access reached the bus, so none may be elided now
+	mmap.SetShadowEnabled(false);
+	RealTime rt;
+	if (rt.ConfigureFromEnv())
+		rt.Enter();
+
+	LatencyHistogram late;
+	uint64_t writes = 0, reads = 0, mismatches = 0;
+	uint64_t start = MonotonicNs();
+	for (size_t i = 0; i < records.size(); i++) {
+		const RegRecord &r = records[i];
+		if (speed > 0) {
+			uint64_t due = start + (uint64_t)(r.timeNs / speed);
+			SleepUntilNs(due);
+			late.Add(MonotonicNs() - due);
+		}
+		if (r.op == RECORD_WRITE) {
+			mmap.Motor_Reg32_Write(r.motorId, r.regOffset, r.value);
+			writes++;
+		} else {
+			if (mmap.Motor_Reg32_Read(r.motorId, r.regOffset) != r.value)
+				mismatches++;
+			reads++;
+		}
+	}
+	double seconds = (MonotonicNs() - start) / 1e9;
+
+	double recorded = records.empty() ? 0 : records.back().timeNs / 1e9;
+	printf("Replayed %llu writes and %llu reads in %.3f s (recorded over %.3f s)\n",
+		   (unsigned long long)writes, (unsigned long long)reads, seconds, recorded);
+	printf("Reads that differed from the recording: %llu\n", (unsigned long long)mismatches);
+	if (speed > 0)
+		late.Print(stdout, "Replay lateness");
+	return 0;
+}
@@ -0,0 +1,361 @@
+#ifndef SERVOFRAME_CPP_
+#define SERVOFRAME_CPP_
+#include "CurrentBudget.cpp"
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+
+// Environment variable choosing how frame commits are timed against the PWM period:
+//   SPIDER_FRAME_SYNC=off | guard | boundary, optionally followed by :<phase us>
+#define FRAME_SYNC_ENV "SPIDER_FRAME_SYNC"
+// The PWM period, in nanoseconds
+#define FRAME_PERIOD_NS ((uint64_t)T_20MS * (1000000000ull / FREQ))
+// A guarded commit this close to the next period boundary waits until just after it
+#define FRAME_GUARD_NS 200000
+// How long after a boundary a delayed commit is written, so it does not race the boundary
+#define FRAME_BOUNDARY_DELAY_NS 20000
+// A boundary commit this soon after a boundary is written at once
+#define FRAME_BOUNDARY_WINDOW_NS 1000000
+
+/**
+ * A frame of duty cycles for any subset of the 18 servos, staged one at a
+ * time and then committed together. Servos moved one register write at a
+ * time can pick up their new duty cycles in different 20 ms PWM periods,
+ * so a movement's legs visibly start one after another. A commit writes
+ * the whole frame as one tight burst (MMap::Motor_DC_WriteFrame), timed
+ * so that no period boundary falls inside it:
+ *   FRAME_SYNC_OFF      - written at once
+ *   FRAME_SYNC_GUARD    - written at once, unless the next boundary is
+ *                         within FRAME_GUARD_NS; then just after it (default)
+ *   FRAME_SYNC_BOUNDARY - always written just after a boundary
+ *
+ * The PWM cores' counters cannot be read, so the boundaries are estimated:
+ * one period apart from an epoch (see SetEpoch), shifted by a phase that
+ * can be measured on a scope. Where the FPGA design has a frame latch (see
+ * MMap::HasFrameLatch) the cores take the frame together whenever it is
+ * written, so commits are never delayed.
+ *
+ * Each commit records its spread, the time from its first register write
+ * to its last.
+ *
+ * With a current budget (see CurrentBudget) a frame whose moves would draw
+ * too much together is committed in parts. Each part is written when its
+ * moves are due to start.
+ *
+ * The frame also tracks which servos hold torque. Release() stops a
+ * servo's pulses through PWM_ABORT and Arm() restarts them. Every servo
+ * with a pulse is counted as held or released over time, in servo-seconds,
+ * to quantify the energy saved. GetPower() may be called from any thread.
+ */
+class ServoFrame
+{
+public:
+	typedef enum
+	{
+		FRAME_SYNC_OFF,
+		FRAME_SYNC_GUARD,
+		FRAME_SYNC_BOUNDARY
+	} SYNC;
+
+	typedef struct
+	{
+		uint64_t commits;       // Frames committed
+		uint64_t delayed;       // Commits that waited for a period boundary
+		uint64_t straddled;     // Commits with an estimated boundary inside their burst
+		uint64_t lastSpreadNs;  // First-to-last write time of the most recent commit
+		uint64_t maxSpreadNs;   // Largest spread
+		uint64_t totalSpreadNs; // Spread over all commits
+	} Stats;
+
+	typedef struct
+	{
+		uint64_t heldNs;     // Time servos with a pulse held torque, summed over the servos
+		uint64_t releasedNs; // Time servos with a pulse were released, summed over the servos
+		uint64_t releases;   // Servos released
+		uint64_t arms;       // Released servos re-armed
+	} Power;
+
+private:
+	// The staged duty cycles, and which motors have one (bit per motor ID)
+	uint32_t m_dc[MOTOR_NUM];
+	uint32_t m_mask;
+	// The servo told of each staged move once it is written, or NULL, and the move's angle
+	ServoMotor *m_motor[MOTOR_NUM];
+	float m_angle[MOTOR_NUM];
+	SYNC m_sync;
+	// A period boundary falls m_phaseNs after m_epochNs, and every FRAME_PERIOD_NS from there
+	uint64_t m_epochNs;
+	uint64_t m_phaseNs;
+	Stats m_stats;
+	CurrentBudget m_budget;
+	// When each motor was last written, the motors last given a pulse (a non-zero
+	// duty cycle), those released, and the time their power is accounted up to
+	uint64_t m_lastWriteNs[MOTOR_NUM];
+	uint32_t m_pulsed;
+	uint32_t m_released;
+	uint64_t m_accountedNs;
+	Power m_power;
+	// Guards the power accounting (m_pulsed, m_released, m_accountedNs and
+	// m_power) against GetPower() on another thread
+	std::mutex m_powerMutex;
+
+	// Adds the time since the last call to the held and released servo time; call it under m_powerMutex
+	void account()
+	{
+		uint64_t now = MonotonicNs();
+		m_power.heldNs += __builtin_popcount(m_pulsed & ~m_released) * (now - m_accountedNs);
+		m_power.releasedNs += __builtin_popcount(m_pulsed & m_released) * (now - m_accountedNs);
+		m_accountedNs = now;
+	}
+
+	// Writes value to the PWM_ABORT register of every motor in mask as one batch
+	bool writeAbort(MMap *mmio, uint32_t mask, uint32_t value)
+	{
+		MMap::RegWrite writes[MOTOR_NUM];
+		size_t n = 0;
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			if (mask & (1u << id))
+				writes[n++] = MMap::BatchWrite<RegMap::PwmCore::Abort>(id, value);
+		}
+		return mmio->Motor_Reg32_WriteBatch(writes, n);
+	}
+
+	// Time since the estimated period boundary at or before t
+	uint64_t sinceBoundary(uint64_t t)
+	{
+		uint64_t boundary = (m_epochNs + m_phaseNs) % FRAME_PERIOD_NS;
+		return (t + FRAME_PERIOD_NS - boundary) % FRAME_PERIOD_NS;
+	}
+
+	// Writes the staged duty cycles of the motors in mask as one burst, once the timing allows
+	bool write(MMap *mmio, uint32_t mask)
+	{
+		if (m_sync != FRAME_SYNC_OFF && !MMap::HasFrameLatch()) {
+			uint64_t now = MonotonicNs(), since = sinceBoundary(now);
+			bool wait = (m_sync == FRAME_SYNC_GUARD) ? FRAME_PERIOD_NS - since < FRAME_GUARD_NS
+													 : since > FRAME_BOUNDARY_WINDOW_NS;
+			if (wait) {
+				SleepUntilNs(now + FRAME_PERIOD_NS - since + FRAME_BOUNDARY_DELAY_NS);
+				m_stats.delayed++;
+			}
+		}
+		if (!mmio->Motor_DC_WriteFrame(m_dc, mask))
+			return false;
+		{
+			std::lock_guard<std::mutex> lock(m_powerMutex);
+			account();
+			for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+				if (mask & (1u << id)) {
+					m_lastWriteNs[id] = m_accountedNs;
+					if (m_dc[id] != 0)
+						m_pulsed |= 1u << id;
+					else
+						m_pulsed &= ~(1u << id);
+				}
+			}
+		}
+
+		uint64_t spread = mmio->GetLastSpreadNs();
+		if (sinceBoundary(mmio->GetLastFrameNs()) + spread >= FRAME_PERIOD_NS)
+			m_stats.straddled++;
+		m_stats.commits++;
+		m_stats.lastSpreadNs = spread;
+		m_stats.totalSpreadNs += spread;
+		if (spread > m_stats.maxSpreadNs)
+			m_stats.maxSpreadNs = spread;
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			if ((mask & (1u << id)) && m_motor[id] != NULL)
+				m_motor[id]->Commit(m_dc[id], m_angle[id]);
+		return true;
+	}
+
+public:
+	ServoFrame(SYNC sync = FRAME_SYNC_GUARD)
+	{
+		m_mask = 0;
+		m_sync = sync;
+		m_epochNs = MonotonicNs();
+		m_phaseNs = 0;
+		ResetStats();
+		memset(m_lastWriteNs, 0, sizeof(m_lastWriteNs));
+		m_pulsed = 0;
+		m_released = 0;
+		m_accountedNs = MonotonicNs();
+		memset(&m_power, 0, sizeof(m_power));
+	}
+
+	/**
+	 * Configures the timing from $SPIDER_FRAME_SYNC and the current budget
+	 * from $SPIDER_CURRENT, if they are set.
+	 * @return false if a variable cannot be parsed
+	 */
+	bool ConfigureFromEnv()
+	{
+		if (!m_budget.ConfigureFromEnv())
+			return false;
+		const char *name = getenv(FRAME_SYNC_ENV);
+		if (name == NULL)
+			return true;
+		const char *phase = strchr(name, ':');
+		size_t len = (phase != NULL) ? (size_t)(phase - name) : strlen(name);
+		if (len == 3 && strncmp(name, "off", len) == 0)
+			m_sync = FRAME_SYNC_OFF;
+		else if (len == 5 && strncmp(name, "guard", len) == 0)
+			m_sync = FRAME_SYNC_GUARD;
+		else if (len == 8 && strncmp(name, "boundary", len) == 0)
+			m_sync = FRAME_SYNC_BOUNDARY;
+		else {
+			fprintf(stderr, "ERROR: unknown %s timing \"%s\"...\n", FRAME_SYNC_ENV, name);
+			return false;
+		}
+		if (phase != NULL)
+			m_phaseNs = strtoull(phase + 1, NULL, 0) * 1000 % FRAME_PERIOD_NS;
+		return true;
+	}
+
+	void SetSync(SYNC sync) { m_sync = sync; }
+	SYNC GetSync() { return m_sync; }
+
+	/**
+	 * Sets when a PWM period is taken to have started, e.g. when the
+	 * servos' PERIOD registers were written (the constructor's time by
+	 * default), and how long after that the cores' periods actually begin.
+	 */
+	void SetEpoch(uint64_t epochNs) { m_epochNs = epochNs; }
+	void SetPhase(uint64_t phaseNs) { m_phaseNs = phaseNs % FRAME_PERIOD_NS; }
+
+	const Stats &GetStats() { return m_stats; }
+	void ResetStats() { memset(&m_stats, 0, sizeof(m_stats)); }
+	CurrentBudget *GetBudget() { return &m_budget; }
+
+	// When a frame last wrote the motor's duty cycle (MonotonicNs() time base), 0 if never
+	uint64_t GetLastWriteNs(uint32_t motorId) { return m_lastWriteNs[motorId]; }
+	// The motors whose last duty cycle was not 0, so they have a pulse unless released
+	uint32_t GetPulsed() { return m_pulsed; }
+	uint32_t GetReleased() { return m_released; }
+
+	/**
+	 * Releases the holding torque of the motors in mask that have a pulse,
+	 * by setting their PWM_ABORT.
+	 * @return false if the register mapping does not exist
+	 */
+	bool Release(MMap *mmio, uint32_t mask)
+	{
+		mask &= m_pulsed & ~m_released;
+		if (mask == 0)
+			return true;
+		if (!writeAbort(mmio, mask, 1))
+			return false;
+		std::lock_guard<std::mutex> lock(m_powerMutex);
+		account();
+		m_released |= mask;
+		m_power.releases += __builtin_popcount(mask);
+		return true;
+	}
+
+	/**
+	 * Restores the pulses, and so the holding torque, of the released
+	 * motors in mask. They take it up again at their next PWM period.
+	 * @return false if the register mapping does not exist
+	 */
+	bool Arm(MMap *mmio, uint32_t mask)
+	{
+		mask &= m_released;
+		if (mask == 0)
+			return true;
+		if (!writeAbort(mmio, mask, 0))
+			return false;
+		std::lock_guard<std::mutex> lock(m_powerMutex);
+		account();
+		m_released &= ~mask;
+		m_power.arms += __builtin_popcount(mask);
+		return true;
+	}
+
+	// Held and released servo time up to now, and how often servos were released and re-armed
+	Power GetPower()
+	{
+		std::lock_guard<std::mutex> lock(m_powerMutex);
+		Power power = m_power;
+		uint64_t since = MonotonicNs() - m_accountedNs;
+		power.heldNs += __builtin_popcount(m_pulsed & ~m_released) * since;
+		power.releasedNs += __builtin_popcount(m_pulsed & m_released) * since;
+		return power;
+	}
+
+	/**
+	 * Stages a move of a servo to fAngle, clamped to [-90, 90]. The servo
+	 * records the move when the frame is committed.
+	 */
+	void Stage(ServoMotor *motor, float fAngle)
+	{
+		fAngle = ServoMotor::ClampAngle(fAngle);
+		Set(motor, motor->CalibratedDC(fAngle), fAngle);
+	}
+
+	// Same as Stage, with the duty cycle already computed, e.g. by a compiled gait
+	void Set(ServoMotor *motor, uint32_t dc, float fAngle)
+	{
+		uint32_t id = motor->GetMotorID();
+		m_dc[id] = dc;
+		m_motor[id] = motor;
+		m_angle[id] = fAngle;
+		m_mask |= 1u << id;
+	}
+
+	/**
+	 * Stages the duty cycles of the motors in mask, e.g. streamed setpoints
+	 * whose servos keep track of them themselves.
+	 * @param dc - duty cycle per motor ID; entries not in the mask are ignored
+	 */
+	void SetDC(const uint32_t dc[MOTOR_NUM], uint32_t mask = (1u << MOTOR_NUM) - 1)
+	{
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			if (mask & (1u << id)) {
+				m_dc[id] = dc[id];
+				m_motor[id] = NULL;
+			}
+		}
+		m_mask |= mask;
+	}
+
+	uint32_t GetMask() { return m_mask; }
+	void Clear() { m_mask = 0; }
+
+	/**
+	 * Writes the staged duty cycles as one burst, once the timing allows,
+	 * and empties the frame. With a current budget, moves due to start
+	 * later are written in further bursts, sleeping until they are due.
+	 * @return false if the register mapping does not exist
+	 */
+	bool Commit(MMap *mmio)
+	{
+		uint32_t mask = m_mask;
+		m_mask = 0;
+		if (mask == 0)
+			return true;
+		if (!m_budget.IsEnabled())
+			return write(mmio, mask);
+
+		uint64_t now = MonotonicNs(), start[MOTOR_NUM];
+		m_budget.Plan(now, m_dc, m_motor, mask, start);
+		while (mask != 0) {
+			uint64_t next = UINT64_MAX;
+			for (uint32_t id = 0; id < MOTOR_NUM; id++)
+				if ((mask & (1u << id)) && start[id] < next)
+					next = start[id];
+			uint32_t part = 0;
+			for (uint32_t id = 0; id < MOTOR_NUM; id++)
+				if ((mask & (1u << id)) && start[id] == next)
+					part |= 1u << id;
+			if (next != 0)
+				SleepUntilNs(now + next);
+			if (!write(mmio, part))
+				return false;
+			mask &= ~part;
+		}
+		return true;
+	}
+};
+
+#endif /* SERVOFRAME_CPP_ */
@@ -1,3 +1,5 @@
+#ifndef SERVOMOTOR_CPP_
+#define SERVOMOTOR_CPP_
 #include "MMap.h"
 
 #define DEGREE_MIN -90
@@ -5,25 +7,78 @@
 #define SPEED_MAX 100
 #define SPEED_MIN 0
 
-// Use these definitions for _index_ arguments to the RegisterRead/RegisterWrite methods
-#define PWM_PERIOD 0
-#define PWM_DC 1
-#define PWM_DELAY 2
-#define PWM_READY 2
-#define PWM_ABORT 3
-
 // The DE10 clock frequency
 #define FREQ 50000000
 // The 20MS PWM period, in clock ticks
 #define T_20MS (FREQ / 50)
-// The maximum allowed PWM Duty cycle (corresponds to 90 degrees)
-#define PWM_MAX (T_20MS * 2.5 / 20)
-// The minimum allowed PWM Duty cycle (corresponds to -90 degrees)
-#define PWM_MIN (T_20MS * 0.5 / 20)
+// The maximum allowed PWM Duty cycle (corresponds to 90 degrees), 2.5 ms
+#define PWM_MAX (T_20MS * 25 / 200)
+// The minimum allowed PWM Duty cycle (corresponds to -90 degrees), 0.5 ms
+#define PWM_MIN (T_20MS * 5 / 200)
 
 #define DELAY_MIN 1000 // TODO replace this with your calculation from pre-lab 3
 #define DELAY_MAX 2000 // TODO replace this with your calculation from pre-lab 3
 
+// Angles are quantised to 1 / ANGLE_STEPS_PER_DEGREE degree for the lookup table
+#define ANGLE_STEPS_PER_DEGREE 10
+#define ANGLE_TABLE_SIZE ((DEGREE_MAX - DEGREE_MIN) * ANGLE_STEPS_PER_DEGREE + 1)
+#define SPEED_TABLE_SIZE (SPEED_MAX - SPEED_MIN + 1)
+
+/*
+ * Compile-time index sequences (std::index_sequence is C++14), built by
+ * halving so 1801 entries stay well within the template depth limit.
+ */
+template <unsigned... I> struct IndexSeq {};
+template <class A, class B> struct ConcatSeq;
+template <unsigned... A, unsigned... B>
+struct ConcatSeq<IndexSeq<A...>, IndexSeq<B...> > { typedef IndexSeq<A..., (sizeof...(A) + B)...> type; };
+template <unsigned N>
+struct MakeIndexSeq { typedef typename ConcatSeq<typename MakeIndexSeq<N / 2>::type, typename MakeIndexSeq<N - N / 2>::type>::type type; };
+template <> struct MakeIndexSeq<0> { typedef IndexSeq<> type; };
+template <> struct MakeIndexSeq<1> { typedef IndexSeq<0> type; };
+
+// Duty cycle of table entry i, i.e. of DEGREE_MIN + i / ANGLE_STEPS_PER_DEGREE degrees, rounded
+constexpr uint32_t AngleIndexToDC(unsigned i)
+{
+	return PWM_MIN + (i * (uint32_t)(PWM_MAX - PWM_MIN) + (ANGLE_TABLE_SIZE - 1) / 2) / (ANGLE_TABLE_SIZE - 1);
+}
+
+// Delay of a speed: DELAY_MAX at SPEED_MIN down to DELAY_MIN at SPEED_MAX
+constexpr uint32_t SpeedIndexToDelay(unsigned i)
+{
+	return DELAY_MAX - i * (DELAY_MAX - DELAY_MIN) / (SPEED_MAX - SPEED_MIN);
+}
+
+typedef struct { uint32_t dc[ANGLE_TABLE_SIZE]; } AngleTable;
+typedef struct { uint32_t delay[SPEED_TABLE_SIZE]; } SpeedTable;
+
+template <unsigned... I>
+constexpr AngleTable MakeAngleTable(IndexSeq<I...>) { return AngleTable{ { AngleIndexToDC(I)... } }; }
+template <unsigned... I>
+constexpr SpeedTable MakeSpeedTable(IndexSeq<I...>) { return SpeedTable{ { SpeedIndexToDelay(I)... } }; }
+
+// The duty cycle of every quantised angle and the delay of every speed, built by the compiler
+static constexpr AngleTable angle_dc_table = MakeAngleTable(MakeIndexSeq<ANGLE_TABLE_SIZE>::type());
+static constexpr SpeedTable speed_delay_table = MakeSpeedTable(MakeIndexSeq<SPEED_TABLE_SIZE>::type());
+static_assert(angle_dc_table.dc[0] == PWM_MIN && angle_dc_table.dc[ANGLE_TABLE_SIZE - 1] == PWM_MAX,
+			  "angle table must span PWM_MIN to PWM_MAX");
+static_assert(speed_delay_table.delay[0] == DELAY_MAX && speed_delay_table.delay[SPEED_TABLE_SIZE - 1] == DELAY_MIN,
+			  "speed table must span DELAY_MAX to DELAY_MIN");
+
+/**
+ * The PWM core ramps the duty cycle towards a newly written value by one
+ * clock tick every PWM_DELAY clock cycles. This predicts how long that takes.
+ * @param dcFrom - the duty cycle the ramp starts from
+ * @param dcTo - the newly written duty cycle
+ * @param delay - the PWM_DELAY register value
+ * @return the predicted ramp time in nanoseconds
+ */
+inline uint64_t PwmRampNs(uint32_t dcFrom, uint32_t dcTo, uint32_t delay)
+{
+	uint64_t ticks = (dcFrom > dcTo) ? dcFrom - dcTo : dcTo - dcFrom;
+	return ticks * delay * (1000000000ull / FREQ);
+}
+
 class ServoMotor
 {
 public:
@@ -39,6 +94,13 @@ private:
 	int m_nMotorID;
 	// Stores a pointer to the memory map object that can communicate with the servo.
 	MMap *_mmio;
+	// The duty cycle and delay last written to the PWM core
+	uint32_t m_dc;
+	uint32_t m_delay;
+	// When the last move is predicted to finish (MonotonicNs() time base)
+	uint64_t m_readyAtNs;
+	// This servo's angle to duty cycle table: angle_dc_table, or a calibrated one
+	const AngleTable *m_table;
 
     /**
 	 * Given a speed value, s, convert it into an appropriate
@@ -48,8 +110,25 @@ private:
 	 */
 	int speedToDelay(int s)
 	{
-		float percent = s / 100;
-		return DELAY_MAX - ((int)percent * (DELAY_MAX - DELAY_MIN));
+		if (s > SPEED_MAX) {
+			s = SPEED_MAX;
+		} else if (s < SPEED_MIN) {
+			s = SPEED_MIN;
+		}
+		return speed_delay_table.delay[s - SPEED_MIN];
+	}
+
+	/**
+	 * Clamps the angle to [-90, 90], stores it as the current angle
+	 * and computes the matching duty cycle.
+	 * @return the duty cycle register value for the angle
+	 */
+	uint32_t setAngle(float fAngle)
+	{
+		fAngle = ClampAngle(fAngle);
+		uint32_t dc = CalibratedDC(fAngle);
+		Commit(dc, fAngle);
+		return dc;
 	}
 
 public:
@@ -62,6 +141,10 @@ public:
 		m_nMotorID = motorId;
 		m_fAngle = 180.0;
 		m_speed = 0;
+		m_dc = 0;
+		m_delay = speedToDelay(50);
+		m_readyAtNs = 0;
+		m_table = &angle_dc_table;
 
 		_mmio = mmio;
 		// TODO use MMIO to set:
@@ -69,10 +152,10 @@ public:
 		// THE PWM duty cycle
 		// The delay
 		// Also set the Abort field to 0
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_PERIOD, T_20MS);
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_DC, 0);
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_DELAY, speedToDelay(50));
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_ABORT, 0);
+		_mmio->Write<RegMap::PwmCore::Period>(m_nMotorID, T_20MS);
+		_mmio->Write<RegMap::PwmCore::Dc>(m_nMotorID, 0);
+		_mmio->Write<RegMap::PwmCore::Delay>(m_nMotorID, m_delay);
+		_mmio->Write<RegMap::PwmCore::Abort>(m_nMotorID, 0);
 	}
 
 	
@@ -88,16 +171,7 @@ public:
 	 */
 	void Move(float fAngle)
 	{
-		if (fAngle > DEGREE_MAX) {
-			fAngle = DEGREE_MAX;
-		} else if (fAngle < DEGREE_MIN) {
-			fAngle = DEGREE_MIN;
-		}
-		m_fAngle = fAngle;
-		// TODO compute the correct duty cycle from the current angle
-		// and use MMIO to update the correct register
-		int32_t dc = (uint32_t)(PWM_MIN + ((GetfAngle() - DEGREE_MIN) / (float)(DEGREE_MAX - DEGREE_MIN)) * (float)(PWM_MAX - PWM_MIN));
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_DC, dc);
+		_mmio->Write<RegMap::PwmCore::Dc>(m_nMotorID, setAngle(fAngle));
 	}
 
 
@@ -107,7 +181,7 @@ public:
 	 */
 	bool IsReady()
 	{
-		return _mmio->Motor_Reg32_Read(m_nMotorID, PWM_READY);
+		return _mmio->Read<RegMap::PwmCore::Ready>(m_nMotorID);
 	}
 
 	/**
@@ -128,9 +202,104 @@ public:
 		}
 		m_speed = speed;
 		// TODO update the PWM circuit registers using the appropriate MMIO address
-		_mmio->Motor_Reg32_Write(m_nMotorID, PWM_DELAY, speedToDelay(GetSpeed()));
+		m_delay = speedToDelay(GetSpeed());
+		_mmio->Write<RegMap::PwmCore::Delay>(m_nMotorID, m_delay);
+	}
+
+	// Clamps an angle to [-90, 90]
+	static float ClampAngle(float fAngle)
+	{
+		return (fAngle > DEGREE_MAX) ? DEGREE_MAX : (fAngle < DEGREE_MIN) ? DEGREE_MIN : fAngle;
+	}
+
+	/**
+	 * Looks up the duty cycle for an angle, clamped to [-90, 90] and
+	 * rounded to the nearest 1 / ANGLE_STEPS_PER_DEGREE degree.
+	 */
+	static uint32_t AngleToDC(float fAngle)
+	{
+		return StepsToDC(AngleToSteps(fAngle));
+	}
+
+	/**
+	 * Converts an angle to table steps above DEGREE_MIN, clamped to the table.
+	 * This is the only float operation of a move.
+	 */
+	static int AngleToSteps(float fAngle)
+	{
+		int steps = (int)((fAngle - DEGREE_MIN) * ANGLE_STEPS_PER_DEGREE + 0.5f);
+		return (steps < 0) ? 0 : (steps >= ANGLE_TABLE_SIZE) ? ANGLE_TABLE_SIZE - 1 : steps;
+	}
+
+	// Looks up the duty cycle for an angle already in table steps
+	static uint32_t StepsToDC(int steps)
+	{
+		return angle_dc_table.dc[steps];
+	}
+
+	/**
+	 * Same as AngleToDC, but looks the angle up in this servo's table, so
+	 * its calibration is applied.
+	 */
+	uint32_t CalibratedDC(float fAngle)
+	{
+		return m_table->dc[AngleToSteps(fAngle)];
+	}
+
+	/**
+	 * Replaces this servo's angle to duty cycle table, e.g. with one built
+	 * from a calibration. The table must outlive its use; NULL restores
+	 * the nominal table. Takes effect from the next move.
+	 */
+	void SetTable(const AngleTable *table)
+	{
+		m_table = (table != NULL) ? table : &angle_dc_table;
+	}
+
+	/**
+	 * Records that the duty cycle dc, for the angle fAngle, has been (or is
+	 * about to be) written to this servo's DC register by someone else,
+	 * e.g. a precompiled gait, so the angle and readiness prediction stay current.
+	 */
+	void Commit(uint32_t dc, float fAngle)
+	{
+		m_fAngle = fAngle;
+		if (dc != m_dc) {
+			m_readyAtNs = MonotonicNs() + PwmRampNs(m_dc, dc, m_delay);
+			m_dc = dc;
+		}
 	}
 
+	/**
+	 * Computes the angle of a duty cycle, the inverse of AngleToDC.
+	 */
+	static float DCToAngle(uint32_t dc)
+	{
+		return DEGREE_MIN + (dc - (float)PWM_MIN) * (DEGREE_MAX - DEGREE_MIN) / (float)(PWM_MAX - PWM_MIN);
+	}
+
+	/**
+	 * Records that a duty cycle has been streamed to this servo frame by
+	 * frame and the servo has followed it, so no ramp is predicted.
+	 */
+	void Track(uint32_t dc, float fAngle)
+	{
+		m_fAngle = fAngle;
+		m_dc = dc;
+		m_readyAtNs = MonotonicNs();
+	}
+
+	int GetMotorID() { return m_nMotorID; }
+	// The duty cycle and PWM_DELAY value last written to the servo
+	uint32_t GetDC() { return m_dc; }
+	uint32_t GetDelay() { return m_delay; }
+
+	/**
+	 * @return when the last move is predicted to have finished, from the
+	 * angle change and the programmed delay (MonotonicNs() time base)
+	 */
+	uint64_t GetReadyAtNs() { return m_readyAtNs; }
+
 
 	virtual float GetfAngle(){ return (m_fAngle == -0.0) ? 0.0f :  m_fAngle; }
   
@@ -141,3 +310,4 @@ public:
 	}
 };
 
+#endif /* SERVOMOTOR_CPP_ */
@@ -0,0 +1,283 @@
+#ifndef SERVOSIM_CPP_
+#define SERVOSIM_CPP_
+#include "SpiderLeg.cpp"
+#include "BodyPose.cpp"
+
+// Virtual time at which a simulation starts, so no time reads as 0
+#define SIM_START_NS 1000000000ull
+// Virtual time taken by each register access across the bridge
+#define SIM_ACCESS_NS 250
+// Interval between kinematic samples of the body and feet
+#define SIM_SAMPLE_NS 2000000ull
+// Feet within this height of the lowest foot bear weight
+#define SIM_CONTACT_MM 2.0f
+
+/**
+ * A headless model of the robot behind a simulated MMap backend, in
+ * virtual time. Each PWM core ramps its duty cycle towards the last value
+ * written by one clock tick every PWM_DELAY clocks and reports PWM_READY
+ * once there, as the hardware does. Every SIM_SAMPLE_NS the joint angles
+ * are put through the legs' forward kinematics to find the feet; the
+ * lowest feet are planted, and the rigid planar motion that best keeps
+ * the planted feet still moves the body. Whatever the planted feet still
+ * move after that slips.
+ *
+ * Motors are numbered as in Spider: leg i (RF RM RB LF LM LB) has motors
+ * 3i to 3i + 2 for hip, knee and ankle, and the right legs' servos turn
+ * the other way.
+ *
+ * Install it as both the MMap's model and the virtual clock; every sleep
+ * then advances time, so a movement runs as fast as it can be computed.
+ */
+class ServoSim : public RegModel, public VirtualClock
+{
+public:
+	// How the body has moved since the last ResetMotion()
+	typedef struct
+	{
+		double x, y;      // Body position in the world, mm
+		double yaw;       // Heading, degrees anticlockwise
+		double distance;  // Path length of the body, mm
+		double slipMm;    // Distance slid by planted feet
+		uint32_t strides; // Steps taken by any foot: lift-off to touchdown
+		double strideMm;  // Total horizontal distance of those steps
+		double travelDeg; // Angle turned by all the servos together
+	} Motion;
+
+private:
+	typedef struct
+	{
+		uint32_t from;   // Duty cycle when the ramp started
+		uint32_t to;     // Duty cycle written
+		uint32_t delay;  // PWM_DELAY
+		uint64_t start;  // When the ramp started
+	} Servo;
+
+	uint64_t m_now;
+	uint64_t m_nextSample;
+	Servo m_servo[MOTOR_NUM];
+	BodyKinematics m_body;
+	// Foot positions in the body frame at the last sample, and which bore weight
+	BodyKinematics::Feet m_feet;
+	bool m_contact[BODY_LEG_NUM];
+	bool m_haveFeet;
+	// World position of each foot when it last lifted off
+	double m_liftX[BODY_LEG_NUM], m_liftY[BODY_LEG_NUM];
+	bool m_lifted[BODY_LEG_NUM];
+	Motion m_motion;
+
+	uint32_t dcAt(const Servo &s, uint64_t t)
+	{
+		uint64_t ticks = (t - s.start) / ((uint64_t)(s.delay ? s.delay : 1) * (1000000000ull / FREQ));
+		if (s.to > s.from)
+			return (ticks >= s.to - s.from) ? s.to : s.from + (uint32_t)ticks;
+		return (ticks >= s.from - s.to) ? s.to : s.from - (uint32_t)ticks;
+	}
+
+	// Angle a servo has turned since its ramp started
+	double rampDeg(const Servo &s)
+	{
+		uint32_t dc = dcAt(s, m_now);
+		return (dc > s.from ? dc - s.from : s.from - dc) * (double)(DEGREE_MAX - DEGREE_MIN) / (PWM_MAX - PWM_MIN);
+	}
+
+	// Starts a new ramp from wherever the servo is now
+	void rebase(Servo &s)
+	{
+		if (s.from != 0)
+			m_motion.travelDeg += rampDeg(s);
+		s.from = dcAt(s, m_now);
+		s.start = m_now;
+	}
+
+	// Converts foot positions from the body frame into the world frame
+	void toWorld(float x, float y, double &wx, double &wy)
+	{
+		double a = m_motion.yaw / IK_RAD_TO_DEG;
+		wx = m_motion.x + x * cos(a) - y * sin(a);
+		wy = m_motion.y + x * sin(a) + y * cos(a);
+	}
+
+	void sample()
+	{
+		LegIK::Joints joints[BODY_LEG_NUM];
+		for (int leg = 0; leg < BODY_LEG_NUM; leg++) {
+			float angle[SpiderLeg::JOINT_NUM];
+			for (int j = 0; j < SpiderLeg::JOINT_NUM; j++) {
+				uint32_t dc = dcAt(m_servo[leg * 3 + j], m_now);
+				// A servo with no pulse is limp; there is no pose to sample
+				if (dc == 0) {
+					m_haveFeet = false;
+					return;
+				}
+				angle[j] = ServoMotor::DCToAngle(dc) * (leg < BODY_LEG_NUM / 2 ? -1 : 1);
+			}
+			joints[leg].hip = angle[SpiderLeg::Hip];
+			joints[leg].knee = angle[SpiderLeg::Knee];
+			joints[leg].ankle = angle[SpiderLeg::Ankle];
+		}
+		BodyKinematics::Feet feet;
+		m_body.LegsToFeet(joints, feet);
+		float lowest = feet.z[0];
+		for (int i = 1; i < BODY_LEG_NUM; i++)
+			lowest = fminf(lowest, feet.z[i]);
+		bool contact[BODY_LEG_NUM];
+		for (int i = 0; i < BODY_LEG_NUM; i++)
+			contact[i] = feet.z[i] <= lowest + SIM_CONTACT_MM;
+		if (m_haveFeet)
+			moveBody(feet, contact);
+
+		for (int i = 0; i < BODY_LEG_NUM; i++) {
+			double wx, wy;
+			toWorld(feet.x[i], feet.y[i], wx, wy);
+			if (m_haveFeet && m_contact[i] && !contact[i]) {
+				m_liftX[i] = wx;
+				m_liftY[i] = wy;
+				m_lifted[i] = true;
+			} else if (m_haveFeet && !m_contact[i] && contact[i] && m_lifted[i]) {
+				m_motion.strides++;
+				m_motion.strideMm += hypot(wx - m_liftX[i], wy - m_liftY[i]);
+				m_lifted[i] = false;
+			}
+			m_contact[i] = contact[i];
+		}
+		m_feet = feet;
+		m_haveFeet = true;
+	}
+
+	/**
+	 * Moves the body by the rigid planar motion that best keeps the feet
+	 * planted in both samples still (least squares), and adds what they
+	 * still move to the slip.
+	 */
+	void moveBody(const BodyKinematics::Feet &feet, const bool contact[BODY_LEG_NUM])
+	{
+		int n = 0;
+		double px = 0, py = 0, cx = 0, cy = 0;
+		for (int i = 0; i < BODY_LEG_NUM; i++) {
+			if (m_contact[i] && contact[i]) {
+				px += m_feet.x[i];
+				py += m_feet.y[i];
+				cx += feet.x[i];
+				cy += feet.y[i];
+				n++;
+			}
+		}
+		if (n == 0)
+			return;
+		px /= n; py /= n; cx /= n; cy /= n;
+		// Rotation taking the planted feet from their previous to their current body-frame positions
+		double dot = 0, cross = 0;
+		for (int i = 0; i < BODY_LEG_NUM; i++) {
+			if (m_contact[i] && contact[i]) {
+				double ax = m_feet.x[i] - px, ay = m_feet.y[i] - py;
+				double bx = feet.x[i] - cx, by = feet.y[i] - cy;
+				dot += ax * bx + ay * by;
+				cross += ax * by - ay * bx;
+			}
+		}
+		double phi = (n > 1) ? atan2(cross, dot) : 0;
+		double c = cos(phi), s = sin(phi);
+		for (int i = 0; i < BODY_LEG_NUM; i++) {
+			if (m_contact[i] && contact[i]) {
+				double ax = m_feet.x[i] - px, ay = m_feet.y[i] - py;
+				m_motion.slipMm += hypot(cx + c * ax - s * ay - feet.x[i], cy + s * ax + c * ay - feet.y[i]);
+			}
+		}
+		// The feet moved by (R, t) in the body frame, so the body moved by its inverse
+		double tx = cx - (c * px - s * py), ty = cy - (s * px + c * py);
+		double dx = -(c * tx + s * ty), dy = -(-s * tx + c * ty);
+		double a = m_motion.yaw / IK_RAD_TO_DEG;
+		m_motion.x += dx * cos(a) - dy * sin(a);
+		m_motion.y += dx * sin(a) + dy * cos(a);
+		m_motion.yaw -= phi * IK_RAD_TO_DEG;
+		m_motion.distance += hypot(dx, dy);
+	}
+
+	// Advances virtual time, sampling the kinematics on the way
+	void advanceTo(uint64_t t)
+	{
+		while (m_nextSample <= t) {
+			m_now = m_nextSample;
+			sample();
+			m_nextSample += SIM_SAMPLE_NS;
+		}
+		if (t > m_now)
+			m_now = t;
+	}
+
+public:
+	ServoSim()
+	{
+		m_now = SIM_START_NS;
+		m_nextSample = SIM_START_NS;
+		memset(m_servo, 0, sizeof(m_servo));
+		m_haveFeet = false;
+		ResetMotion();
+	}
+
+	/**
+	 * Starts modelling the servos of mmio, from the duty cycles and delays
+	 * its registers hold. The backend must be simulated, so registers read
+	 * back what was written.
+	 */
+	void Attach(MMap *mmio)
+	{
+		mmio->SetModel(NULL);
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			m_servo[id].from = m_servo[id].to = mmio->Motor_Reg32_Read(id, PWM_DC);
+			m_servo[id].delay = mmio->Motor_Reg32_Read(id, PWM_DELAY);
+			m_servo[id].start = m_now;
+		}
+		mmio->SetModel(this);
+	}
+
+	void OnWrite(uint32_t motorId, uint32_t regOffset, uint32_t value)
+	{
+		advanceTo(m_now + SIM_ACCESS_NS);
+		Servo &s = m_servo[motorId];
+		if (regOffset == PWM_DC) {
+			rebase(s);
+			// A servo that had no pulse jumps straight to its first position
+			if (s.to == 0 || value == 0)
+				s.from = value;
+			s.to = value;
+		} else if (regOffset == PWM_DELAY) {
+			rebase(s);
+			s.delay = value;
+		}
+	}
+
+	uint32_t OnRead(uint32_t motorId, uint32_t regOffset, uint32_t value)
+	{
+		advanceTo(m_now + SIM_ACCESS_NS);
+		if (regOffset == PWM_READY)
+			return dcAt(m_servo[motorId], m_now) == m_servo[motorId].to;
+		return value;
+	}
+
+	uint64_t NowNs() { return m_now; }
+	void SleepUntilNs(uint64_t t) { advanceTo(t); }
+
+	Motion GetMotion()
+	{
+		Motion m = m_motion;
+		// Include the ramps still under way
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			if (m_servo[id].from != 0)
+				m.travelDeg += rampDeg(m_servo[id]);
+		return m;
+	}
+
+	// Puts the body back at the origin, facing along x, and zeroes the totals
+	void ResetMotion()
+	{
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			rebase(m_servo[id]);
+		memset(&m_motion, 0, sizeof(m_motion));
+		for (int i = 0; i < BODY_LEG_NUM; i++)
+			m_lifted[i] = false;
+	}
+};
+
+#endif /* SERVOSIM_CPP_ */
@@ -1,4 +1,15 @@
-#include "SpiderLeg.cpp"
+#ifndef SPIDER_CPP_
+#define SPIDER_CPP_
+#include "GaitEngine.cpp"
+#include "Calibration.cpp"
+#include "Workspace.cpp"
+#include "BodyPose.cpp"
+#include "ReadyWaiter.cpp"
+#include "RealTime.cpp"
+#include "IdleManager.cpp"
+#include <atomic>
+#include <functional>
+#include <memory>
 
 #define Knee_Up_Base 60
 #define Knee_Down_Base 45
@@ -6,6 +17,63 @@
 #define HipM_Base 0
 #define HipB_Base 20
 #define Ankle_Base 45
+// Hip swing of a walking or turning step
+#define Swing_Base 20
+// Percentage of the knee and hip travel overlapped by the next phase when pipelined
+#define KneeOverlap_Base 40
+#define HipOverlap_Base 20
+
+// Environment variable enabling the pipelined gaits: SPIDER_PIPELINE=1
+#define PIPELINE_ENV "SPIDER_PIPELINE"
+// Environment variable selecting the default velocity profile: step | trapezoid | scurve
+#define PROFILE_ENV "SPIDER_PROFILE"
+
+// How fast the PWM ramp moves while a body pose or walk is streamed, in degrees/s: 36 degrees per
+// 20 ms frame, so a frame's setpoint is always reached within the frame and the servos
+// themselves (SERVO_MAX_DPS) set the pace
+#define POSE_STREAM_RAMP_DPS 1800
+// PWM_DELAY giving that ramp rate: one duty cycle tick every delay clocks (50)
+#define POSE_STREAM_DELAY (FREQ / (POSE_STREAM_RAMP_DPS * (PWM_MAX - PWM_MIN) / (DEGREE_MAX - DEGREE_MIN)))
+static_assert(POSE_STREAM_RAMP_DPS >= SERVO_MAX_DPS, "the pose stream ramp must outpace the servos");
+
+// Continuous walking: duration of a tripod's swing (and of the other's stance) and the swing's foot lift
+#define WALK_HALF_CYCLE_MS 400
+#define WALK_LIFT_MM 25.0f
+// Largest walking velocity, and how fast the velocity follows a new command
+#define WALK_VMAX_MMPS 60.0f
+#define WALK_YAW_MAX_DPS 30.0f
+#define WALK_ACCEL_MMPS2 150.0f
+#define WALK_YAW_ACCEL_DPS2 75.0f
+// Tripod leg masks, in LEG_ID bits
+#define WALK_TRIPOD1_MASK 0x15 // RF RB LM
+#define WALK_TRIPOD2_MASK 0x2A // RM LF LB
+
+// Longest sleep while holding a step, so cancellation is noticed promptly
+#define MOTION_HOLD_SLICE_US 5000
+
+/**
+ * One phase of a movement: the joint moves to issue together, then
+ * optionally a wait for the servos to settle and a fixed hold time.
+ * When pipelined, the wait ends once the moves are predicted to have
+ * covered 100 - overlapPct percent of their travel; only the motors in
+ * motorMask, those the step moves, are considered.
+ *
+ * A streamed step also has a tick, called once per PWM frame after issue
+ * until it returns false, to write the next setpoints of a trajectory.
+ * tick(true) must end the trajectory early.
+ */
+typedef struct
+{
+	std::function<void()> issue;
+	bool waitReady;
+	uint32_t holdUs;
+	uint8_t overlapPct;
+	uint32_t motorMask; // bit per motor ID
+	std::function<bool(bool stop)> tick;
+} MotionStep;
+
+// A movement, as the ordered list of its phases
+typedef std::vector<MotionStep> MotionPlan;
 
 class Spider
 {
@@ -34,10 +102,67 @@ class Spider
 	} DIR;
 
 	SpiderLeg *m_szLeg[LEG_NUM];
+	// The legs' servos, indexed by motor ID
+	ServoMotor *m_motorById[MOTOR_NUM];
 
 	TRIPOD_ID lastStep;
 	DIR lastDir;
 	MMap *_mmio;
+	// Joint moves staged for the next CommitMoves(), written as one frame
+	ServoFrame m_frame;
+	// Releases the torque of idle joints and re-arms them for the next movement
+	IdleManager m_idle;
+	// Delay changes of SetStreamDelays, written as one batch
+	std::vector<MMap::RegWrite> m_batch;
+	// How WaitReady waits for the servos
+	ReadyWaiter m_waiter;
+	// The movements, compiled from their gait descriptions
+	GaitEngine m_gaits;
+	// Whether steps may overlap the following one by their overlapPct; set from any thread
+	std::atomic<bool> m_pipelined;
+	// Movements run to completion, and the time spent running them
+	uint64_t m_steps;
+	uint64_t m_stepNs;
+	// Velocity profile of phases that do not name one
+	std::atomic<Trajectory::PROFILE> m_profile;
+	// The trajectory being streamed, its servos' target angles and the last setpoints
+	Trajectory m_traj;
+	float m_streamAngle[MOTOR_NUM];
+	uint32_t m_streamDC[MOTOR_NUM];
+	uint32_t m_streamFrame;
+	// The servo calibration and the file it was last loaded from
+	Calibration m_calibration;
+	std::string m_calPath;
+	// Reachable foot positions of a leg, if $SPIDER_WORKSPACE names a grid file
+	LegWorkspace m_workspace;
+	// The body pose, the pose being streamed to and the foot positions relative to the neutral body
+	BodyKinematics m_body;
+	BodyKinematics::Pose m_pose;
+	BodyKinematics::Pose m_poseFrom;
+	BodyKinematics::Pose m_poseTo;
+	BodyKinematics::Feet m_feet;
+	uint32_t m_poseFrame;
+	uint32_t m_poseFrames;
+	// Commanded walking velocity (mm/s forwards, mm/s left, degrees/s anticlockwise), set from any thread
+	std::atomic<float> m_cmdVx;
+	std::atomic<float> m_cmdVy;
+	std::atomic<float> m_cmdYaw;
+	// Set while a walk is planned or running
+	std::atomic<bool> m_walkActive;
+	// The walking velocity reached so far, the stance and lift-off foot positions and the swinging legs
+	float m_walkVx, m_walkVy, m_walkYaw;
+	BodyKinematics::Feet m_walkNeutral;
+	BodyKinematics::Feet m_walkLift;
+	uint32_t m_walkSwing;
+	uint32_t m_walkFrame;
+	uint32_t m_walkFrames;
+	// Distance and rotation walked since the last ResetOdometry(); may be read from any thread
+	std::atomic<float> m_odoX, m_odoY, m_odoYaw;
+	// Real-time settings of the control thread, and the timing of the streaming loop
+	RealTime m_rt;
+	LoopStats m_loopStats;
+	// Start of the frame grid that streamed steps are aligned to in real-time mode
+	uint64_t m_frameEpoch;
 
 public:
 	Spider()
@@ -55,9 +180,55 @@ public:
 		{
 			// Reverse the angles on all of the RHS motors
 			m_szLeg[i] = new SpiderLeg(_mmio, szMotorID[i * 3], szMotorID[i * 3 + 1], szMotorID[i * 3 + 2], i == LEG_RF || i == LEG_RB || i == LEG_RM);
+			for (int j = 0; j < SpiderLeg::JOINT_NUM; j++)
+				m_motorById[szMotorID[i * 3 + j]] = m_szLeg[i]->GetMotor((SpiderLeg::JOINT_ID)j);
 		}
+		memset(&m_pose, 0, sizeof(m_pose));
+		m_poseFrame = m_poseFrames = 0;
+		m_cmdVx = m_cmdVy = m_cmdYaw = 0;
+		m_walkActive = false;
+		m_walkFrame = m_walkFrames = 0;
+		ResetOdometry();
 		lastStep = TRIPOD2;
 		lastDir = FWD;
+		m_batch.reserve(MOTOR_NUM);
+		m_waiter.ConfigureFromEnv();
+		m_rt.ConfigureFromEnv();
+		m_frameEpoch = MonotonicNs();
+		// The servos' PERIOD registers have just been written; frames are timed from then
+		m_frame.ConfigureFromEnv();
+		m_frame.SetEpoch(m_frameEpoch);
+		m_idle.ConfigureFromEnv();
+		const char *pipeline = getenv(PIPELINE_ENV);
+		m_pipelined = pipeline != NULL && strcmp(pipeline, "0") != 0;
+		Trajectory::PROFILE profile = Trajectory::PROFILE_STEP;
+		const char *profileName = getenv(PROFILE_ENV);
+		if (profileName != NULL && !Trajectory::ParseProfile(profileName, profile))
+			fprintf(stderr, "ERROR: unknown %s \"%s\"...\n", PROFILE_ENV, profileName);
+		m_profile = profile;
+		m_streamFrame = 0;
+		ResetStepRate();
+
+		m_gaits.SetParam("Knee_Up", Knee_Up_Base);
+		m_gaits.SetParam("Knee_Down", Knee_Down_Base);
+		m_gaits.SetParam("HipF", HipF_Base);
+		m_gaits.SetParam("HipM", HipM_Base);
+		m_gaits.SetParam("HipB", HipB_Base);
+		m_gaits.SetParam("Ankle", Ankle_Base);
+		m_gaits.SetParam("Swing", Swing_Base);
+		m_gaits.SetParam("KneeOverlap", KneeOverlap_Base);
+		m_gaits.SetParam("HipOverlap", HipOverlap_Base);
+		m_gaits.LoadText(gait_builtin, "built-in gaits");
+		const char *path = getenv(GAIT_FILE_ENV);
+		if (path != NULL)
+			m_gaits.LoadFile(path);
+		path = getenv(WORKSPACE_FILE_ENV);
+		if (path != NULL && !m_workspace.LoadOrBuild(path))
+			fprintf(stderr, "ERROR: no workspace grid, checking joint limits on the IK solutions instead...\n");
+		// Without a usable calibration the gaits run on the uncalibrated tables
+		path = getenv(CALIBRATION_FILE_ENV);
+		if (path == NULL || !LoadCalibration(path))
+			m_gaits.Compile(m_szLeg);
 	}
 
 	~Spider()
@@ -66,27 +237,614 @@ public:
 			delete m_szLeg[i];
 	}
 
-	void Init()
+	// Exposes the register interface, e.g. to read its MMIO access counters
+	MMap *GetMMIO() { return _mmio; }
+	// Exposes the ready waiter, to pick a strategy or read its statistics
+	ReadyWaiter *GetWaiter() { return &m_waiter; }
+	// Exposes the frame commit, to pick its timing or read the spread of the commits
+	ServoFrame *GetFrame() { return &m_frame; }
+	// Exposes the idle power-down, to set its timeout or read its statistics
+	IdleManager *GetIdle() { return &m_idle; }
+	// Exposes the gait engine, e.g. to list the gaits or read parameters
+	GaitEngine *GetGaits() { return &m_gaits; }
+
+	/**
+	 * Loads a gait file on top of the current gaits and recompiles them.
+	 * Must not be called while a movement is being planned.
+	 * @return false if the file could not be loaded or compiled
+	 */
+	bool LoadGaits(const char *path)
 	{
-		//// Init -- The servo angle needs to be explicitly set to 0.0 to enable.
-		for (int i = 0; i < LEG_NUM; i++)
+		bool bSuccess = m_gaits.LoadFile(path);
+		return m_gaits.Compile(m_szLeg) && bSuccess;
+	}
+
+	/**
+	 * Sets gait parameters, as "param" lines in a gait file do, and
+	 * recompiles the gaits. Must not be called while a movement is being planned.
+	 * @return false if the gaits could not be compiled
+	 */
+	bool SetGaitParams(const std::map<std::string, float> &params)
+	{
+		for (std::map<std::string, float>::const_iterator it = params.begin(); it != params.end(); ++it)
+			m_gaits.SetParam(it->first, it->second);
+		return m_gaits.Compile(m_szLeg);
+	}
+
+	/**
+	 * Loads a servo calibration file, rebuilds the servos' duty cycle tables
+	 * and recompiles the gaits. Must run on the thread that moves the spider,
+	 * e.g. as a MotionScheduler job, so the control loop keeps running.
+	 * @return false, keeping the current calibration, if the file is unusable
+	 */
+	bool LoadCalibration(const char *path)
+	{
+		if (!m_calibration.LoadFile(path))
+			return false;
+		m_calPath = path;
+		m_calibration.Apply(m_motorById);
+		return m_gaits.Compile(m_szLeg);
+	}
+
+	// Loads the last calibration file that loaded again, e.g. after a servo was swapped
+	bool ReloadCalibration()
+	{
+		if (m_calPath.empty()) {
+			fprintf(stderr, "ERROR: no calibration file loaded...\n");
+			return false;
+		}
+		return LoadCalibration(m_calPath.c_str());
+	}
+
+	Calibration *GetCalibration() { return &m_calibration; }
+	// The legs' workspace grid; IsLoaded() is false unless $SPIDER_WORKSPACE was set
+	LegWorkspace *GetWorkspace() { return &m_workspace; }
+
+	// Computes where a leg's foot is, in the leg's frame, from its joints' current angles
+	void GetFootPosition(int leg, float &x, float &y, float &z)
+	{
+		m_szLeg[leg]->GetFootPosition(x, y, z);
+	}
+
+	/**
+	 * Appends the phases of a named gait to plan. Each phase is issued as
+	 * one frame of its precompiled duty cycles.
+	 * @return false if there is no gait of that name
+	 */
+	bool PlanGait(const std::string &name, MotionPlan &plan)
+	{
+		const GaitEngine::Gait *found = m_gaits.Find(name);
+		if (found == NULL) {
+			fprintf(stderr, "ERROR: unknown gait \"%s\"...\n", name.c_str());
+			return false;
+		}
+		// Plans may outlive a reload of the gaits, so they keep their own copy
+		std::shared_ptr<const GaitEngine::Gait> gait(new GaitEngine::Gait(*found));
+		for (size_t p = 0; p < gait->phases.size(); p++) {
+			const GaitEngine::Phase &phase = gait->phases[p];
+			uint32_t begin = phase.begin, end = phase.end;
+			Trajectory::PROFILE profile = (phase.profile == Trajectory::PROFILE_DEFAULT) ? m_profile.load() : phase.profile;
+			if (profile != Trajectory::PROFILE_STEP && begin != end) {
+				uint32_t minFrames = phase.minFrames;
+				AddStep(plan, [this, gait, begin, end, profile, minFrames]() {
+					StartStream(*gait, begin, end, profile, minFrames);
+				}, phase.waitReady, phase.holdUs);
+				plan.back().tick = [this](bool stop) { return StreamFrame(stop); };
+				continue;
+			}
+			uint32_t mask = 0;
+			for (uint32_t i = begin; i < end; i++)
+				mask |= 1u << gait->writes[i].motorId;
+			AddStep(plan, [this, gait, begin, end]() {
+				for (uint32_t i = begin; i < end; i++)
+					m_frame.Set(gait->motors[i], gait->writes[i].value, gait->angles[i]);
+				CommitMoves();
+			}, phase.waitReady, phase.holdUs, phase.overlapPct, mask);
+		}
+		return true;
+	}
+
+	/**
+	 * Identifies the movements that can be planned with Plan().
+	 */
+	typedef enum
+	{
+		MOTION_INIT,
+		MOTION_STANDUP,
+		MOTION_RESET,
+		MOTION_FORWARD,
+		MOTION_BACKWARD,
+		MOTION_TURN_LEFT,
+		MOTION_TURN_RIGHT,
+		MOTION_NUM
+	} MOTION_ID;
+
+	/**
+	 * Appends the steps of a movement to plan. The gait state (which tripod
+	 * stepped last) only advances when a plan runs to its end, so a forward
+	 * or backward step must have run before the next one is planned: only
+	 * one tripod plan may be outstanding at a time.
+	 */
+	void Plan(MOTION_ID motion, MotionPlan &plan)
+	{
+		switch (motion)
 		{
-			m_szLeg[i]->MoveJoint(SpiderLeg::Hip, 0.0);
-			// WaitReady();
-			m_szLeg[i]->MoveJoint(SpiderLeg::Knee, 0.0);
-			// WaitReady();
-			m_szLeg[i]->MoveJoint(SpiderLeg::Ankle, 0.0);
-			// WaitReady();
+		case MOTION_INIT: PlanInit(plan); break;
+		case MOTION_STANDUP: PlanStandup(plan); break;
+		case MOTION_RESET: PlanReset(plan); break;
+		case MOTION_FORWARD: PlanMoveForward(plan); break;
+		case MOTION_BACKWARD: PlanMoveBackward(plan); break;
+		case MOTION_TURN_LEFT: PlanTurnLeft(plan); break;
+		case MOTION_TURN_RIGHT: PlanTurnRight(plan); break;
+		default: break;
 		}
-		WaitReady();
 	}
 
-	bool WaitReady()
+	/**
+	 * Pipelined steps start the next phase before the servos of the current
+	 * one have settled, as set by each phase's overlap. Off by default, or
+	 * as set by $SPIDER_PIPELINE.
+	 */
+	void SetPipelined(bool pipelined) { m_pipelined = pipelined; }
+	bool IsPipelined() { return m_pipelined; }
+
+	/**
+	 * Sets the velocity profile of gait phases that do not name one.
+	 * PROFILE_STEP (the default, or as set by $SPIDER_PROFILE) leaves the
+	 * moves to the PWM_DELAY ramp; the others stream a trajectory.
+	 * Applies to movements planned afterwards.
+	 */
+	void SetProfile(Trajectory::PROFILE profile) { m_profile = profile; }
+	Trajectory::PROFILE GetProfile() { return m_profile; }
+	Trajectory *GetTrajectory() { return &m_traj; }
+
+	/**
+	 * Starts streaming the moves [begin, end) of a gait along a trajectory
+	 * and writes its first frame. While streaming, each servo's PWM_DELAY is
+	 * lowered so its ramp keeps up with the setpoints.
+	 */
+	void StartStream(const GaitEngine::Gait &gait, uint32_t begin, uint32_t end,
+					 Trajectory::PROFILE profile, uint32_t minFrames)
 	{
-		bool bReady = false;
-		while (!bReady)
-			bReady = IsReady();
-		return bReady;
+		uint32_t from[MOTOR_NUM] = {0}, to[MOTOR_NUM] = {0}, mask = 0;
+		for (uint32_t i = begin; i < end; i++) {
+			uint32_t id = gait.writes[i].motorId;
+			from[id] = gait.motors[i]->GetDC();
+			to[id] = gait.writes[i].value;
+			mask |= 1u << id;
+			m_streamAngle[id] = gait.angles[i];
+		}
+		m_traj.Plan(profile, from, to, mask, minFrames);
+
+		// One duty cycle tick every delay clocks covers the largest step within a frame
+		SetStreamDelays(mask, T_20MS / (m_traj.MaxFrameStep() + 1));
+		m_streamFrame = 0;
+		StreamFrame(false);
+	}
+
+	/**
+	 * Writes the next frame of the trajectory being streamed. One frame
+	 * after the last setpoint, or when stop is set, ends the stream:
+	 * restores the servos' delays and records where they were left.
+	 * @return false once the stream has ended
+	 */
+	bool StreamFrame(bool stop)
+	{
+		uint32_t frames = m_traj.GetFrames(), mask = m_traj.GetMask();
+		if (!stop && m_streamFrame < frames) {
+			m_streamFrame++;
+			m_traj.Sample(m_streamFrame, m_streamDC);
+			m_frame.SetDC(m_streamDC, mask);
+			CommitMoves();
+			return true;
+		}
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			if (mask & (1u << id))
+				m_motorById[id]->Track(m_streamDC[id], m_streamFrame == frames ? m_streamAngle[id] : ServoMotor::DCToAngle(m_streamDC[id]));
+		SetStreamDelays(mask, 0);
+		return false;
+	}
+
+	/**
+	 * Lowers the PWM_DELAY of the motors in mask to at most delay, so their
+	 * ramps keep up with streamed setpoints, or with delay 0 restores the
+	 * motors' own delays.
+	 */
+	void SetStreamDelays(uint32_t mask, uint32_t delay)
+	{
+		for (uint32_t id = 0; id < MOTOR_NUM; id++) {
+			if (mask & (1u << id)) {
+				uint32_t own = m_motorById[id]->GetDelay();
+				m_batch.push_back(MMap::BatchWrite<RegMap::PwmCore::Delay>(id, (delay != 0 && delay < own) ? delay : own));
+			}
+		}
+		_mmio->Motor_Reg32_WriteBatch(m_batch);
+		m_batch.clear();
+	}
+
+	const BodyKinematics::Pose &GetPose() { return m_pose; }
+
+	/**
+	 * Plans a change of body pose: the body moves to target over ms
+	 * milliseconds along an S-curve while the feet stay where they are.
+	 * Every PWM frame the six legs are solved from the interpolated pose's
+	 * transform and streamed. The pose is relative to standing in the
+	 * stance of the gait parameters, which the legs must be in when the
+	 * pose leaves neutral. If a pose on the way is out of reach, the body
+	 * stops at the last reachable one.
+	 */
+	void PlanPose(const BodyKinematics::Pose &target, uint32_t ms, MotionPlan &plan)
+	{
+		uint32_t frames = (uint32_t)((ms * 1000000ull + TRAJ_FRAME_NS - 1) / TRAJ_FRAME_NS);
+		AddStep(plan, [this, target, frames]() { StartPose(target, frames); }, false);
+		plan.back().tick = [this](bool stop) { return PoseFrame(stop); };
+	}
+
+	void SetPose(const BodyKinematics::Pose &target, uint32_t ms)
+	{
+		MotionPlan plan;
+		PlanPose(target, ms, plan);
+		RunPlan(plan);
+	}
+
+	// Computes where the feet are when standing in the stance of the gait parameters
+	void StanceFeet(BodyKinematics::Feet &feet)
+	{
+		LegIK::Joints stance[LEG_NUM];
+		const char *hip[LEG_NUM] = { "HipF", "HipM", "HipB", "HipF", "HipM", "HipB" };
+		for (int i = 0; i < LEG_NUM; i++) {
+			stance[i].hip = m_gaits.GetParam(hip[i]);
+			stance[i].knee = m_gaits.GetParam("Knee_Down");
+			stance[i].ankle = m_gaits.GetParam("Ankle");
+		}
+		m_body.LegsToFeet(stance, feet);
+	}
+
+	void StartPose(const BodyKinematics::Pose &target, uint32_t frames)
+	{
+		// The planted feet, from the standing stance
+		StanceFeet(m_feet);
+		m_poseFrom = m_pose;
+		m_poseTo = target;
+		m_poseFrames = (frames == 0) ? 1 : frames;
+		m_poseFrame = 0;
+		SetStreamDelays((1u << MOTOR_NUM) - 1, POSE_STREAM_DELAY);
+		PoseFrame(false);
+	}
+
+	/**
+	 * Streams the next frame of a pose change; allocation-free.
+	 * @return false once the change has ended
+	 */
+	bool PoseFrame(bool stop)
+	{
+		if (!stop && m_poseFrame < m_poseFrames) {
+			m_poseFrame++;
+			float t = (float)Trajectory::Profile(Trajectory::PROFILE_SCURVE, m_poseFrame / (double)m_poseFrames, 0.5);
+			BodyKinematics::Pose pose = BodyKinematics::Blend(m_poseFrom, m_poseTo, t);
+			if (WritePose(pose)) {
+				m_pose = pose;
+				return true;
+			}
+			fprintf(stderr, "ERROR: body pose out of reach, stopping...\n");
+		}
+		SetStreamDelays((1u << MOTOR_NUM) - 1, 0);
+		return false;
+	}
+
+	/**
+	 * Solves every leg for a body pose with the feet at m_feet and writes
+	 * all 18 duty cycles as one frame.
+	 * @return false, writing nothing, if a foot would be out of reach
+	 */
+	bool WritePose(const BodyKinematics::Pose &pose)
+	{
+		float m[4][4];
+		LegIK::FootBatch feet;
+		LegIK::JointBatch joints;
+		uint32_t dc[MOTOR_NUM];
+		BodyKinematics::PoseToMatrix(pose, m);
+		m_body.FeetToLegs(m, m_feet, feet);
+		LegIK::SolveBatch(feet, joints, LEG_NUM);
+		if (inServoRange(feet, joints) != (1u << LEG_NUM) - 1)
+			return false;
+		for (int i = 0; i < LEG_NUM; i++) {
+			dc[m_szLeg[i]->GetMotor(SpiderLeg::Hip)->GetMotorID()] = m_szLeg[i]->StreamJoint(SpiderLeg::Hip, joints.hip[i]);
+			dc[m_szLeg[i]->GetMotor(SpiderLeg::Knee)->GetMotorID()] = m_szLeg[i]->StreamJoint(SpiderLeg::Knee, joints.knee[i]);
+			dc[m_szLeg[i]->GetMotor(SpiderLeg::Ankle)->GetMotorID()] = m_szLeg[i]->StreamJoint(SpiderLeg::Ankle, joints.ankle[i]);
+		}
+		m_frame.SetDC(dc);
+		CommitMoves();
+		return true;
+	}
+
+	/**
+	 * Sets the walking velocity: vx mm/s forwards, vy mm/s to the left and
+	 * yaw degrees/s anticlockwise, clamped to the WALK_* limits. May be
+	 * called from any thread; a running walk picks the new velocity up
+	 * within a frame, mid-stride. A zero velocity ends the walk once the
+	 * feet are back in the stance.
+	 * @return true if no walk is active, so the caller must plan one with
+	 * PlanWalk() (e.g. as a MotionScheduler job) for the command to act
+	 */
+	bool SetVelocity(float vx, float vy, float yaw)
+	{
+		m_cmdVx = fmaxf(-WALK_VMAX_MMPS, fminf(vx, WALK_VMAX_MMPS));
+		m_cmdVy = fmaxf(-WALK_VMAX_MMPS, fminf(vy, WALK_VMAX_MMPS));
+		m_cmdYaw = fmaxf(-WALK_YAW_MAX_DPS, fminf(yaw, WALK_YAW_MAX_DPS));
+		return !m_walkActive.exchange(true);
+	}
+
+	// Zeroes the commanded velocity and marks no walk active, e.g. when a planned walk was cancelled
+	void StopWalk()
+	{
+		m_cmdVx = m_cmdVy = m_cmdYaw = 0;
+		m_walkActive = false;
+	}
+
+	bool IsWalking() { return m_walkActive; }
+
+	/**
+	 * Plans a walk at the velocity set by SetVelocity(). The walk is an
+	 * alternating tripod gait generated in foot space every PWM frame:
+	 * the standing tripod's feet move against the body's translation and
+	 * rotation, and the swinging tripod's feet travel to where they land
+	 * half a stride ahead, so translation and rotation blend into each
+	 * stride and a new velocity takes effect without stopping. Like body
+	 * poses, it starts from the standing stance and keeps the current pose.
+	 */
+	void PlanWalk(MotionPlan &plan)
+	{
+		AddStep(plan, [this]() { StartWalk(); }, false);
+		plan.back().tick = [this](bool stop) { return WalkFrame(stop); };
+	}
+
+	void StartWalk()
+	{
+		m_walkActive = true;
+		StanceFeet(m_walkNeutral);
+		m_feet = m_walkNeutral;
+		m_walkVx = m_walkVy = m_walkYaw = 0;
+		// The first half cycle swings the tripod that did not step last
+		m_walkSwing = (lastStep == TRIPOD1) ? WALK_TRIPOD1_MASK : WALK_TRIPOD2_MASK;
+		m_walkFrames = (uint32_t)((WALK_HALF_CYCLE_MS * 1000000ull + TRAJ_FRAME_NS - 1) / TRAJ_FRAME_NS);
+		m_walkFrame = m_walkFrames;
+		SetStreamDelays((1u << MOTOR_NUM) - 1, POSE_STREAM_DELAY);
+	}
+
+	/**
+	 * Streams the next frame of a walk; allocation-free.
+	 * @return false once the walk has ended
+	 */
+	bool WalkFrame(bool stop)
+	{
+		if (stop)
+			return endWalk();
+		if (m_walkFrame >= m_walkFrames) {
+			// Half cycle boundary: stop if asked to and standing, else swap the tripods
+			if (walkCommandZero() && m_walkVx == 0 && m_walkVy == 0 && m_walkYaw == 0 && feetAtNeutral()) {
+				m_walkActive = false;
+				// A command that arrived just now finds no walk active; keep walking for it
+				if (walkCommandZero() || m_walkActive.exchange(true))
+					return endWalk();
+			}
+			m_walkSwing ^= WALK_TRIPOD1_MASK | WALK_TRIPOD2_MASK;
+			lastStep = (m_walkSwing == WALK_TRIPOD1_MASK) ? TRIPOD1 : TRIPOD2;
+			lastDir = FWD;
+			m_walkLift = m_feet;
+			m_walkFrame = 0;
+		}
+		m_walkFrame++;
+
+		// Follow the command within the acceleration limits
+		const float dt = TRAJ_FRAME_NS * 1e-9f;
+		m_walkVx = approach(m_walkVx, m_cmdVx, WALK_ACCEL_MMPS2 * dt);
+		m_walkVy = approach(m_walkVy, m_cmdVy, WALK_ACCEL_MMPS2 * dt);
+		m_walkYaw = approach(m_walkYaw, m_cmdYaw, WALK_YAW_ACCEL_DPS2 * dt);
+		float heading = (m_odoYaw + m_walkYaw * dt) / IK_RAD_TO_DEG;
+		m_odoYaw = heading * IK_RAD_TO_DEG;
+		m_odoX = m_odoX + (m_walkVx * cosf(heading) - m_walkVy * sinf(heading)) * dt;
+		m_odoY = m_odoY + (m_walkVx * sinf(heading) + m_walkVy * cosf(heading)) * dt;
+
+		// Standing feet: the body moves by v dt and turns by yaw dt over the ground
+		float c = cosf(-m_walkYaw * dt / IK_RAD_TO_DEG), s = sinf(-m_walkYaw * dt / IK_RAD_TO_DEG);
+		// Swinging feet land half a stance ahead of their neutral position, along the profile
+		float half = m_walkFrames * dt / 2;
+		float ct = cosf(m_walkYaw * half / IK_RAD_TO_DEG), st = sinf(m_walkYaw * half / IK_RAD_TO_DEG);
+		float tau = m_walkFrame / (float)m_walkFrames;
+		float u = (float)Trajectory::Profile(Trajectory::PROFILE_SCURVE, tau, 0.5);
+		float lift = WALK_LIFT_MM * sinf(IK_PI * tau);
+		for (int i = 0; i < LEG_NUM; i++) {
+			float nx = m_walkNeutral.x[i], ny = m_walkNeutral.y[i];
+			if (m_walkSwing & (1u << i)) {
+				float tx = ct * nx - st * ny + m_walkVx * half;
+				float ty = st * nx + ct * ny + m_walkVy * half;
+				m_feet.x[i] = m_walkLift.x[i] + u * (tx - m_walkLift.x[i]);
+				m_feet.y[i] = m_walkLift.y[i] + u * (ty - m_walkLift.y[i]);
+				m_feet.z[i] = m_walkNeutral.z[i] + lift;
+			} else {
+				float x = m_feet.x[i] - m_walkVx * dt, y = m_feet.y[i] - m_walkVy * dt;
+				m_feet.x[i] = c * x - s * y;
+				m_feet.y[i] = s * x + c * y;
+				m_feet.z[i] = m_walkNeutral.z[i];
+			}
+		}
+		if (!WritePose(m_pose)) {
+			fprintf(stderr, "ERROR: walking step out of reach, stopping...\n");
+			return endWalk();
+		}
+		return true;
+	}
+
+	// Distance walked (mm) and rotation (degrees) since the last reset, from the commanded velocity
+	void GetOdometry(float &x, float &y, float &yaw) { x = m_odoX; y = m_odoY; yaw = m_odoYaw; }
+	void ResetOdometry() { m_odoX = m_odoY = m_odoYaw = 0; }
+
+	/**
+	 * Real-time mode of the control loop, off by default or as set by
+	 * $SPIDER_RT. Configure it before the control thread starts; that
+	 * thread calls EnterRealTime() first.
+	 */
+	RealTime *GetRealTime() { return &m_rt; }
+	bool EnterRealTime() { return m_rt.Enter(); }
+	// Timing of the frames streamed so far; may be read from any thread
+	LoopStats *GetLoopStats() { return &m_loopStats; }
+
+	/**
+	 * Runs one step: issues its moves, waits for the servos if the step asks
+	 * for it, then holds for the step's hold time.
+	 * @param cancel - if not NULL, checked while waiting and holding
+	 * @return false if the step was cut short by cancel
+	 */
+	bool RunStep(const MotionStep &step, const std::atomic<bool> *cancel = NULL)
+	{
+		uint64_t issuedNs = MonotonicNs();
+		if (step.tick && m_rt.IsEnabled()) {
+			// Keep every stream on one frame grid, so frames stay a period apart across steps
+			issuedNs = m_frameEpoch + (issuedNs - m_frameEpoch + TRAJ_FRAME_NS - 1) / TRAJ_FRAME_NS * TRAJ_FRAME_NS;
+			SleepUntilNs(issuedNs);
+		}
+		step.issue();
+		if (step.tick) {
+			// Stream the trajectory at the PWM frame rate, on an absolute schedule
+			uint64_t next = issuedNs;
+			bool more;
+			do {
+				next += TRAJ_FRAME_NS;
+				SleepUntilNs(next);
+				uint64_t woke = MonotonicNs();
+				if (cancel != NULL && cancel->load()) {
+					step.tick(true);
+					return false;
+				}
+				more = step.tick(false);
+				uint64_t done = MonotonicNs();
+				m_loopStats.Record(woke > next ? woke - next : 0, done - woke);
+				if (done >= next + TRAJ_FRAME_NS) {
+					// Ran past the next frame's deadline: skip the frames missed instead of bursting them
+					m_loopStats.Overrun();
+					next += (done - next) / TRAJ_FRAME_NS * TRAJ_FRAME_NS;
+				}
+			} while (more);
+		}
+		if (step.waitReady && m_pipelined && step.overlapPct > 0 && !step.tick) {
+			if (!WaitTravel(issuedNs, 100 - step.overlapPct, step.motorMask, cancel))
+				return false;
+		} else if (step.waitReady && !WaitReady(cancel)) {
+			return false;
+		}
+		for (uint64_t t = 0; t < step.holdUs; t += MOTION_HOLD_SLICE_US)
+		{
+			if (cancel != NULL && cancel->load())
+				return false;
+			uint64_t us = step.holdUs - t < MOTION_HOLD_SLICE_US ? step.holdUs - t : MOTION_HOLD_SLICE_US;
+			SleepNs(us * 1000);
+		}
+		return cancel == NULL || !cancel->load();
+	}
+
+	/**
+	 * Runs every step of a plan in order, on the calling thread, after
+	 * re-arming any servos released while idle.
+	 */
+	bool RunPlan(const MotionPlan &plan, const std::atomic<bool> *cancel = NULL)
+	{
+		uint64_t start = MonotonicNs();
+		m_idle.Wake(m_frame, _mmio);
+		for (size_t i = 0; i < plan.size(); i++)
+			if (!RunStep(plan[i], cancel))
+				return false;
+		if (!plan.empty()) {
+			m_steps++;
+			m_stepNs += MonotonicNs() - start;
+		}
+		return true;
+	}
+
+	/**
+	 * Releases the torque of the joints idle for the idle timeout (see
+	 * IdleManager). Call it between movements, on the thread running them.
+	 * @return when it should be called again (MonotonicNs() time base), or
+	 * 0 if there is nothing left to release
+	 */
+	uint64_t Idle()
+	{
+		return m_idle.Poll(m_frame, _mmio, m_szLeg, LEG_NUM);
+	}
+
+	/**
+	 * The step rate: movements run to completion per second of running
+	 * them, so idle time between commands does not count.
+	 */
+	double GetStepRate() { return m_stepNs == 0 ? 0 : m_steps * 1e9 / m_stepNs; }
+	uint64_t GetStepCount() { return m_steps; }
+	void ResetStepRate() { m_steps = 0; m_stepNs = 0; }
+
+	void Init()
+	{
+		MotionPlan plan;
+		PlanInit(plan);
+		RunPlan(plan);
+	}
+
+	void PlanInit(MotionPlan &plan)
+	{
+		//// Init -- The servo angle needs to be explicitly set to 0.0 to enable.
+		PlanGait("init", plan);
+	}
+
+	bool WaitReady(const std::atomic<bool> *cancel = NULL)
+	{
+		if (cancel == NULL)
+			return m_waiter.Wait([this]() { return IsReady(); }, PredictedReadyNs());
+		m_waiter.Wait([this, cancel]() { return IsReady() || cancel->load(); }, PredictedReadyNs());
+		return !cancel->load();
+	}
+
+	/**
+	 * Waits until the motors in mask are ready, or until their moves issued
+	 * at issuedNs are predicted to have covered percent of their travel,
+	 * whichever is first. Other motors, e.g. still finishing an earlier
+	 * move, do not hold the wait up.
+	 * @return false if cancelled
+	 */
+	bool WaitTravel(uint64_t issuedNs, uint32_t percent, uint32_t mask, const std::atomic<bool> *cancel = NULL)
+	{
+		uint64_t readyNs = PredictedReadyNs(mask);
+		uint64_t at = (readyNs > issuedNs) ? issuedNs + (readyNs - issuedNs) * percent / 100 : issuedNs;
+		m_waiter.Wait([this, at, mask, cancel]() {
+			return MonotonicNs() >= at || IsReady(mask) || (cancel != NULL && cancel->load());
+		}, at);
+		return cancel == NULL || !cancel->load();
+	}
+
+	// Latest predicted completion time of the last moves of the motors in mask
+	uint64_t PredictedReadyNs(uint32_t mask)
+	{
+		uint64_t t = 0;
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			if ((mask & (1u << id)) && m_motorById[id]->GetReadyAtNs() > t)
+				t = m_motorById[id]->GetReadyAtNs();
+		return t;
+	}
+
+	// Whether every motor in mask has finished its last move
+	bool IsReady(uint32_t mask)
+	{
+		for (uint32_t id = 0; id < MOTOR_NUM; id++)
+			if ((mask & (1u << id)) && !m_motorById[id]->IsReady())
+				return false;
+		return true;
+	}
+
+	// Latest predicted completion time of any leg's last moves
+	uint64_t PredictedReadyNs()
+	{
+		uint64_t t = 0;
+		for (int i = 0; i < LEG_NUM; i++)
+			if (m_szLeg[i]->GetReadyAtNs() > t)
+				t = m_szLeg[i]->GetReadyAtNs();
+		return t;
 	}
 
 	bool IsReady()
@@ -99,46 +857,29 @@ public:
 	}
 
 	void MoveForward()
+	{
+		MotionPlan plan;
+		PlanMoveForward(plan);
+		RunPlan(plan);
+	}
+
+	void PlanMoveForward(MotionPlan &plan)
 	{
 		// Check if the last step was TRIPOD2 moving forward or TRIPOD1 moving backward
 		if ((lastStep == TRIPOD2 && lastDir == FWD) || (lastStep == TRIPOD1 && lastDir == BACK))
 		{
-			// Lift the knees of TRIPOD1 to raise its legs
-			MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Move the hips of TRIPOD1 forward and TRIPOD2 backward
-			MoveTripod(TRIPOD1, SpiderLeg::Hip, HipF_Base + 20, HipM_Base + 20, HipB_Base + 20);
-			MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base - 20, HipM_Base - 20, HipB_Base - 20);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Lower the knees of TRIPOD1 to place its legs back on the ground
-			MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Update the last step to TRIPOD1
-			lastStep = TRIPOD1;
+			// Step with TRIPOD1: lift it, swing it forward while TRIPOD2 pushes back, lower it
+			PlanGait("forward_t1", plan);
+			// Update the last step to TRIPOD1 and the last direction to FWD once it has run
+			planStepDone(plan, TRIPOD1, FWD);
 		}
 		else
 		{
-			// Lift the knees of TRIPOD2 to raise its legs
-			MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Move the hips of TRIPOD1 backward and TRIPOD2 forward
-			MoveTripod(TRIPOD1, SpiderLeg::Hip, HipF_Base - 20, HipM_Base - 20, HipB_Base - 20);
-			MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base + 20, HipM_Base + 20, HipB_Base + 20);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Lower the knees of TRIPOD2 to place its legs back on the ground
-			MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Update the last step to TRIPOD2
-			lastStep = TRIPOD2;
+			// Step with TRIPOD2: lift it, swing it forward while TRIPOD1 pushes back, lower it
+			PlanGait("forward_t2", plan);
+			// Update the last step to TRIPOD2 and the last direction to FWD once it has run
+			planStepDone(plan, TRIPOD2, FWD);
 		}
-		// Update the last direction to FWD
-		lastDir = FWD;
 	}
 
 	/**
@@ -151,50 +892,35 @@ public:
 	 * for each step to complete before proceeding to the next.
 	 *
 	 * The function also updates the lastStep and lastDir variables to keep track of
-	 * the last tripod configuration used and the last direction of movement.
+	 * the last tripod configuration used and the last direction of movement, once
+	 * the step has completed; a cancelled step leaves them unchanged.
 	 */
 	void MoveBackward()
+	{
+		MotionPlan plan;
+		PlanMoveBackward(plan);
+		RunPlan(plan);
+	}
+
+	void PlanMoveBackward(MotionPlan &plan)
 	{
 		// Check if the last step was TRIPOD1 moving backward or TRIPOD2 moving forward
 		if ((lastStep == TRIPOD1 && lastDir == BACK) || (lastStep == TRIPOD2 && lastDir == FWD))
 		{
-			// Lift the knees of TRIPOD2 to raise its legs
-			MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Move the hips of TRIPOD1 forward and TRIPOD2 backward
-			MoveTripod(TRIPOD1, SpiderLeg::Hip, HipF_Base + 20, HipM_Base + 20, HipB_Base + 20);
-			MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base - 20, HipM_Base - 20, HipB_Base - 20);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Lower the knees of TRIPOD2 to place its legs back on the ground
-			MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Update the last step to TRIPOD2
-			lastStep = TRIPOD2;
+			// Step with TRIPOD2: lift it, swing it backward while TRIPOD1 pushes forward, lower it
+			PlanGait("backward_t2", plan);
+			// Update the last step to TRIPOD2 and the last direction to BACK once it has run
+			planStepDone(plan, TRIPOD2, BACK);
 		}
 		else
 		{
-			// Lift the knees of TRIPOD1 to raise its legs
-			MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Move the hips of TRIPOD1 backward and TRIPOD2 forward
-			MoveTripod(TRIPOD1, SpiderLeg::Hip, HipF_Base - 20, HipM_Base - 20, HipB_Base - 20);
-			MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base + 20, HipM_Base + 20, HipB_Base + 20);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Lower the knees of TRIPOD1 to place its legs back on the ground
-			MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-			WaitReady(); // Wait until the movement is complete
-	
-			// Update the last step to TRIPOD1
-			lastStep = TRIPOD1;
+			// Step with TRIPOD1: lift it, swing it backward while TRIPOD2 pushes forward, lower it
+			PlanGait("backward_t1", plan);
+			// Update the last step to TRIPOD1 and the last direction to BACK once it has run
+			planStepDone(plan, TRIPOD1, BACK);
 		}
-		// Update the last direction to BACK
-		lastDir = BACK;
 	}
+
 	/**
 	 * @brief Executes a left turn movement for the spider robot.
 	 *
@@ -203,152 +929,232 @@ public:
 	 * and moving the hips forward and backward to create a rotational movement.
 	 *
 	 * The sequence of operations is as follows:
-	 * 1. Lift the knees of TRIPOD1.
-	 * 2. Lift the knees of TRIPOD2.
-	 * 3. Move the hips of TRIPOD1 forward and TRIPOD2 backward.
-	 * 4. Lower the knees of TRIPOD1.
-	 * 5. Lower the knees of TRIPOD2.
-	 * 6. Move the hips of TRIPOD1 backward and TRIPOD2 forward.
-	 * 7. Lower the knees of TRIPOD1.
-	 * 8. Lower the knees of TRIPOD2.
+	 * 1. Lift the knees of TRIPOD2.
+	 * 2. Move the hips of TRIPOD2 to rotate the body.
+	 * 3. Lower the knees of TRIPOD2.
+	 * 4. Lift the knees of TRIPOD1.
+	 * 5. Return the hips of TRIPOD2 to their original position.
+	 * 6. Lower the knees of TRIPOD1.
 	 *
-	 * Each movement is followed by a wait until the movement is complete.
-	 */
-		void TurnLeft()
-	{
-		// Lift the knees of TRIPOD2 to raise its legs
-		MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Move the hips of TRIPOD2 to create a left turn motion
-		MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base - 20, HipM_Base + 20, HipB_Base - 20);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lower the knees of TRIPOD2 to place its legs back on the ground
-		MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lift the knees of TRIPOD1 to raise the other set of legs
-		MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Return the hips of TRIPOD2 to the original position
-		MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base + 20, HipM_Base - 20, HipB_Base + 20);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lower the knees of TRIPOD1 to place its legs back on the ground
-		MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
+	 * Each movement but the last is followed by a wait until the movement is complete.
+	 */
+	void TurnLeft()
+	{
+		MotionPlan plan;
+		PlanTurnLeft(plan);
+		RunPlan(plan);
+	}
+
+	void PlanTurnLeft(MotionPlan &plan)
+	{
+		PlanGait("turn_left", plan);
 	}
 
 	/**
 	 * @brief Turns the spider robot to the right.
 	 *
-	 * This function performs a sequence of movements to turn the spider robot to the right.
-	 * It lifts the knees of both tripods, moves the hips of TRIPOD1 backward and TRIPOD2 forward
-	 * to create a rotational movement, and then lowers the knees of both tripods.
-	 *
-	 * The sequence of operations is as follows:
-	 * 1. Lift the knees of TRIPOD1.
-	 * 2. Lift the knees of TRIPOD2.
-	 * 3. Wait until the movement is complete.
-	 * 4. Move the hips of TRIPOD1 backward and TRIPOD2 forward.
-	 * 5. Wait until the movement is complete.
-	 * 6. Lower the knees of TRIPOD1.
-	 * 7. Lower the knees of TRIPOD2.
-	 * 8. Wait until the movement is complete.
+	 * This function performs the same sequence as TurnLeft() with the
+	 * hip swings of TRIPOD2 mirrored, so the body rotates the other way.
 	 */
 	void TurnRight()
 	{
-		// Lift the knees of TRIPOD2 to raise its legs
-		MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Move the hips of TRIPOD2 to create a right turn motion
-		MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base + 20, HipM_Base - 20, HipB_Base + 20);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lower the knees of TRIPOD2 to place its legs back on the ground
-		MoveTripod(TRIPOD2, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lift the knees of TRIPOD1 to raise the other set of legs
-		MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Up_Base, Knee_Up_Base, Knee_Up_Base);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Return the hips of TRIPOD2 to the original position
-		MoveTripod(TRIPOD2, SpiderLeg::Hip, HipF_Base - 20, HipM_Base + 20, HipB_Base - 20);
-		WaitReady(); // Wait until the movement is complete
-	
-		// Lower the knees of TRIPOD1 to place its legs back on the ground
-		MoveTripod(TRIPOD1, SpiderLeg::Knee, Knee_Down_Base, Knee_Down_Base, Knee_Down_Base);
+		MotionPlan plan;
+		PlanTurnRight(plan);
+		RunPlan(plan);
+	}
+
+	void PlanTurnRight(MotionPlan &plan)
+	{
+		PlanGait("turn_right", plan);
+	}
+
+	static float approach(float from, float to, float maxStep)
+	{
+		return (to > from + maxStep) ? from + maxStep : (to < from - maxStep) ? from - maxStep : to;
+	}
+
+	bool walkCommandZero() { return m_cmdVx == 0 && m_cmdVy == 0 && m_cmdYaw == 0; }
+
+	// Whether every foot is within half a millimetre of its stance position
+	bool feetAtNeutral()
+	{
+		for (int i = 0; i < LEG_NUM; i++)
+			if (fabsf(m_feet.x[i] - m_walkNeutral.x[i]) > 0.5f || fabsf(m_feet.y[i] - m_walkNeutral.y[i]) > 0.5f
+				|| fabsf(m_feet.z[i] - m_walkNeutral.z[i]) > 0.5f)
+				return false;
+		return true;
+	}
+
+	/**
+	 * Puts lifted feet down where they are, so a walk stopped mid-swing does
+	 * not leave a tripod in the air, and waits for them to land. If that
+	 * stance is out of reach (e.g. the step that stopped the walk was), all
+	 * feet go back to the walk's neutral stance instead.
+	 */
+	void landFeet()
+	{
+		bool lifted = false;
+		for (int i = 0; i < LEG_NUM; i++) {
+			if (fabsf(m_feet.z[i] - m_walkNeutral.z[i]) > 0.5f) {
+				m_feet.z[i] = m_walkNeutral.z[i];
+				lifted = true;
+			}
+		}
+		if (!lifted)
+			return;
+		if (!WritePose(m_pose)) {
+			m_feet = m_walkNeutral;
+			WritePose(m_pose);
+		}
+		WaitReady();
+	}
+
+	// Ends a walk: lands the feet, restores the servos' delays and zeroes the command
+	bool endWalk()
+	{
+		landFeet();
+		StopWalk();
+		m_walkFrame = m_walkFrames = 0;
+		SetStreamDelays((1u << MOTOR_NUM) - 1, 0);
+		return false;
+	}
+
+	/**
+	 * Appends a step recording the tripod and direction just stepped. As the
+	 * plan's last step it only runs if the plan was not cancelled, so the
+	 * next step starts from the tripod the robot is actually on.
+	 */
+	void planStepDone(MotionPlan &plan, TRIPOD_ID tripod, DIR dir)
+	{
+		AddStep(plan, [this, tripod, dir]() { lastStep = tripod; lastDir = dir; }, false);
+	}
+
+	// Appends a step issuing fn's moves, then (by default) waiting for the servos
+	static void AddStep(MotionPlan &plan, std::function<void()> fn, bool waitReady = true, uint32_t holdUs = 0,
+						uint8_t overlapPct = 0, uint32_t motorMask = (1u << MOTOR_NUM) - 1)
+	{
+		MotionStep step;
+		step.issue = fn;
+		step.waitReady = waitReady;
+		step.holdUs = holdUs;
+		step.overlapPct = overlapPct;
+		step.motorMask = motorMask;
+		plan.push_back(step);
 	}
 
 	void MoveTripod(TRIPOD_ID Tripod, SpiderLeg::JOINT_ID Joint, float AngleF, float AngleM, float AngleB)
+	{
+		StageTripod(Tripod, Joint, AngleF, AngleM, AngleB);
+		CommitMoves();
+	}
+
+	/**
+	 * Stages the joint moves of a tripod in m_frame without writing them,
+	 * so several tripods or joints can be sent with one CommitMoves().
+	 */
+	void StageTripod(TRIPOD_ID Tripod, SpiderLeg::JOINT_ID Joint, float AngleF, float AngleM, float AngleB)
 	{
 		if (Tripod == 0)
 		{
-			m_szLeg[LEG_RF]->MoveJoint(Joint, AngleF);
-			m_szLeg[LEG_LM]->MoveJoint(Joint, AngleM);
-			m_szLeg[LEG_RB]->MoveJoint(Joint, AngleB);
+			m_szLeg[LEG_RF]->StageJoint(Joint, AngleF, m_frame);
+			m_szLeg[LEG_LM]->StageJoint(Joint, AngleM, m_frame);
+			m_szLeg[LEG_RB]->StageJoint(Joint, AngleB, m_frame);
 		}
 		else
 		{
-			m_szLeg[LEG_LF]->MoveJoint(Joint, AngleF);
-			m_szLeg[LEG_RM]->MoveJoint(Joint, AngleM);
-			m_szLeg[LEG_LB]->MoveJoint(Joint, AngleB);
+			m_szLeg[LEG_LF]->StageJoint(Joint, AngleF, m_frame);
+			m_szLeg[LEG_RM]->StageJoint(Joint, AngleM, m_frame);
+			m_szLeg[LEG_LB]->StageJoint(Joint, AngleB, m_frame);
 		}
 	}
 
-	void Standup()
+	/**
+	 * Moves the feet of all six legs, in LEG_ID order, to positions in their
+	 * legs' frames (see LegIK), solving all legs in one batch and writing
+	 * all joints as one frame. Legs whose position is out of reach, or
+	 * needs a joint beyond the servos' range, do not move. Only the first
+	 * LEG_NUM lanes of feet are read.
+	 * @return a mask with bit i set if leg i moved
+	 */
+	uint32_t MoveFeetTo(const LegIK::FootBatch &feet)
 	{
-		bool bSuccess;
-
-		//// Stand up  -- Adjust Hip
-
-		float fszJoin0Angle[] = {HipF_Base, 0, HipB_Base,
-								 HipF_Base, 0, HipB_Base};
+		LegIK::FootBatch batch = feet;
+		LegIK::JointBatch joints;
+		// The padding lanes repeat the first leg so they always solve
+		for (int i = LEG_NUM; i < IK_BATCH; i++) {
+			batch.x[i] = feet.x[0];
+			batch.y[i] = feet.y[0];
+			batch.z[i] = feet.z[0];
+		}
+		LegIK::SolveBatch(batch, joints, LEG_NUM);
+		uint32_t moved = inServoRange(batch, joints);
 		for (int i = 0; i < LEG_NUM; i++)
-			m_szLeg[i]->MoveJoint(SpiderLeg::Hip, fszJoin0Angle[i]);
-
-		bSuccess = WaitReady();
-
-		//// Stand up  -- Adjust Knee ankle
-		float KneeAngle = 90;
-		const float AnkleAngle = 45.0;
-		while (bSuccess && KneeAngle >= 45.0)
 		{
-			for (int i = 0; i < LEG_NUM; i++)
-			{
-				m_szLeg[i]->MoveJoint(SpiderLeg::Knee, KneeAngle);
-				m_szLeg[i]->MoveJoint(SpiderLeg::Ankle, AnkleAngle);
-			}
-			bSuccess = WaitReady();
-			KneeAngle -= 5.0;
+			if (!(moved & (1u << i)))
+				continue;
+			m_szLeg[i]->StageJoint(SpiderLeg::Hip, joints.hip[i], m_frame);
+			m_szLeg[i]->StageJoint(SpiderLeg::Knee, joints.knee[i], m_frame);
+			m_szLeg[i]->StageJoint(SpiderLeg::Ankle, joints.ankle[i], m_frame);
 		}
+		CommitMoves();
+		return moved;
+	}
 
-		if (bSuccess)
-			Reset();
+	/**
+	 * SolveBatch only checks that the feet are within the legs' length;
+	 * this also checks that every joint stays within the servos' range, so
+	 * StreamJoint never has to clamp one. With a workspace grid loaded that
+	 * is one grid read per leg, otherwise a check of the solved angles.
+	 * @return a mask with bit i set if leg i's solution can be driven
+	 */
+	uint32_t inServoRange(const LegIK::FootBatch &feet, const LegIK::JointBatch &joints)
+	{
+		uint32_t mask = 0;
+		for (int i = 0; i < LEG_NUM; i++) {
+			bool inRange = m_workspace.IsLoaded() ? m_workspace.IsReachable(feet.x[i], feet.y[i], feet.z[i])
+						   : fabsf(joints.hip[i]) <= DEGREE_MAX && fabsf(joints.knee[i]) <= DEGREE_MAX
+								 && fabsf(joints.ankle[i]) <= DEGREE_MAX;
+			if (inRange)
+				mask |= 1u << i;
+		}
+		return mask & joints.reachable;
+	}
+
+	/**
+	 * Writes every staged joint move as one frame, timed against the PWM
+	 * period (see ServoFrame) so all the servos take it in the same period.
+	 */
+	void CommitMoves()
+	{
+		m_frame.Commit(_mmio);
+	}
+
+	void Standup()
+	{
+		MotionPlan plan;
+		PlanStandup(plan);
+		RunPlan(plan);
+	}
+
+	void PlanStandup(MotionPlan &plan)
+	{
+		//// Stand up  -- Adjust Hip, then lower the knees 90 -> 45 in 5 degree steps
+		PlanGait("standup", plan);
+		PlanReset(plan);
 	}
 
 	void Reset()
 	{
-		float fszJoin0Angle[] = {HipF_Base, 0, HipB_Base,
-								 HipF_Base, 0, HipB_Base};
+		MotionPlan plan;
+		PlanReset(plan);
+		RunPlan(plan);
+	}
 
-		////////////////////////
-		////Reset Hip Knee ankle
-		for (int i = 0; i < LEG_NUM - 3; i++)
-		{
-			m_szLeg[i]->MoveJoint(SpiderLeg::Knee, Knee_Up_Base);
-			m_szLeg[LEG_NUM - i - 1]->MoveJoint(SpiderLeg::Knee, Knee_Up_Base);
-			m_szLeg[i]->MoveJoint(SpiderLeg::Hip, fszJoin0Angle[i]);
-			m_szLeg[LEG_NUM - i - 1]->MoveJoint(SpiderLeg::Hip, fszJoin0Angle[LEG_NUM - i - 1]);
-			m_szLeg[i]->MoveJoint(SpiderLeg::Ankle, Ankle_Base);
-			m_szLeg[LEG_NUM - i - 1]->MoveJoint(SpiderLeg::Ankle, Ankle_Base);
-			WaitReady();
-			m_szLeg[i]->MoveJoint(SpiderLeg::Knee, Knee_Down_Base);
-			m_szLeg[LEG_NUM - i - 1]->MoveJoint(SpiderLeg::Knee, Knee_Down_Base);
-			WaitReady();
-		}
+	void PlanReset(MotionPlan &plan)
+	{
+		////Reset Hip Knee ankle, one pair of opposite legs at a time
+		PlanGait("reset", plan);
 	}
-};
\ No newline at end of file
+};
+
+#endif /* SPIDER_CPP_ */
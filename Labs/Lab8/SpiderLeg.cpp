@@ -1,4 +1,7 @@
-#include "ServoMotor.cpp"
+#ifndef SPIDERLEG_CPP_
+#define SPIDERLEG_CPP_
+#include "ServoFrame.cpp"
+#include "Kinematics.cpp"
 
 class SpiderLeg {
 public:
@@ -31,6 +34,45 @@ public:
 		m_szMotor[JointID]->Move((m_reverse) ? -fAngle : fAngle);
 	}
 
+	// Same as MoveJoint, but stages the move in frame, to be committed with the other servos'
+	void StageJoint(JOINT_ID JointID, float fAngle, ServoFrame &frame) {
+		frame.Stage(m_szMotor[JointID], (m_reverse) ? -fAngle : fAngle);
+	}
+
+	/**
+	 * For joints streamed frame by frame: computes a joint's duty cycle for
+	 * fAngle and records it as reached, without writing it.
+	 * @return the duty cycle, for the frame of the joint's motor
+	 */
+	uint32_t StreamJoint(JOINT_ID JointID, float fAngle) {
+		float a = (m_reverse) ? -fAngle : fAngle;
+		a = (a > DEGREE_MAX) ? DEGREE_MAX : (a < DEGREE_MIN) ? DEGREE_MIN : a;
+		uint32_t dc = m_szMotor[JointID]->CalibratedDC(a);
+		m_szMotor[JointID]->Track(dc, a);
+		return dc;
+	}
+
+	/**
+	 * Moves the joints so the foot reaches (x, y, z) in the leg's frame
+	 * (see LegIK), in mm.
+	 * @return false, without moving, if the position is out of reach
+	 */
+	bool MoveFootTo(float x, float y, float z) {
+		LegIK::Joints joints;
+		if (!LegIK::Solve(x, y, z, joints))
+			return false;
+		MoveJoint(Hip, joints.hip);
+		MoveJoint(Knee, joints.knee);
+		MoveJoint(Ankle, joints.ankle);
+		return true;
+	}
+
+	// Computes where the foot is, in the leg's frame, from the joints' current angles
+	void GetFootPosition(float &x, float &y, float &z) {
+		LegIK::Joints joints = { GetfAngle(Hip), GetfAngle(Knee), GetfAngle(Ankle) };
+		LegIK::Forward(joints, x, y, z);
+	}
+
 	bool IsReady(void){
 		bool bReady = true;
 		for(int i=0;i<JOINT_NUM && bReady;i++){
@@ -40,6 +82,18 @@ public:
 		return bReady;
 	}
 
+	ServoMotor *GetMotor(JOINT_ID JointID) { return m_szMotor[JointID]; }
+	bool IsReversed() { return m_reverse; }
+
+	// Latest predicted completion time of the joints' last moves
+	uint64_t GetReadyAtNs(void){
+		uint64_t t = 0;
+		for(int i=0;i<JOINT_NUM;i++)
+			if (m_szMotor[i]->GetReadyAtNs() > t)
+				t = m_szMotor[i]->GetReadyAtNs();
+		return t;
+	}
+
 	float GetfAngle(JOINT_ID JointID)
 	{
 		float tmp = m_szMotor[JointID]->GetfAngle();
@@ -47,3 +101,5 @@ public:
 	}
 
 };
+
+#endif /* SPIDERLEG_CPP_ */
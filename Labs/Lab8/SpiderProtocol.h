@@ -0,0 +1,148 @@
+#ifndef SPIDERPROTOCOL_H_
+#define SPIDERPROTOCOL_H_
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * The teleoperation protocol between server.cpp and client.cpp: binary
+ * messages over a local stream socket, each a MsgHeader followed by
+ * length bytes of payload. Both ends run on the same machine, so fields
+ * are in host byte order. Every request gets exactly one reply with the
+ * same seq (MSG_ACK, or MSG_PONG for MSG_PING); MSG_DONE and
+ * MSG_TELEMETRY arrive unprompted.
+ */
+
+#define PROTO_DEFAULT_SOCKET "/tmp/spider.sock"
+// Largest payload of any message
+#define PROTO_MAX_PAYLOAD 64
+
+typedef enum
+{
+	// Requests
+	MSG_PING = 1,     // any payload, echoed back in MSG_PONG
+	MSG_MOTION = 2,   // MotionMsg: queue a built-in movement
+	MSG_GAIT = 3,     // the name of a gait: queue it
+	MSG_VELOCITY = 4, // VelocityMsg: walk at a velocity, or stop walking with 0 0 0
+	MSG_CANCEL = 5,   // no payload: cancel the running and queued movements
+	MSG_SUBSCRIBE = 6, // SubscribeMsg: send telemetry periodically, or stop with 0
+	// Replies and notifications
+	MSG_ACK = 0x81,       // AckMsg
+	MSG_PONG = 0x82,      // the payload of the MSG_PING
+	MSG_DONE = 0x83,      // DoneMsg: a movement queued by this client ended
+	MSG_TELEMETRY = 0x84  // TelemetryMsg
+} MSG_TYPE;
+
+typedef enum
+{
+	PROTO_OK,
+	PROTO_ERR_BAD_REQUEST, // unknown type or malformed payload
+	PROTO_ERR_UNKNOWN,     // no such movement or gait
+	PROTO_ERR_QUEUE_FULL   // the motion queue had no room
+} PROTO_STATUS;
+
+typedef enum
+{
+	PROTO_MOTION_FORWARD,
+	PROTO_MOTION_BACKWARD,
+	PROTO_MOTION_TURN_LEFT,
+	PROTO_MOTION_TURN_RIGHT,
+	PROTO_MOTION_STANDUP,
+	PROTO_MOTION_RESET,
+	PROTO_MOTION_NUM
+} PROTO_MOTION;
+
+typedef struct
+{
+	uint8_t type;     // MSG_TYPE
+	uint8_t reserved;
+	uint16_t length;  // payload bytes, at most PROTO_MAX_PAYLOAD
+	uint32_t seq;     // chosen by the client, copied into the reply
+} MsgHeader;
+
+typedef struct
+{
+	uint32_t motion; // PROTO_MOTION
+} MotionMsg;
+
+typedef struct
+{
+	float vx;  // mm/s forwards
+	float vy;  // mm/s left
+	float yaw; // degrees/s anticlockwise
+} VelocityMsg;
+
+typedef struct
+{
+	uint32_t periodMs;
+} SubscribeMsg;
+
+typedef struct
+{
+	uint32_t status; // PROTO_STATUS
+	uint32_t jobId;  // the queued movement, for MSG_DONE; 0 if none
+} AckMsg;
+
+typedef struct
+{
+	uint32_t jobId;
+	uint32_t completed; // 0 if the movement was cancelled
+} DoneMsg;
+
+typedef struct
+{
+	uint64_t timeNs;     // CLOCK_MONOTONIC time of the sample
+	uint32_t pending;    // queued movements, including the running one
+	uint32_t walking;    // non-zero while walking at a velocity
+	float odoX, odoY;    // distance walked, mm
+	float odoYaw;        // rotation walked, degrees
+	uint32_t overruns;   // streamed frames that overran their period
+} TelemetryMsg;
+
+// Writes all of a buffer to a blocking socket; false on error
+inline bool ProtoWriteAll(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Reads exactly len bytes from a blocking socket; false on error or end of stream
+inline bool ProtoReadAll(int fd, void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+// Fills in a socket address for a path; false if the path is too long
+inline bool ProtoAddress(const char *path, struct sockaddr_un &addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, path);
+	return true;
+}
+
+#endif /* SPIDERPROTOCOL_H_ */
@@ -0,0 +1,78 @@
+#ifndef SPSCRING_CPP_
+#define SPSCRING_CPP_
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Cache line size, so the producer's and the consumer's indices do not share a line
+#define SPSC_CACHE_LINE 64
+
+/**
+ * A bounded single-producer/single-consumer ring buffer. One thread
+ * pushes and one thread consumes; neither ever takes a lock. N must be a
+ * power of two.
+ *
+ * The consumer reads the oldest element in place with Front() and
+ * releases its slot with Pop(), so an element can stay in the ring while
+ * it is being worked on. Push() and Pop() count up from 0, so the n-th
+ * element pushed (from 0) always lives in slot n % N.
+ */
+template <class T, uint32_t N>
+class SpscRing
+{
+	static_assert(N != 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+	T m_slot[N];
+	// Number of elements pushed; written by the producer only
+	alignas(SPSC_CACHE_LINE) std::atomic<uint32_t> m_head;
+	// Number of elements popped; written by the consumer only
+	alignas(SPSC_CACHE_LINE) std::atomic<uint32_t> m_tail;
+
+public:
+	SpscRing()
+	{
+		m_head = 0;
+		m_tail = 0;
+	}
+
+	/**
+	 * Producer: appends a copy of value.
+	 * @return false if the ring is full
+	 */
+	bool Push(const T &value)
+	{
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) == N)
+			return false;
+		m_slot[head & (N - 1)] = value;
+		m_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer: the oldest element, or NULL if the ring is empty
+	T *Front()
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire))
+			return NULL;
+		return &m_slot[tail & (N - 1)];
+	}
+
+	// Consumer: releases the slot of the element returned by Front()
+	void Pop() { m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+	// Elements pushed and popped so far; either thread may read them
+	uint32_t Pushed() { return m_head.load(std::memory_order_acquire); }
+	uint32_t Popped() { return m_tail.load(std::memory_order_acquire); }
+	uint32_t Size()
+	{
+		// The tail first: it never passes the head read after it
+		uint32_t tail = Popped();
+		return Pushed() - tail;
+	}
+	static uint32_t Capacity() { return N; }
+	// The slot the n-th element pushed lives in
+	static uint32_t SlotOf(uint32_t n) { return n & (N - 1); }
+};
+
+#endif /* SPSCRING_CPP_ */
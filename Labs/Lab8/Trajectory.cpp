@@ -0,0 +1,186 @@
+#ifndef TRAJECTORY_CPP_
+#define TRAJECTORY_CPP_
+#include "ServoMotor.cpp"
+#include <math.h>
+#include <string.h>
+
+// Length of one PWM frame, the period at which setpoints are streamed
+#define TRAJ_FRAME_NS (T_20MS * (1000000000ull / FREQ))
+// Default joint speed and acceleration limits, in degrees/s and degrees/s^2
+#define TRAJ_VMAX_DPS 360
+#define TRAJ_AMAX_DPS2 2400
+// Peak velocity and acceleration of the minimum-jerk S-curve over a unit move in unit time
+#define TRAJ_SCURVE_VPEAK 1.875
+#define TRAJ_SCURVE_APEAK 5.7735
+
+/**
+ * Generates duty cycle setpoints, one per PWM frame, that move a set of
+ * servos from their current duty cycles to new ones along a velocity
+ * profile. Every servo follows the same normalised profile, so all of
+ * them arrive at the same frame; the duration is chosen so the servo
+ * with the longest move stays within the speed and acceleration limits.
+ */
+class Trajectory
+{
+public:
+	typedef enum
+	{
+		PROFILE_STEP,      // Write the target once and let the PWM_DELAY ramp move the servo
+		PROFILE_TRAPEZOID, // Constant acceleration, cruise, constant deceleration
+		PROFILE_SCURVE,    // Minimum-jerk profile, with no steps in the acceleration
+		PROFILE_DEFAULT    // Use the default profile of whoever runs the move
+	} PROFILE;
+
+private:
+	PROFILE m_profile;
+	uint32_t m_from[MOTOR_NUM];
+	uint32_t m_to[MOTOR_NUM];
+	uint32_t m_mask;
+	uint32_t m_frames;
+	// Fraction of the move spent accelerating, for PROFILE_TRAPEZOID
+	double m_accelFrac;
+	double m_vmaxDps;
+	double m_amaxDps2;
+
+public:
+	Trajectory()
+	{
+		m_profile = PROFILE_STEP;
+		memset(m_from, 0, sizeof(m_from));
+		memset(m_to, 0, sizeof(m_to));
+		m_mask = 0;
+		m_frames = 0;
+		m_accelFrac = 0.5;
+		m_vmaxDps = TRAJ_VMAX_DPS;
+		m_amaxDps2 = TRAJ_AMAX_DPS2;
+	}
+
+	void SetLimits(double vmaxDps, double amaxDps2)
+	{
+		m_vmaxDps = vmaxDps;
+		m_amaxDps2 = amaxDps2;
+	}
+
+	/**
+	 * Parses a profile name: "step", "trapezoid" or "scurve".
+	 * @return false if the name is not recognised
+	 */
+	static bool ParseProfile(const char *name, PROFILE &profile)
+	{
+		if (strcmp(name, "step") == 0)
+			profile = PROFILE_STEP;
+		else if (strcmp(name, "trapezoid") == 0)
+			profile = PROFILE_TRAPEZOID;
+		else if (strcmp(name, "scurve") == 0)
+			profile = PROFILE_SCURVE;
+		else
+			return false;
+		return true;
+	}
+
+	/**
+	 * Evaluates a normalised profile: the fraction of the move covered at
+	 * the fraction tau of its duration.
+	 * @param accelFrac - fraction of the duration spent accelerating (trapezoid only, <= 0.5)
+	 */
+	static double Profile(PROFILE profile, double tau, double accelFrac)
+	{
+		if (tau <= 0)
+			return 0;
+		if (tau >= 1)
+			return 1;
+		if (profile == PROFILE_SCURVE)
+			return tau * tau * tau * (10 + tau * (-15 + tau * 6));
+		if (profile == PROFILE_TRAPEZOID) {
+			double vpeak = 1 / (1 - accelFrac);
+			if (tau < accelFrac)
+				return vpeak * tau * tau / (2 * accelFrac);
+			if (tau > 1 - accelFrac)
+				return 1 - vpeak * (1 - tau) * (1 - tau) / (2 * accelFrac);
+			return vpeak * (tau - accelFrac / 2);
+		}
+		return 1;
+	}
+
+	/**
+	 * Plans a move of the servos in motorMask from the duty cycles from[]
+	 * to to[]. A servo whose from[] is 0 (not yet enabled) jumps to its target.
+	 * @param minFrames - the move takes at least this many frames
+	 * @return the number of frames of the move
+	 */
+	uint32_t Plan(PROFILE profile, const uint32_t from[MOTOR_NUM], const uint32_t to[MOTOR_NUM],
+				  uint32_t motorMask, uint32_t minFrames = 0)
+	{
+		double ticksPerDegree = (PWM_MAX - PWM_MIN) / (double)(DEGREE_MAX - DEGREE_MIN);
+		double dmax = 0;
+		m_profile = profile;
+		m_mask = motorMask;
+		for (int i = 0; i < MOTOR_NUM; i++) {
+			m_to[i] = to[i];
+			m_from[i] = (from[i] == 0) ? to[i] : from[i];
+			double d = fabs((double)m_to[i] - (double)m_from[i]) / ticksPerDegree;
+			if ((motorMask & (1u << i)) && d > dmax)
+				dmax = d;
+		}
+
+		// Duration of the longest move within the limits, and the trapezoid's shape
+		double t = 0;
+		m_accelFrac = 0.5;
+		if (profile == PROFILE_SCURVE) {
+			t = fmax(TRAJ_SCURVE_VPEAK * dmax / m_vmaxDps, sqrt(TRAJ_SCURVE_APEAK * dmax / m_amaxDps2));
+		} else if (profile == PROFILE_TRAPEZOID && dmax > 0) {
+			double ta = m_vmaxDps / m_amaxDps2;
+			if (dmax <= m_vmaxDps * ta) {
+				t = 2 * sqrt(dmax / m_amaxDps2); // never reaches vmax
+			} else {
+				t = dmax / m_vmaxDps + ta;
+				m_accelFrac = ta / t;
+			}
+		}
+		m_frames = (uint32_t)ceil(t * 1e9 / TRAJ_FRAME_NS);
+		if (m_frames < minFrames)
+			m_frames = minFrames;
+		if (m_frames < 1)
+			m_frames = 1;
+		return m_frames;
+	}
+
+	uint32_t GetFrames() { return m_frames; }
+	uint32_t GetMask() { return m_mask; }
+
+	/**
+	 * Fills dc[] with the setpoints of the servos in the mask at a frame.
+	 * @param frame - 1 to GetFrames(); the last frame holds the targets
+	 */
+	void Sample(uint32_t frame, uint32_t dc[MOTOR_NUM])
+	{
+		double u = Profile(m_profile, frame / (double)m_frames, m_accelFrac);
+		for (int i = 0; i < MOTOR_NUM; i++)
+			if (m_mask & (1u << i))
+				dc[i] = (uint32_t)lround(m_from[i] + u * ((double)m_to[i] - (double)m_from[i]));
+	}
+
+	/**
+	 * @return the largest change of any servo's setpoint between two
+	 * frames, in duty cycle ticks
+	 */
+	uint32_t MaxFrameStep()
+	{
+		uint32_t prev[MOTOR_NUM], cur[MOTOR_NUM], step = 0;
+		memcpy(prev, m_from, sizeof(prev));
+		for (uint32_t f = 1; f <= m_frames; f++) {
+			Sample(f, cur);
+			for (int i = 0; i < MOTOR_NUM; i++) {
+				if (!(m_mask & (1u << i)))
+					continue;
+				uint32_t d = (cur[i] > prev[i]) ? cur[i] - prev[i] : prev[i] - cur[i];
+				if (d > step)
+					step = d;
+				prev[i] = cur[i];
+			}
+		}
+		return step;
+	}
+};
+
+#endif /* TRAJECTORY_CPP_ */
@@ -0,0 +1,145 @@
+#ifndef WORKPOOL_CPP_
+#define WORKPOOL_CPP_
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads sharing work by stealing. Each worker has
+ * its own queue; Submit() deals tasks out round robin, a worker takes the
+ * newest task of its own queue and, when that is empty, steals the oldest
+ * task of another's. Uneven tasks, such as simulations that end early,
+ * so keep every core busy without one shared queue for all threads to
+ * contend on.
+ *
+ * Tasks are given the index of the worker running them, e.g. to use
+ * per-worker state. Submit() and Wait() must be called from one thread.
+ */
+class WorkPool
+{
+public:
+	typedef std::function<void(unsigned worker)> Task;
+
+private:
+	typedef struct
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	} Queue;
+
+	std::vector<std::unique_ptr<Queue> > m_queues;
+	std::vector<std::thread> m_threads;
+	// Tasks queued but not yet taken, and submitted but not yet finished
+	std::atomic<size_t> m_queued;
+	std::atomic<size_t> m_unfinished;
+	unsigned m_next;
+	bool m_stop;
+	// Only for sleeping: idle workers wait for tasks, Wait() for the last one to finish
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+
+	// Takes a task: the newest of the worker's own queue, else the oldest of another's
+	bool take(unsigned self, Task &task)
+	{
+		for (unsigned i = 0; i < m_queues.size(); i++) {
+			unsigned victim = (self + i) % m_queues.size();
+			Queue &q = *m_queues[victim];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (q.tasks.empty())
+				continue;
+			if (victim == self) {
+				task = q.tasks.back();
+				q.tasks.pop_back();
+			} else {
+				task = q.tasks.front();
+				q.tasks.pop_front();
+			}
+			m_queued--;
+			return true;
+		}
+		return false;
+	}
+
+	void run(unsigned self)
+	{
+		while (true) {
+			Task task;
+			if (!take(self, task)) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [this]() { return m_stop || m_queued > 0; });
+				if (m_stop && m_queued == 0)
+					return;
+				continue;
+			}
+			task(self);
+			if (--m_unfinished == 0) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done.notify_all();
+			}
+		}
+	}
+
+public:
+	// Starts the workers; 0 starts one per CPU
+	WorkPool(unsigned threads = 0)
+	{
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+		m_queued = 0;
+		m_unfinished = 0;
+		m_next = 0;
+		m_stop = false;
+		for (unsigned i = 0; i < threads; i++)
+			m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+		for (unsigned i = 0; i < threads; i++)
+			m_threads.push_back(std::thread(&WorkPool::run, this, i));
+	}
+
+	// Finishes the submitted tasks, then stops the workers
+	~WorkPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (size_t i = 0; i < m_threads.size(); i++)
+			m_threads[i].join();
+	}
+
+	unsigned Size() { return m_threads.size(); }
+
+	void Submit(Task task)
+	{
+		m_unfinished++;
+		{
+			Queue &q = *m_queues[m_next];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.tasks.push_back(task);
+			m_queued++;
+		}
+		m_next = (m_next + 1) % m_queues.size();
+		{
+			// Taken so a worker cannot miss the wake-up between its check and its wait
+			std::lock_guard<std::mutex> lock(m_mutex);
+		}
+		m_wake.notify_one();
+	}
+
+	// Blocks until every submitted task has finished
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this]() { return m_unfinished == 0; });
+	}
+};
+
+#endif /* WORKPOOL_CPP_ */
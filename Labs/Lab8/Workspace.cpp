@@ -0,0 +1,251 @@
+#ifndef WORKSPACE_CPP_
+#define WORKSPACE_CPP_
+#include "Kinematics.cpp"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Environment variable naming the workspace grid file Spider loads, or builds if it is missing
+#define WORKSPACE_FILE_ENV "SPIDER_WORKSPACE"
+
+// The grid, in the leg's frame (mm): WS_STEP_MM cells from the minimum corner
+#define WS_STEP_MM 5
+#define WS_X_MIN 0
+#define WS_X_MAX 170
+#define WS_Y_MIN -170
+#define WS_Y_MAX 170
+#define WS_Z_MIN -170
+#define WS_Z_MAX 110
+#define WS_NX ((WS_X_MAX - WS_X_MIN) / WS_STEP_MM + 1)
+#define WS_NY ((WS_Y_MAX - WS_Y_MIN) / WS_STEP_MM + 1)
+#define WS_NZ ((WS_Z_MAX - WS_Z_MIN) / WS_STEP_MM + 1)
+
+// Joint angles are stored in 0.1 degree steps; this hip value marks an unreachable cell
+#define WS_ANGLE_SCALE 10
+#define WS_UNREACHABLE INT16_MIN
+
+#define WS_MAGIC 0x53575053 // "SPWS"
+#define WS_VERSION 1
+
+/**
+ * A precomputed grid of foot positions of one leg, recording for each
+ * cell whether its centre is reachable within the servos' [-90, 90] range
+ * and, if so, the joint solution. Planners can check a position with one
+ * array read instead of solving the IK.
+ *
+ * The grid is kept in a file that is memory-mapped read-only, so it is
+ * built once and shared by every process using the same leg geometry.
+ * The file records the geometry it was built for, and is rejected if the
+ * LEG_*_MM macros or the grid macros change.
+ */
+class LegWorkspace
+{
+public:
+	typedef struct
+	{
+		int16_t hip;
+		int16_t knee;
+		int16_t ankle;
+	} Cell;
+
+	typedef struct
+	{
+		uint32_t magic;
+		uint32_t version;
+		float coxa, femur, tibia;
+		int32_t xMin, yMin, zMin, step;
+		int32_t nx, ny, nz;
+		uint32_t reachable; // number of reachable cells
+	} Header;
+
+private:
+	void *m_map;
+	size_t m_size;
+	const Header *m_header;
+	const Cell *m_cells;
+
+	static void initHeader(Header &h)
+	{
+		memset(&h, 0, sizeof(h));
+		h.magic = WS_MAGIC;
+		h.version = WS_VERSION;
+		h.coxa = LEG_COXA_MM;
+		h.femur = LEG_FEMUR_MM;
+		h.tibia = LEG_TIBIA_MM;
+		h.xMin = WS_X_MIN;
+		h.yMin = WS_Y_MIN;
+		h.zMin = WS_Z_MIN;
+		h.step = WS_STEP_MM;
+		h.nx = WS_NX;
+		h.ny = WS_NY;
+		h.nz = WS_NZ;
+	}
+
+	// Fills the cells of z slices [z0, z1) and counts the reachable ones
+	static void buildSlices(Cell *cells, int z0, int z1, uint32_t *reachable)
+	{
+		uint32_t n = 0;
+		for (int k = z0; k < z1; k++) {
+			for (int j = 0; j < WS_NY; j++) {
+				for (int i = 0; i < WS_NX; i++) {
+					Cell &c = cells[((size_t)k * WS_NY + j) * WS_NX + i];
+					LegIK::Joints joints;
+					c.hip = WS_UNREACHABLE;
+					c.knee = c.ankle = 0;
+					if (!LegIK::Solve(WS_X_MIN + i * WS_STEP_MM, WS_Y_MIN + j * WS_STEP_MM, WS_Z_MIN + k * WS_STEP_MM, joints))
+						continue;
+					if (fabsf(joints.hip) > 90 || fabsf(joints.knee) > 90 || fabsf(joints.ankle) > 90)
+						continue;
+					c.hip = (int16_t)lroundf(joints.hip * WS_ANGLE_SCALE);
+					c.knee = (int16_t)lroundf(joints.knee * WS_ANGLE_SCALE);
+					c.ankle = (int16_t)lroundf(joints.ankle * WS_ANGLE_SCALE);
+					n++;
+				}
+			}
+		}
+		*reachable = n;
+	}
+
+public:
+	LegWorkspace()
+	{
+		m_map = MAP_FAILED;
+		m_size = 0;
+		m_header = NULL;
+		m_cells = NULL;
+	}
+
+	~LegWorkspace() { Close(); }
+
+	void Close()
+	{
+		if (m_map != MAP_FAILED)
+			munmap(m_map, m_size);
+		m_map = MAP_FAILED;
+		m_header = NULL;
+		m_cells = NULL;
+	}
+
+	bool IsLoaded() { return m_cells != NULL; }
+	const Header *GetHeader() { return m_header; }
+
+	/**
+	 * Builds the grid with the given number of threads (0: one per CPU)
+	 * and writes it to a file.
+	 * @return false if the file could not be written
+	 */
+	static bool Build(const char *path, unsigned threads = 0)
+	{
+		Header h;
+		initHeader(h);
+		size_t count = (size_t)WS_NX * WS_NY * WS_NZ;
+		std::vector<Cell> cells(count);
+		if (threads == 0)
+			threads = std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+
+		// Each thread fills a contiguous range of z slices
+		std::vector<std::thread> pool;
+		std::vector<uint32_t> reachable(threads, 0);
+		for (unsigned t = 0; t < threads; t++)
+			pool.push_back(std::thread(buildSlices, &cells[0], WS_NZ * t / threads, WS_NZ * (t + 1) / threads, &reachable[t]));
+		for (unsigned t = 0; t < threads; t++) {
+			pool[t].join();
+			h.reachable += reachable[t];
+		}
+
+		// Written under a temporary name and renamed, so readers never map a partial file
+		std::string tmp = std::string(path) + ".tmp";
+		FILE *f = fopen(tmp.c_str(), "wb");
+		if (f == NULL) {
+			fprintf(stderr, "ERROR: could not create \"%s\"...\n", tmp.c_str());
+			return false;
+		}
+		bool bSuccess = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(&cells[0], sizeof(Cell), count, f) == count;
+		bSuccess = (fclose(f) == 0) && bSuccess;
+		if (!bSuccess || rename(tmp.c_str(), path) != 0) {
+			fprintf(stderr, "ERROR: could not write \"%s\"...\n", path);
+			unlink(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Maps a grid file.
+	 * @return false if it is missing, or was built for another geometry
+	 */
+	bool Load(const char *path)
+	{
+		Close();
+		int fd = open(path, O_RDONLY);
+		if (fd == -1)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Header)) {
+			close(fd);
+			return false;
+		}
+		m_size = st.st_size;
+		m_map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (m_map == MAP_FAILED)
+			return false;
+
+		Header expected;
+		const Header *h = (const Header *)m_map;
+		initHeader(expected);
+		expected.reachable = h->reachable;
+		if (memcmp(h, &expected, sizeof(Header)) != 0
+			|| m_size != sizeof(Header) + (size_t)WS_NX * WS_NY * WS_NZ * sizeof(Cell)) {
+			fprintf(stderr, "ERROR: \"%s\" is not a workspace grid for this leg geometry...\n", path);
+			Close();
+			return false;
+		}
+		m_header = h;
+		m_cells = (const Cell *)(h + 1);
+		return true;
+	}
+
+	// Maps a grid file, building it first if it is missing or out of date
+	bool LoadOrBuild(const char *path)
+	{
+		if (Load(path))
+			return true;
+		return Build(path) && Load(path);
+	}
+
+	/**
+	 * Looks up the cell nearest to (x, y, z).
+	 * @param joints - if not NULL, receives the cell's joint solution
+	 * @return false if the cell is unreachable, outside the grid, or no grid is loaded
+	 */
+	bool Lookup(float x, float y, float z, LegIK::Joints *joints = NULL)
+	{
+		int i = (int)lroundf((x - WS_X_MIN) / WS_STEP_MM);
+		int j = (int)lroundf((y - WS_Y_MIN) / WS_STEP_MM);
+		int k = (int)lroundf((z - WS_Z_MIN) / WS_STEP_MM);
+		if (m_cells == NULL || i < 0 || i >= WS_NX || j < 0 || j >= WS_NY || k < 0 || k >= WS_NZ)
+			return false;
+		const Cell &c = m_cells[((size_t)k * WS_NY + j) * WS_NX + i];
+		if (c.hip == WS_UNREACHABLE)
+			return false;
+		if (joints != NULL) {
+			joints->hip = c.hip / (float)WS_ANGLE_SCALE;
+			joints->knee = c.knee / (float)WS_ANGLE_SCALE;
+			joints->ankle = c.ankle / (float)WS_ANGLE_SCALE;
+		}
+		return true;
+	}
+
+	bool IsReachable(float x, float y, float z) { return Lookup(x, y, z); }
+};
+
+#endif /* WORKSPACE_CPP_ */
@@ -0,0 +1,82 @@
+#include <iostream>
+#include <stdlib.h>
+#include "Workspace.cpp"
+
+using namespace std;
+
+#define BENCH_QUERIES 1000000
+
+static double SecondsSince(const struct timespec &start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Builds the workspace grid of a leg and compares looking positions up in
+ * it with solving them directly.
+ *   wsbench [grid file] [threads]
+ */
+int main(int argc, char *argv[])
+{
+	const char *path = (argc > 1) ? argv[1] : "/tmp/spider_workspace.bin";
+	unsigned threads = (argc > 2) ? atoi(argv[2]) : 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!LegWorkspace::Build(path, 1))
+		return 1;
+	double single = SecondsSince(start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!LegWorkspace::Build(path, threads))
+		return 1;
+	double multi = SecondsSince(start);
+
+	LegWorkspace ws;
+	if (!ws.Load(path))
+		return 1;
+	const LegWorkspace::Header *h = ws.GetHeader();
+	cout << "Grid: " << h->nx << " x " << h->ny << " x " << h->nz << " cells of " << h->step << " mm, "
+		 << h->reachable << " reachable, "
+		 << (sizeof(LegWorkspace::Header) + (size_t)h->nx * h->ny * h->nz * sizeof(LegWorkspace::Cell)) / 1024 << " KiB" << endl;
+	cout << "Build: " << single * 1000 << " ms on 1 thread, " << multi * 1000 << " ms on "
+		 << (threads ? threads : std::thread::hardware_concurrency()) << endl;
+
+	// Random positions inside the grid, generated up front so only the queries are timed
+	vector<float> x(BENCH_QUERIES), y(BENCH_QUERIES), z(BENCH_QUERIES);
+	srand(1);
+	for (int i = 0; i < BENCH_QUERIES; i++) {
+		x[i] = WS_X_MIN + (WS_X_MAX - WS_X_MIN) * (rand() / (float)RAND_MAX);
+		y[i] = WS_Y_MIN + (WS_Y_MAX - WS_Y_MIN) * (rand() / (float)RAND_MAX);
+		z[i] = WS_Z_MIN + (WS_Z_MAX - WS_Z_MIN) * (rand() / (float)RAND_MAX);
+	}
+
+	LegIK::Joints joints;
+	uint64_t hits = 0, solved = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_QUERIES; i++)
+		hits += ws.Lookup(x[i], y[i], z[i], &joints);
+	double lookup = SecondsSince(start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_QUERIES; i++)
+		solved += LegIK::Solve(x[i], y[i], z[i], joints) && fabsf(joints.hip) <= 90
+				  && fabsf(joints.knee) <= 90 && fabsf(joints.ankle) <= 90;
+	double ik = SecondsSince(start);
+
+	// The sum of the solutions, printed so the loop cannot be optimised out
+	float fx, fy, fz, sum = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_QUERIES; i++) {
+		LegIK::Joints j = { x[i] - 85, y[i] / 2, z[i] / 2 };
+		LegIK::Forward(j, fx, fy, fz);
+		sum += fx + fy + fz;
+	}
+	double fk = SecondsSince(start);
+
+	cout << "Lookup: " << lookup * 1e9 / BENCH_QUERIES << " ns, " << hits << " reachable" << endl;
+	cout << "IK:     " << ik * 1e9 / BENCH_QUERIES << " ns, " << solved << " reachable" << endl;
+	cout << "FK:     " << fk * 1e9 / BENCH_QUERIES << " ns, checksum " << sum << endl;
+	return 0;
+}
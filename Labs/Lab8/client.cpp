@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+#include "SpiderProtocol.h"
+
+using namespace std;
+
+static uint64_t nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Connects to the server; -1, with a message, if it is not running
+static int connectTo(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || !ProtoAddress(path, addr) || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "ERROR: could not connect to \"%s\" (%s)...\n", path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool sendMsg(int fd, uint8_t type, uint32_t seq, const void *payload = NULL, uint16_t length = 0)
+{
+	uint8_t buf[sizeof(MsgHeader) + PROTO_MAX_PAYLOAD];
+	MsgHeader h = { type, 0, length, seq };
+	memcpy(buf, &h, sizeof(h));
+	if (length > 0)
+		memcpy(buf + sizeof(h), payload, length);
+	return ProtoWriteAll(fd, buf, sizeof(h) + length);
+}
+
+// Reads the next message; payload must hold PROTO_MAX_PAYLOAD bytes
+static bool recvMsg(int fd, MsgHeader &h, uint8_t *payload)
+{
+	return ProtoReadAll(fd, &h, sizeof(h)) && h.length <= PROTO_MAX_PAYLOAD
+		&& ProtoReadAll(fd, payload, h.length);
+}
+
+static void printTelemetry(const TelemetryMsg &t)
+{
+	printf("t=%.3f s pending=%u walking=%u odometry=(%.1f mm, %.1f mm, %.1f deg) overruns=%u\n",
+		   t.timeNs / 1e9, t.pending, t.walking, t.odoX, t.odoY, t.odoYaw, t.overruns);
+}
+
+/**
+ * Sends a request and waits for its reply, printing any notifications
+ * that arrive first.
+ * @return false if the connection failed
+ */
+static bool request(int fd, uint8_t type, uint32_t seq, const void *payload, uint16_t length, AckMsg &ack)
+{
+	MsgHeader h;
+	uint8_t reply[PROTO_MAX_PAYLOAD];
+	if (!sendMsg(fd, type, seq, payload, length))
+		return false;
+	while (recvMsg(fd, h, reply)) {
+		if (h.type == MSG_ACK && h.seq == seq && h.length == sizeof(ack)) {
+			memcpy(&ack, reply, sizeof(ack));
+			return true;
+		}
+		if (h.type == MSG_TELEMETRY && h.length == sizeof(TelemetryMsg)) {
+			TelemetryMsg t;
+			memcpy(&t, reply, sizeof(t));
+			printTelemetry(t);
+		}
+	}
+	return false;
+}
+
+// Waits for a queued movement to end
+static bool waitDone(int fd, uint32_t jobId)
+{
+	MsgHeader h;
+	uint8_t reply[PROTO_MAX_PAYLOAD];
+	while (recvMsg(fd, h, reply)) {
+		DoneMsg done;
+		if (h.type != MSG_DONE || h.length != sizeof(done))
+			continue;
+		memcpy(&done, reply, sizeof(done));
+		if (done.jobId == jobId) {
+			printf("Motion %u %s\n", jobId, done.completed ? "done" : "cancelled");
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Load generation: each connection sends requests back to back, one at a
+ * time, and times each until its reply arrives. MSG_SUBSCRIBE requests
+ * stop the connection's own telemetry, so they go through the server's
+ * request handling without touching the robot.
+ */
+static void benchConnection(const char *path, uint32_t requests, uint8_t type, vector<uint64_t> *rtt, char *ok)
+{
+	int fd = connectTo(path);
+	*ok = fd != -1;
+	if (fd == -1)
+		return;
+	rtt->reserve(requests);
+	SubscribeMsg none = { 0 };
+	for (uint32_t seq = 1; seq <= requests && *ok; seq++) {
+		MsgHeader h;
+		uint8_t reply[PROTO_MAX_PAYLOAD];
+		uint64_t start = nowNs();
+		*ok = (type == MSG_PING) ? sendMsg(fd, MSG_PING, seq, &start, sizeof(start))
+								 : sendMsg(fd, MSG_SUBSCRIBE, seq, &none, sizeof(none));
+		while (*ok && (*ok = recvMsg(fd, h, reply)) && h.seq != seq)
+			;
+		if (*ok)
+			rtt->push_back(nowNs() - start);
+	}
+	close(fd);
+}
+
+static int bench(const char *path, uint32_t requests, uint32_t connections, uint8_t type)
+{
+	vector<vector<uint64_t> > rtt(connections);
+	vector<thread> threads;
+	// bool, but not vector<bool>: each thread writes its own element
+	vector<char> ok(connections);
+	uint64_t start = nowNs();
+	// The first requests % connections connections send one request more
+	for (uint32_t i = 0; i < connections; i++)
+		threads.push_back(thread(benchConnection, path, requests / connections + (i < requests % connections), type,
+								 &rtt[i], &ok[i]));
+	for (uint32_t i = 0; i < connections; i++)
+		threads[i].join();
+	double seconds = (nowNs() - start) / 1e9;
+
+	vector<uint64_t> all;
+	for (uint32_t i = 0; i < connections; i++) {
+		if (!ok[i])
+			fprintf(stderr, "ERROR: connection %u failed...\n", i);
+		all.insert(all.end(), rtt[i].begin(), rtt[i].end());
+	}
+	if (all.empty())
+		return 1;
+	sort(all.begin(), all.end());
+	double q[] = { 0.5, 0.9, 0.99, 0.999 };
+	printf("%zu requests over %u connections in %.3f s: %.0f requests/s\n", all.size(), connections, seconds,
+		   all.size() / seconds);
+	printf("RTT us: min %.1f", all.front() / 1e3);
+	for (size_t i = 0; i < sizeof(q) / sizeof(q[0]); i++)
+		printf(", p%g %.1f", q[i] * 100, all[(size_t)(q[i] * (all.size() - 1))] / 1e3);
+	printf(", max %.1f\n", all.back() / 1e3);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	cerr << "Usage: " << name << " [-s <socket>] <command>" << endl
+		 << "  f | b | l | r | standup | reset   run a movement and wait for it to end" << endl
+		 << "  g <gait>                           run a named gait and wait for it to end" << endl
+		 << "  v <vx> <vy> <yaw>                  walk at a velocity (v 0 0 0 stops)" << endl
+		 << "  c                                  cancel the running and queued movements" << endl
+		 << "  watch <ms> [samples]               print telemetry every ms milliseconds" << endl
+		 << "  bench [requests] [connections] [ping | subscribe]" << endl
+		 << "                                     measure round-trip latency under load" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = PROTO_DEFAULT_SOCKET;
+	int arg = 1;
+	if (argc > 2 && string(argv[1]) == "-s") {
+		path = argv[2];
+		arg = 3;
+	}
+	if (arg >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	string cmd = argv[arg++];
+	int nargs = argc - arg;
+	char **args = argv + arg;
+
+	if (cmd == "bench") {
+		uint32_t requests = nargs > 0 ? strtoul(args[0], NULL, 0) : 10000;
+		uint32_t connections = nargs > 1 ? strtoul(args[1], NULL, 0) : 4;
+		uint8_t type = (nargs > 2 && string(args[2]) == "subscribe") ? MSG_SUBSCRIBE : MSG_PING;
+		if (connections == 0 || requests < connections) {
+			usage(argv[0]);
+			return 1;
+		}
+		return bench(path, requests, connections, type);
+	}
+
+	int fd = connectTo(path);
+	if (fd == -1)
+		return 1;
+	const char *motions[PROTO_MOTION_NUM] = { "f", "b", "l", "r", "standup", "reset" };
+	AckMsg ack = { PROTO_ERR_BAD_REQUEST, 0 };
+	bool ok = false, wait = false;
+	for (uint32_t m = 0; m < PROTO_MOTION_NUM; m++) {
+		if (cmd == motions[m]) {
+			MotionMsg msg = { m };
+			ok = request(fd, MSG_MOTION, 1, &msg, sizeof(msg), ack);
+			wait = true;
+		}
+	}
+	if (cmd == "g" && nargs == 1 && strlen(args[0]) <= PROTO_MAX_PAYLOAD) {
+		ok = request(fd, MSG_GAIT, 1, args[0], strlen(args[0]), ack);
+		wait = true;
+	} else if (cmd == "v" && nargs == 3) {
+		VelocityMsg msg = { strtof(args[0], NULL), strtof(args[1], NULL), strtof(args[2], NULL) };
+		ok = request(fd, MSG_VELOCITY, 1, &msg, sizeof(msg), ack);
+	} else if (cmd == "c") {
+		ok = request(fd, MSG_CANCEL, 1, NULL, 0, ack);
+	} else if (cmd == "watch" && nargs >= 1) {
+		SubscribeMsg msg = { (uint32_t)strtoul(args[0], NULL, 0) };
+		uint32_t samples = nargs > 1 ? strtoul(args[1], NULL, 0) : 0;
+		ok = request(fd, MSG_SUBSCRIBE, 1, &msg, sizeof(msg), ack);
+		MsgHeader h;
+		uint8_t reply[PROTO_MAX_PAYLOAD];
+		for (uint32_t n = 0; ok && ack.status == PROTO_OK && (samples == 0 || n < samples) && recvMsg(fd, h, reply);) {
+			if (h.type == MSG_TELEMETRY && h.length == sizeof(TelemetryMsg)) {
+				TelemetryMsg t;
+				memcpy(&t, reply, sizeof(t));
+				printTelemetry(t);
+				n++;
+			}
+		}
+	} else if (!wait) {
+		usage(argv[0]);
+		close(fd);
+		return 1;
+	}
+
+	const char *status[] = { "ok", "bad request", "unknown movement or gait", "motion queue full" };
+	if (!ok) {
+		fprintf(stderr, "ERROR: connection to the server lost...\n");
+	} else if (ack.status != PROTO_OK) {
+		fprintf(stderr, "ERROR: %s...\n", ack.status < 4 ? status[ack.status] : "failed");
+		ok = false;
+	} else if (wait) {
+		printf("Motion %u queued\n", ack.jobId);
+		ok = waitDone(fd, ack.jobId);
+	}
+	close(fd);
+	return ok ? 0 : 1;
+}
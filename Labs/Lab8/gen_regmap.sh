@@ -0,0 +1,174 @@
+#!/bin/sh
+# Generates RegMap.h, the typed register map, from the *_BASE/*_SPAN macros
+# of an hps_0.h exported by the FPGA design:
+#   sh gen_regmap.sh hps_0.h > RegMap.h
+# The Makefile regenerates it whenever hps_0.h changes.
+
+if [ $# -ne 1 ] || [ ! -r "$1" ]; then
+	echo "usage: $0 hps_0.h > RegMap.h" >&2
+	exit 1
+fi
+
+awk -v src="$(basename "$1")" '
+# hps_0.h gives addresses in hex; POSIX awk has no strtonum
+function num(s,   i, v) {
+	if (s !~ /^0[xX]/)
+		return s + 0
+	s = tolower(substr(s, 3))
+	v = 0
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+
+$1 == "#define" && $2 ~ /_BASE$/ {
+	name = substr($2, 1, length($2) - 5)
+	if (!(name in base))
+		names[n++] = name
+	base[name] = num($3)
+}
+$1 == "#define" && $2 ~ /_SPAN$/ {
+	span[substr($2, 1, length($2) - 5)] = num($3)
+}
+
+END {
+	# Devices are the names with both a base and a span; PWMn is the core of servo n
+	for (i = 0; i < n; i++) {
+		if (!(names[i] in span))
+			continue
+		dev[ndev++] = names[i]
+		if (names[i] ~ /^PWM[0-9]+$/)
+			pwm[substr(names[i], 4) + 0] = names[i]
+	}
+	for (npwm = 0; npwm in pwm; npwm++)
+		;
+	if (npwm == 0) {
+		print "ERROR: " src " defines no PWM cores..." > "/dev/stderr"
+		exit 1
+	}
+	for (i = 0; i < ndev; i++) {
+		if (dev[i] ~ /^PWM[0-9]+$/ && substr(dev[i], 4) + 0 >= npwm) {
+			print "ERROR: " src " has " dev[i] " but no PWM" npwm "..." > "/dev/stderr"
+			exit 1
+		}
+	}
+	# Every PWM core has the same registers, so they must have the same span
+	for (i = 1; i < npwm; i++) {
+		if (span[pwm[i]] != span[pwm[0]]) {
+			print "ERROR: " src " gives " pwm[i] " a different span from " pwm[0] "..." > "/dev/stderr"
+			exit 1
+		}
+	}
+	# Servo IDs by ascending register address, and the extent of all devices
+	for (i = 0; i < npwm; i++) {
+		for (j = i; j > 0 && base[pwm[order[j - 1]]] > base[pwm[i]]; j--)
+			order[j] = order[j - 1]
+		order[j] = i
+	}
+	lo = base[dev[0]]
+	hi = base[dev[0]] + span[dev[0]]
+	for (i = 1; i < ndev; i++) {
+		if (base[dev[i]] < lo)
+			lo = base[dev[i]]
+		if (base[dev[i]] + span[dev[i]] > hi)
+			hi = base[dev[i]] + span[dev[i]]
+	}
+
+	print "// Generated from " src " by gen_regmap.sh; do not edit."
+	print "#ifndef REGMAP_H_"
+	print "#define REGMAP_H_"
+	print "#include <stdint.h>"
+	print ""
+	print "/**"
+	print " * The devices of the lightweight bridge as types, so a register whose"
+	print " * device and index are known when compiling has a constant address (see"
+	print " * MMap::Write and MMap::Read). Offsets are from PWM_PHYS_START."
+	print " */"
+	print "namespace RegMap"
+	print "{"
+	print ""
+	print "// How a register may be accessed, checked by MMap::Write and MMap::Read"
+	print "typedef enum { RW, RO, WO } ACCESS;"
+	print ""
+	print "template <uint32_t Base, uint32_t Span>"
+	print "struct Device"
+	print "{"
+	print "\tstatic constexpr uint32_t BASE = Base;"
+	print "\tstatic constexpr uint32_t SPAN = Span;"
+	print "};"
+	print ""
+	print "// The 32-bit register at Index of device D"
+	print "template <typename D, uint32_t Index, ACCESS Access = RW>"
+	print "struct Reg"
+	print "{"
+	print "\tstatic_assert(Index < D::SPAN / 4, \"register outside its device\");"
+	print "\ttypedef D Dev;"
+	print "\tstatic constexpr uint32_t INDEX = Index;"
+	print "\tstatic constexpr uint32_t OFFSET = D::BASE + Index * 4;"
+	print "\tstatic constexpr bool READABLE = Access != WO;"
+	print "\tstatic constexpr bool WRITABLE = Access != RO;"
+	print "};"
+	print ""
+	print "// The registers of PWM core D; register 2 is PWM_DELAY when written and PWM_READY when read"
+	print "template <typename D>"
+	print "struct PwmRegs"
+	print "{"
+	print "\ttypedef Reg<D, 0> Period;"
+	print "\ttypedef Reg<D, 1> Dc;"
+	print "\ttypedef Reg<D, 2, WO> Delay;"
+	print "\ttypedef Reg<D, 2, RO> Ready;"
+	print "\ttypedef Reg<D, 3> Abort;"
+	print "};"
+	print ""
+	print "// The PWM core of servo Id"
+	print "template <uint32_t Base, uint32_t Span, uint32_t Id>"
+	print "struct PwmDevice : Device<Base, Span>, PwmRegs<PwmDevice<Base, Span, Id> >"
+	print "{"
+	print "\tstatic constexpr uint32_t ID = Id;"
+	print "};"
+	print ""
+	print "constexpr uint32_t PWM_NUM = " npwm ";"
+	print "constexpr uint32_t PWM_SPAN = " span[pwm[0]] ";"
+	print ""
+	print "// The PWM core of a servo chosen at run time, e.g. PwmCore::Dc; offsets are within the core"
+	print "struct PwmCore : Device<0, PWM_SPAN>, PwmRegs<PwmCore>"
+	print "{"
+	print "};"
+	print ""
+	print "// PWM core by servo ID, e.g. Pwm<3>::Dc"
+	print "template <uint32_t Id>"
+	print "struct Pwm"
+	print "{"
+	print "\tstatic_assert(Id < PWM_NUM, \"no such PWM core in " src "\");"
+	print "};"
+	for (i = 0; i < npwm; i++)
+		printf "template <> struct Pwm<%d> : PwmDevice<0x%x, %d, %d> {};\n", i, base[pwm[i]], span[pwm[i]], i
+	print ""
+	print "// Other devices"
+	for (i = 0; i < ndev; i++)
+		if (dev[i] !~ /^PWM[0-9]+$/)
+			printf "typedef Device<0x%x, %d> %s;\n", base[dev[i]], span[dev[i]], dev[i]
+	print ""
+	print "// Device offsets of the PWM cores by servo ID, for IDs known only at run time"
+	print "constexpr uint32_t PWM_BASES[PWM_NUM] = {"
+	for (i = 0; i < npwm; i++)
+		printf "\t0x%x,\n", base[pwm[i]]
+	print "};"
+	print ""
+	print "// Servo IDs by ascending register address"
+	print "constexpr uint32_t PWM_ORDER[PWM_NUM] = {"
+	line = "\t"
+	for (i = 0; i < npwm; i++)
+		line = line order[i] ((i < npwm - 1) ? ", " : ",")
+	print line
+	print "};"
+	print ""
+	print "// The extent of all devices: the lowest offset, and the end of the highest"
+	printf "constexpr uint32_t DEVICES_START = 0x%x;\n", lo
+	printf "constexpr uint32_t DEVICES_END = 0x%x;\n", hi
+	print ""
+	print "} // namespace RegMap"
+	print ""
+	print "#endif /* REGMAP_H_ */"
+}
+' "$1"
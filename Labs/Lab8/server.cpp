@@ -0,0 +1,475 @@
+#include <iostream>
+#include <map>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "MotionScheduler.cpp"
+#include "SpiderProtocol.h"
+
+using namespace std;
+
+// Granularity of the telemetry subscriptions
+#define SERVER_TICK_MS 10
+// A client whose unsent replies grow beyond this is too slow and is dropped
+#define SERVER_MAX_OUTPUT (64 * 1024)
+// Completed movements waiting to be reported by the event loop (a power of two)
+#define SERVER_DONE_QUEUE 256
+#define SERVER_MAX_EVENTS 64
+
+/**
+ * Serves the teleoperation protocol (see SpiderProtocol.h) to any number
+ * of local clients from one thread, with an epoll event loop. That thread
+ * is the only one submitting to the MotionScheduler; movements that end
+ * on the control thread are handed back through a lock-free ring and an
+ * eventfd, and reported to the client that queued them.
+ */
+class TeleopServer
+{
+	typedef struct
+	{
+		int fd;
+		// Distinguishes connections that reuse a closed client's fd
+		uint32_t serial;
+		std::vector<uint8_t> in;
+		std::vector<uint8_t> out;
+		// Whether EPOLLOUT is watched, while out is not empty
+		bool writing;
+		uint32_t periodMs;
+		uint64_t nextTelemetryNs;
+	} Client;
+
+	typedef struct
+	{
+		int fd;
+		uint32_t serial;
+		uint32_t jobId;
+		bool completed;
+	} Done;
+
+	Spider *m_spider;
+	MotionScheduler *m_scheduler;
+	std::string m_path;
+	int m_epoll, m_listen, m_timer, m_signal, m_event;
+	std::map<int, Client> m_clients;
+	uint32_t m_nextSerial;
+	// Filled by the control thread, drained by the event loop
+	SpscRing<Done, SERVER_DONE_QUEUE> m_done;
+	// Movement reports lost because m_done was full
+	std::atomic<uint64_t> m_doneDropped;
+	bool m_stop;
+
+	bool watch(int fd, uint32_t events, int op = EPOLL_CTL_ADD)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = fd;
+		return epoll_ctl(m_epoll, op, fd, &ev) == 0;
+	}
+
+	void closeClient(int fd)
+	{
+		epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+		close(fd);
+		m_clients.erase(fd);
+	}
+
+	// Queues a message for a client and sends as much as the socket takes
+	void send(Client &c, uint8_t type, uint32_t seq, const void *payload, uint16_t length)
+	{
+		MsgHeader h = { type, 0, length, seq };
+		const uint8_t *p = (const uint8_t *)payload;
+		c.out.insert(c.out.end(), (const uint8_t *)&h, (const uint8_t *)(&h + 1));
+		c.out.insert(c.out.end(), p, p + length);
+		flush(c);
+	}
+
+	void ack(Client &c, uint32_t seq, uint32_t status, uint32_t jobId = 0)
+	{
+		AckMsg a = { status, jobId };
+		send(c, MSG_ACK, seq, &a, sizeof(a));
+	}
+
+	/**
+	 * Writes a client's pending output, waiting for EPOLLOUT if the socket is full.
+	 * @return false if the client was dropped
+	 */
+	bool flush(Client &c)
+	{
+		size_t sent = 0;
+		while (sent < c.out.size()) {
+			ssize_t n = ::send(c.fd, &c.out[sent], c.out.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (n <= 0) {
+				closeClient(c.fd);
+				return false;
+			}
+			sent += n;
+		}
+		c.out.erase(c.out.begin(), c.out.begin() + sent);
+		if (c.out.size() > SERVER_MAX_OUTPUT) {
+			fprintf(stderr, "ERROR: client %u is not reading, dropping it...\n", c.serial);
+			closeClient(c.fd);
+			return false;
+		}
+		if (c.out.empty() == c.writing) {
+			c.writing = !c.out.empty();
+			watch(c.fd, EPOLLIN | (c.writing ? EPOLLOUT : 0), EPOLL_CTL_MOD);
+		}
+		return true;
+	}
+
+	// A completion callback reporting the movement to the client that queued it
+	MotionScheduler::Callback notify(const Client &c)
+	{
+		int fd = c.fd, event = m_event;
+		uint32_t serial = c.serial;
+		SpscRing<Done, SERVER_DONE_QUEUE> *done = &m_done;
+		std::atomic<uint64_t> *dropped = &m_doneDropped;
+		return [fd, serial, event, done, dropped](MotionScheduler::JobId id, bool completed) {
+			Done d = { fd, serial, (uint32_t)id, completed };
+			uint64_t one = 1;
+			if (!done->Push(d)) {
+				(*dropped)++;
+				fprintf(stderr, "ERROR: report queue full, client %u is not told movement %u ended...\n", serial,
+						(uint32_t)id);
+			} else if (write(event, &one, sizeof(one)) != sizeof(one)) {
+				fprintf(stderr, "ERROR: could not signal a finished movement...\n");
+			}
+		};
+	}
+
+	void submitted(Client &c, uint32_t seq, MotionScheduler::JobId id)
+	{
+		ack(c, seq, id == 0 ? PROTO_ERR_QUEUE_FULL : PROTO_OK, (uint32_t)id);
+	}
+
+	void handle(Client &c, const MsgHeader &h, const uint8_t *payload)
+	{
+		static const Spider::MOTION_ID motions[PROTO_MOTION_NUM] = {
+			Spider::MOTION_FORWARD, Spider::MOTION_BACKWARD, Spider::MOTION_TURN_LEFT,
+			Spider::MOTION_TURN_RIGHT, Spider::MOTION_STANDUP, Spider::MOTION_RESET };
+		switch (h.type)
+		{
+		case MSG_PING:
+			send(c, MSG_PONG, h.seq, payload, h.length);
+			break;
+		case MSG_MOTION:
+		{
+			MotionMsg m;
+			if (h.length != sizeof(m))
+				return ack(c, h.seq, PROTO_ERR_BAD_REQUEST);
+			memcpy(&m, payload, sizeof(m));
+			if (m.motion >= PROTO_MOTION_NUM)
+				return ack(c, h.seq, PROTO_ERR_UNKNOWN);
+			submitted(c, h.seq, m_scheduler->Submit(motions[m.motion], notify(c)));
+			break;
+		}
+		case MSG_GAIT:
+		{
+			std::string name((const char *)payload, h.length);
+			if (m_spider->GetGaits()->Find(name) == NULL)
+				return ack(c, h.seq, PROTO_ERR_UNKNOWN);
+			submitted(c, h.seq, m_scheduler->Submit(name, notify(c)));
+			break;
+		}
+		case MSG_VELOCITY:
+		{
+			VelocityMsg v;
+			if (h.length != sizeof(v))
+				return ack(c, h.seq, PROTO_ERR_BAD_REQUEST);
+			memcpy(&v, payload, sizeof(v));
+			if (!m_spider->SetVelocity(v.vx, v.vy, v.yaw))
+				return ack(c, h.seq, PROTO_OK); // the running walk takes the new velocity
+			if (v.vx == 0 && v.vy == 0 && v.yaw == 0) {
+				m_spider->StopWalk(); // not walking, and nothing to walk for
+				return ack(c, h.seq, PROTO_OK);
+			}
+			Spider *spider = m_spider;
+			MotionScheduler::Callback done = notify(c);
+			MotionScheduler::JobId id = m_scheduler->Submit([spider](MotionPlan &plan) { spider->PlanWalk(plan); },
+				[spider, done](MotionScheduler::JobId id, bool completed) {
+					if (!completed)
+						spider->StopWalk();
+					done(id, completed);
+				});
+			// Not queued, so no walk will clear the flag SetVelocity set
+			if (id == 0)
+				spider->StopWalk();
+			submitted(c, h.seq, id);
+			break;
+		}
+		case MSG_CANCEL:
+			m_scheduler->CancelAll();
+			ack(c, h.seq, PROTO_OK);
+			break;
+		case MSG_SUBSCRIBE:
+		{
+			SubscribeMsg s;
+			if (h.length != sizeof(s))
+				return ack(c, h.seq, PROTO_ERR_BAD_REQUEST);
+			memcpy(&s, payload, sizeof(s));
+			c.periodMs = s.periodMs;
+			c.nextTelemetryNs = MonotonicNs();
+			ack(c, h.seq, PROTO_OK);
+			break;
+		}
+		default:
+			ack(c, h.seq, PROTO_ERR_BAD_REQUEST);
+			break;
+		}
+	}
+
+	void readClient(int fd)
+	{
+		Client &c = m_clients[fd];
+		uint8_t buf[4096];
+		while (true) {
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (n <= 0) {
+				closeClient(fd);
+				return;
+			}
+			c.in.insert(c.in.end(), buf, buf + n);
+		}
+
+		// Handle every complete message; a reply may drop the client
+		size_t used = 0;
+		while (c.in.size() - used >= sizeof(MsgHeader)) {
+			MsgHeader h;
+			memcpy(&h, &c.in[used], sizeof(h));
+			if (h.length > PROTO_MAX_PAYLOAD) {
+				fprintf(stderr, "ERROR: client %u sent an oversized message, dropping it...\n", c.serial);
+				closeClient(fd);
+				return;
+			}
+			if (c.in.size() - used < sizeof(h) + h.length)
+				break;
+			handle(c, h, c.in.data() + used + sizeof(h));
+			used += sizeof(h) + h.length;
+			if (m_clients.count(fd) == 0)
+				return;
+		}
+		c.in.erase(c.in.begin(), c.in.begin() + used);
+	}
+
+	void accept()
+	{
+		while (true) {
+			int fd = accept4(m_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+				return;
+			Client &c = m_clients[fd];
+			c.fd = fd;
+			c.serial = m_nextSerial++;
+			c.in.clear();
+			c.out.clear();
+			c.writing = false;
+			c.periodMs = 0;
+			c.nextTelemetryNs = 0;
+			if (!watch(fd, EPOLLIN))
+				closeClient(fd);
+		}
+	}
+
+	void sendTelemetry()
+	{
+		uint64_t timerTicks;
+		if (read(m_timer, &timerTicks, sizeof(timerTicks)) != sizeof(timerTicks))
+			return;
+		uint64_t now = MonotonicNs();
+		TelemetryMsg t;
+		memset(&t, 0, sizeof(t));
+		t.timeNs = now;
+		t.pending = m_scheduler->Pending();
+		t.walking = m_spider->IsWalking();
+		m_spider->GetOdometry(t.odoX, t.odoY, t.odoYaw);
+		t.overruns = m_spider->GetLoopStats()->GetOverruns();
+
+		std::vector<int> due;
+		for (std::map<int, Client>::iterator it = m_clients.begin(); it != m_clients.end(); ++it)
+			if (it->second.periodMs != 0 && now >= it->second.nextTelemetryNs)
+				due.push_back(it->first);
+		for (size_t i = 0; i < due.size(); i++) {
+			Client &c = m_clients[due[i]];
+			c.nextTelemetryNs = now + c.periodMs * 1000000ull;
+			send(c, MSG_TELEMETRY, 0, &t, sizeof(t));
+		}
+	}
+
+	void reportDone()
+	{
+		uint64_t count;
+		if (read(m_event, &count, sizeof(count)) != sizeof(count))
+			return;
+		for (Done *d = m_done.Front(); d != NULL; d = m_done.Front()) {
+			std::map<int, Client>::iterator it = m_clients.find(d->fd);
+			if (it != m_clients.end() && it->second.serial == d->serial) {
+				DoneMsg msg = { d->jobId, d->completed };
+				send(it->second, MSG_DONE, 0, &msg, sizeof(msg));
+			}
+			m_done.Pop();
+		}
+	}
+
+public:
+	// Movement reports lost because too many movements ended before the event loop reported them
+	uint64_t GetDroppedReports() { return m_doneDropped; }
+
+	TeleopServer(Spider *spider, MotionScheduler *scheduler)
+	{
+		m_spider = spider;
+		m_scheduler = scheduler;
+		m_epoll = m_listen = m_timer = m_signal = m_event = -1;
+		m_nextSerial = 1;
+		m_doneDropped = 0;
+		m_stop = false;
+	}
+
+	~TeleopServer()
+	{
+		while (!m_clients.empty())
+			closeClient(m_clients.begin()->first);
+		int fds[] = { m_listen, m_timer, m_signal, m_event, m_epoll };
+		for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+			if (fds[i] != -1)
+				close(fds[i]);
+		if (!m_path.empty())
+			unlink(m_path.c_str());
+	}
+
+	/**
+	 * Blocks SIGINT and SIGTERM, so Run() can handle them. Call before
+	 * starting any thread, which would otherwise be killed by them.
+	 */
+	static void BlockSignals(sigset_t &signals)
+	{
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	}
+
+	/**
+	 * Listens on a Unix-domain socket, replacing a stale one, and sets up
+	 * the event loop.
+	 * @return false, with a message, if anything could not be set up
+	 */
+	bool Open(const char *path)
+	{
+		struct sockaddr_un addr;
+		if (!ProtoAddress(path, addr)) {
+			fprintf(stderr, "ERROR: socket path \"%s\" is too long...\n", path);
+			return false;
+		}
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		unlink(path);
+		if (m_epoll == -1 || m_listen == -1 || bind(m_listen, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(m_listen, SOMAXCONN) != 0) {
+			fprintf(stderr, "ERROR: could not listen on \"%s\" (%s)...\n", path, strerror(errno));
+			return false;
+		}
+		m_path = path;
+
+		struct itimerspec period;
+		memset(&period, 0, sizeof(period));
+		period.it_interval.tv_nsec = period.it_value.tv_nsec = SERVER_TICK_MS * 1000000;
+		m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		m_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		sigset_t signals;
+		BlockSignals(signals);
+		m_signal = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (m_timer == -1 || m_event == -1 || m_signal == -1 || timerfd_settime(m_timer, 0, &period, NULL) != 0
+			|| !watch(m_listen, EPOLLIN) || !watch(m_timer, EPOLLIN) || !watch(m_event, EPOLLIN)
+			|| !watch(m_signal, EPOLLIN)) {
+			fprintf(stderr, "ERROR: could not set up the event loop (%s)...\n", strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	// Serves clients until SIGINT or SIGTERM
+	void Run()
+	{
+		struct epoll_event events[SERVER_MAX_EVENTS];
+		while (!m_stop) {
+			int n = epoll_wait(m_epoll, events, SERVER_MAX_EVENTS, -1);
+			if (n < 0 && errno != EINTR) {
+				fprintf(stderr, "ERROR: epoll_wait failed (%s)...\n", strerror(errno));
+				return;
+			}
+			for (int i = 0; i < n; i++) {
+				int fd = events[i].data.fd;
+				if (fd == m_listen) {
+					accept();
+				} else if (fd == m_timer) {
+					sendTelemetry();
+				} else if (fd == m_event) {
+					reportDone();
+				} else if (fd == m_signal) {
+					m_stop = true;
+				} else if (m_clients.count(fd) != 0) {
+					if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+						closeClient(fd);
+						continue;
+					}
+					// A failed flush has closed the client; otherwise read what arrived with it
+					if (events[i].events & EPOLLOUT && !flush(m_clients[fd]))
+						continue;
+					if (events[i].events & EPOLLIN)
+						readClient(fd);
+				}
+			}
+		}
+	}
+};
+
+int main(int argc, char *argv[])
+{
+	const char *path = PROTO_DEFAULT_SOCKET;
+	sigset_t signals;
+	TeleopServer::BlockSignals(signals);
+	Spider Spider;
+
+	// -s <path> listens on another socket; -g and -c are as for ./spider
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (string(argv[i]) == "-s")
+			path = argv[i + 1];
+		else if (string(argv[i]) == "-g")
+			Spider.LoadGaits(argv[i + 1]);
+		else if (string(argv[i]) == "-c")
+			Spider.LoadCalibration(argv[i + 1]);
+		else
+			cerr << "Usage: " << argv[0] << " [-s <socket>] [-g <gait file>] [-c <calibration file>]" << endl;
+	}
+
+	cout << "Spider Init" << endl;
+	Spider.Init();
+	cout << "Spider Standup" << endl;
+	Spider.Standup();
+
+	MotionScheduler Scheduler(&Spider);
+	TeleopServer Server(&Spider, &Scheduler);
+	if (!Server.Open(path))
+		return 1;
+	cout << "Listening on " << path << endl;
+	Server.Run();
+
+	cout << "Stopping" << endl;
+	if (Server.GetDroppedReports() != 0)
+		cout << "Movement reports dropped: " << Server.GetDroppedReports() << endl;
+	Scheduler.CancelAll();
+	Scheduler.WaitIdle();
+	return 0;
+}